@@ -47,15 +47,29 @@
 #include <errno.h>
 #include <cctype>
 #include <stdint.h>
+#include <climits>
+#include <cstdarg>
 
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <set>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+	#include <immintrin.h>
+  #ifdef _MSC_VER
+	#include <intrin.h>
+  #endif
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+#endif
 
 #ifdef _WIN32
 	#include <io.h>
 	#include <conio.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
 	#include <windows.h>
   #ifndef STDIN_FILENO
 	#define STDIN_FILENO 			_fileno(stdin)
@@ -64,7 +78,6 @@
 	#define isatty					_isatty
 	#define strcasecmp				_stricmp
 	#define strncasecmp				_strnicmp
-	static int s_crossline_win = 1;
 #else
 	#include <unistd.h>
 	#include <termios.h>
@@ -72,7 +85,9 @@
 	#include <signal.h>
 	#include <sys/ioctl.h>
 	#include <sys/stat.h>
-	static int s_crossline_win = 0;
+	#include <sys/mman.h>
+	#include <sys/file.h>
+	#include <poll.h>
 #endif
 
 #include "crossline.h"
@@ -83,6 +98,8 @@
 
 // Default word delimiters for move and cut
 #define CROSS_DFT_DELIMITER			" !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~"
+// Time (ms) to wait for the rest of an escape sequence before Esc is taken on its own
+#define CROSS_ESC_TIMEOUT			100
 
 // Make control-characters readable
 #define CTRL_KEY(key)				(key - 0x40)
@@ -103,6 +120,8 @@ enum {
 	KEY_ESC			= 27,	// Escapce
 	KEY_DEL2		= 127,  // It's treaded as Backspace is Linux
 	KEY_DEBUG		= 30,	// Ctrl-^ Enter keyboard debug mode
+	KEY_RESIZE		= -2,	// Not a key, the terminal has been resized
+	KEY_WAKE		= -3,	// Not a key, another thread has something for the edit loop (TerminalClass::Wake)
 
 #ifdef _WIN32 // Windows
 
@@ -187,76 +206,810 @@ enum {
 	KEY_F3_2		= ESC_KEY4('[', 'C'),	 // linux Esc[[C: Clear history (need confirm).
 	KEY_F4_2		= ESC_KEY4('[', 'D'),	 // linux Esc[[D: Search history with current input.
 
+	KEY_PASTE_BEGIN	= ESC_KEY6('2','0','0'), // xterm Esc[200~: Start of bracketed paste.
+	KEY_PASTE_END	= ESC_KEY6('2','0','1'), // xterm Esc[201~: End of bracketed paste.
+
 #endif
 };
 
 /*****************************************************************************/
 
-// class for handling low level functions
+// CrosslineStats as relaxed atomics, so the completion worker can record too and readers
+// don't need a lock.  Nothing is timed unless enabled
+struct CrosslineStatsData {
+	struct Histogram {
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> total{0};
+		std::atomic<uint64_t> max{0};
+		std::atomic<uint64_t> buckets[CrosslineStats::Buckets];
+
+		Histogram() { Reset(); }
+		void Add(const uint64_t v);
+		void Get(CrosslineStats::Histogram &h) const;
+		void Reset();
+	};
+
+	std::atomic<bool> enabled{false};
+	Histogram keyLatency;
+	Histogram frameBytes;
+	std::atomic<uint64_t> frames{0};
+	std::atomic<uint64_t> writes{0};
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> refresh[4];   // by Crossline::UpdateType
+	Histogram findItems;
+	Histogram historyDump;
+	Histogram historyLoad;
+	Histogram historySave;
+	int dumpSec = 0;
+	uint64_t nextDump = 0;
+
+	CrosslineStatsData() { Reset(); }
+	bool On() const {
+		return enabled.load(std::memory_order_relaxed);
+	}
+	// microseconds on the steady clock, 0 when not collecting so the matching Stop is skipped
+	uint64_t Start() const;
+	void Stop(Histogram &h, const uint64_t start);
+	void Count(std::atomic<uint64_t> &c, const uint64_t n=1) {
+		c.fetch_add(n, std::memory_order_relaxed);
+	}
+	void Get(CrosslineStats &st) const;
+	void Reset();
+};
+
+// Times a scope into a histogram
+struct CrosslineStatsTimer {
+	CrosslineStatsData *stats;
+	CrosslineStatsData::Histogram &hist;
+	uint64_t start;
+	CrosslineStatsTimer(CrosslineStatsData *s, CrosslineStatsData::Histogram &h) :
+		stats(s), hist(h), start(s ? s->Start() : 0) {}
+	~CrosslineStatsTimer() {
+		if (start) { stats->Stop(hist, start); }
+	}
+};
+
+// for timers on an object with no stats attached, as a history used on its own
+static CrosslineStatsData s_no_stats;
+
+static int crossline_stats_bucket(const uint64_t v)
+{
+	int b = 0;
+	while ((b < CrosslineStats::Buckets - 1) && (v >= (uint64_t(1) << b))) {
+		b++;
+	}
+	return b;
+}
+
+void CrosslineStatsData::Histogram::Add(const uint64_t v)
+{
+	count.fetch_add(1, std::memory_order_relaxed);
+	total.fetch_add(v, std::memory_order_relaxed);
+	buckets[crossline_stats_bucket(v)].fetch_add(1, std::memory_order_relaxed);
+	uint64_t m = max.load(std::memory_order_relaxed);
+	while ((v > m) && !max.compare_exchange_weak(m, v, std::memory_order_relaxed)) ;
+}
+
+void CrosslineStatsData::Histogram::Get(CrosslineStats::Histogram &h) const
+{
+	h.count = count.load(std::memory_order_relaxed);
+	h.total = total.load(std::memory_order_relaxed);
+	h.max = max.load(std::memory_order_relaxed);
+	for (int i = 0; i < CrosslineStats::Buckets; ++i) {
+		h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+	}
+}
+
+void CrosslineStatsData::Histogram::Reset()
+{
+	count.store(0, std::memory_order_relaxed);
+	total.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < CrosslineStats::Buckets; ++i) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t CrosslineStatsData::Start() const
+{
+	if (!On()) {
+		return 0;
+	}
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	// never 0, that means not timing
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count() | 1;
+}
+
+void CrosslineStatsData::Stop(Histogram &h, const uint64_t start)
+{
+	uint64_t end = Start();
+	if (start && end) {
+		h.Add(end > start ? end - start : 0);
+	}
+}
+
+void CrosslineStatsData::Get(CrosslineStats &st) const
+{
+	keyLatency.Get(st.keyLatency);
+	frameBytes.Get(st.frameBytes);
+	st.frames = frames.load(std::memory_order_relaxed);
+	st.writes = writes.load(std::memory_order_relaxed);
+	st.bytes = bytes.load(std::memory_order_relaxed);
+	st.refreshMove = refresh[0].load(std::memory_order_relaxed);
+	st.refreshAll = refresh[1].load(std::memory_order_relaxed);
+	st.refreshFromPos = refresh[2].load(std::memory_order_relaxed);
+	st.refreshChanged = refresh[3].load(std::memory_order_relaxed);
+	findItems.Get(st.findItems);
+	historyDump.Get(st.historyDump);
+	historyLoad.Get(st.historyLoad);
+	historySave.Get(st.historySave);
+}
+
+void CrosslineStatsData::Reset()
+{
+	keyLatency.Reset();
+	frameBytes.Reset();
+	frames.store(0, std::memory_order_relaxed);
+	writes.store(0, std::memory_order_relaxed);
+	bytes.store(0, std::memory_order_relaxed);
+	for (auto &r : refresh) {
+		r.store(0, std::memory_order_relaxed);
+	}
+	findItems.Reset();
+	historyDump.Reset();
+	historyLoad.Reset();
+	historySave.Reset();
+}
+
+double CrosslineStats::Histogram::Mean() const
+{
+	return count ? double(total) / double(count) : 0.0;
+}
+
+uint64_t CrosslineStats::Histogram::Percentile(const double p) const
+{
+	if (count == 0) {
+		return 0;
+	}
+	uint64_t want = uint64_t(p * double(count) + 0.5);
+	want = std::max<uint64_t>(want, 1);
+	uint64_t seen = 0;
+	for (int i = 0; i < Buckets - 1; ++i) {
+		seen += buckets[i];
+		if (seen >= want) {
+			return std::min<uint64_t>(i ? (uint64_t(1) << i) - 1 : 0, max);
+		}
+	}
+	return max;
+}
+
+static void crossline_stats_hist(std::string &out, const char *name, const CrosslineStats::Histogram &h)
+{
+	char line[160];
+	snprintf(line, sizeof(line), "%s: n %llu mean %.1f p50 %llu p99 %llu max %llu\n", name,
+	         (unsigned long long)h.count, h.Mean(), (unsigned long long)h.Percentile(0.5),
+	         (unsigned long long)h.Percentile(0.99), (unsigned long long)h.max);
+	out += line;
+}
+
+std::string CrosslineStats::ToString() const
+{
+	std::string out;
+	crossline_stats_hist(out, "key us", keyLatency);
+	crossline_stats_hist(out, "frame bytes", frameBytes);
+	char line[200];
+	snprintf(line, sizeof(line), "output: frames %llu writes %llu bytes %llu\n"
+	         "refresh: move %llu changed %llu from pos %llu all %llu\n",
+	         (unsigned long long)frames, (unsigned long long)writes, (unsigned long long)bytes,
+	         (unsigned long long)refreshMove, (unsigned long long)refreshChanged,
+	         (unsigned long long)refreshFromPos, (unsigned long long)refreshAll);
+	out += line;
+	crossline_stats_hist(out, "FindItems us", findItems);
+	crossline_stats_hist(out, "HistoryDump us", historyDump);
+	crossline_stats_hist(out, "HistoryLoad us", historyLoad);
+	crossline_stats_hist(out, "HistorySave us", historySave);
+	return out;
+}
+
+// Frames, input buffering and key events over a CrosslineTerminal
 class TerminalClass {
 public:
 #ifdef _WIN32
-	HANDLE hConsole;
-#else
-   termios origIOS;
+	HANDLE hConsole;    // for the console API when the terminal isn't Ansi
 #endif
-    int screenRows;
-    int screenCols;
 
 protected:
+	CrosslineTerminal *io;
+	std::unique_ptr<CrosslineTerminal> ownIo;   // the console, when none was given
+	bool ansi;
+
 	static const int BufLen = 32;
 	int curBuf;
 	int buffer[BufLen];
-	int RawGetChar();
+
+	// Input read ahead from the terminal, filled with a single Read of whatever
+	// is available and served a byte at a time by GetChar.  inHead == inTail when empty
+	static const int InBufLen = 4096;
+	unsigned char inBuf[InBufLen];
+	int inHead;
+	int inTail;
+
+	// >0 while inside RawBegin/RawEnd, allows nested ReadlineEdit calls
+	int rawDepth;
+	bool pasteWanted;
+
+	// resizeReported is the last ResizeCount returned as KEY_RESIZE
+	unsigned int resizeReported;
+
+	// Wake() from another thread counts up wakeCount and interrupts the wait for input
+	std::atomic<unsigned int> wakeCount;
+	unsigned int wakeReported;
+	bool EventPending() const;
+
+	int RawGetChar(const bool allowEvent);
+	bool inputEnded = false;	// RawGetChar's last read found the end of input
+	// Read into the input buffer, 0 at the end of input or after timeoutMs, -1 for an event if allowEvent
+	int ReadInput(const bool allowEvent, const int timeoutMs=-1);
+
+	// Output for the current frame, written with a single Write by Flush.
+	// Outside a frame output goes straight to the terminal as before
+	std::string outBuf;
+	int frameDepth;
+	crossline_color_e curColor;	// colour last sent to the terminal, -1 if unknown
+#ifdef _WIN32
+	WORD dftAttributes;			// console attributes for CROSSLINE_COLOR_DEFAULT
+#endif
 
 public:
-	TerminalClass();
+	TerminalClass(CrosslineTerminal *terminal);
+	~TerminalClass();
 	void Print(const std::string &st);
-	template <typename... Args>	void Printf(const char* fmt, Args&&... args);
-	int GetChar();
+	void Print(const char *st, const size_t len);
+	// Next input byte, if allowEvent KEY_RESIZE is returned when the terminal has been resized
+	// and KEY_WAKE after a Wake()
+	int GetChar(const bool allowEvent=false);
+	// Interrupt GetChar(true) with KEY_WAKE, can be called from any thread
+	void Wake();
+	// The last GetChar returned 0 because the input has ended (or the terminal hung up)
+	bool InputEnded() const { return inputEnded; }
+	// The next input byte if one comes within ms, otherwise -1, for the rest of an escape sequence
+	int GetCharWait(const int ms);
+	// GetChar(true) would return without waiting
+	bool InputReady();
+	// wait up to ms for InputReady
+	bool InputWait(const int ms);
+	// frames and writes are counted here when set
+	CrosslineStatsData *stats = nullptr;
+	// times input has been read from the terminal, a key that needed more input took user time
+	unsigned int readCount = 0;
+	CrosslineTerminal &Terminal() { return *io; }
 	void PutChar(const int c);
 	void ShowCursor(const bool show);
     void Beep();
+	void ColorSet(const crossline_color_e color);
+	void CursorSet(const int row, const int col);
+	void CursorMove(const int row_off, const int col_off);
+	// Where the cursor is, asking the terminal
+	bool CursorGet(int &row, int &col);
+	void Clear();
+	// After writing the last column the cursor waits there to wrap (ANSI terminals)
+	bool PendingWrap() const { return ansi; }
+
+	// Collect output until EndFrame and send it with one write, frames nest
+	void BeginFrame();
+	void EndFrame();
+	// Write the output collected so far
+	void Flush();
+	// Forget the colour state, e.g. after the screen has been cleared externally
+	void ColorReset();
+
+	// Enter raw mode once for a whole edit session rather than once per key,
+	// paste turns on bracketed paste for the session
+	void RawBegin(const bool paste);
+	void RawEnd();
+	bool InRaw() const;
+	// Restore the terminal, stop the process and return to raw mode when resumed
+	void Suspend();
+	// Store bytes read outside GetChar (e.g. while waiting for a cursor report)
+	void PushInput(const unsigned char ch);
+
+	// Count of resizes seen, changes when the screen size has to be queried again
+	unsigned int ResizeCount() const;
+	// Query the size of the terminal, only called after a resize
+	void ScreenQuery(int &pRows, int &pCols);
+	bool IsTty() const;
+};
+
+// The text of the line being edited as a gap buffer.  The unused space stays where the last
+// edit was, so typing or deleting near the start of a large paste moves a few bytes rather
+// than everything after the cursor, and reading it for drawing is two views either side of
+// the gap.  Str() closes the gap for the code that wants the line as a std::string, the next
+// edit opens it again
+class EditBuffer {
+public:
+	size_t Length() const { return data.size() - gapLen; }
+	// the character at i, '\0' at Length()
+	char operator[](const size_t i) const { return (i < gap) ? data[i] : data[i + gapLen]; }
+	void Insert(const size_t pos, const char *st, const size_t len);
+	void Insert(const size_t pos, const std::string &st) { Insert(pos, st.data(), st.length()); }
+	void Erase(const size_t pos, const size_t len);
+	void Set(const size_t pos, const char ch);
+	void Assign(const std::string &st);
+	// Exchange the text with st, so a std::string can be treated as an EditBuffer without a copy
+	void Swap(std::string &st);
+	// [beg, end) as the pieces before and after the gap
+	void Pieces(const size_t beg, const size_t end, std::string_view &head, std::string_view &tail) const;
+	void Copy(std::string &dest, const size_t beg, const size_t end) const;
+	bool Equals(const std::string &st) const;
+	// The whole line, which the caller may change until the next edit
+	std::string &Str();
+
+	// UTF-8 characters, a character followed by combining ones counts as one.  The character
+	// before pos starts at CharBefore(pos) and the one at pos ends at CharAfter(pos)
+	size_t CharStart(const size_t pos) const;
+	size_t CharBefore(const size_t pos) const { return (pos > 0) ? CharStart(pos - 1) : 0; }
+	size_t CharAfter(const size_t pos) const;
+	// no byte is above 0x7f, so each byte is a character one cell wide
+	bool Ascii() const;
+
+	// What has changed since Refresh last drew the text, anything past changedTo has only
+	// moved or changed if the length has
+	size_t changedFrom = 0;
+	size_t changedTo = SIZE_MAX;
+	size_t unchangedTail = 0;	// how many characters at the end are as they were, maybe moved
+	void Drawn() { changedFrom = SIZE_MAX; changedTo = 0; unchangedTail = SIZE_MAX; }
+
+protected:
+	std::string data;	// the text with the gap [gap, gap + gapLen) in it
+	size_t gap = 0;
+	size_t gapLen = 0;
+	mutable size_t highBytes = 0;	// bytes above 0x7f, SIZE_MAX until they are counted again
+	void MoveGap(const size_t pos);
+	void Close();
+	void Changed(const size_t beg, const size_t end) {
+		changedFrom = std::min(changedFrom, beg);
+		changedTo = std::max(changedTo, end);
+	}
+	void Kept(const size_t tail) { unchangedTail = std::min(unchangedTail, tail); }
+};
+
+// Where the prompt and text are on the screen, byte i of them (the prompt first) is in
+// cell Cell(i), counting along the rows from the start of the prompt.  A wide character that
+// doesn't fit at the end of a row goes on the next, leaving a filler cell, and combining
+// characters share the cell of the one before.  An ASCII line needs no table, byte i is cell i
+struct LineLayout {
+	bool ascii = true;
+	int cols = 0;
+	size_t length = 0;				// bytes of prompt and text
+	std::vector<int> cells;			// length + 1 of them if not ascii
+	std::vector<size_t> fillers;	// bytes with a filler cell before them
+
+	int Cell(const size_t i) const {
+		return ascii ? (int)i : (i < length) ? cells[i] : cells[length] + int(i - length);
+	}
+	int End() const { return Cell(length); }
+	// the first byte in cell or after it
+	size_t Next(const int cell) const;
+	// the first byte of the character cell is in, length past the end
+	size_t At(const int cell) const;
+	bool Filler(const size_t i) const;
+	// Lay out prompt and buf, only what follows byte from (of prompt and buf) has changed
+	void Build(const std::string &prompt, const EditBuffer &buf, const int cols, size_t from);
+};
+
+// The edit line as it was last drawn: prompt, its colour, the text and the width it was wrapped at.
+// valid is false when something else has been printed since and the cursor is at the start of a new line
+struct ShownLine {
+	bool valid = false;
+	std::string prompt;
+	crossline_color_e promptColor = CROSSLINE_COLOR_DEFAULT;
+	std::string text;
+	const EditBuffer *from = nullptr;	// text is what this buffer held when last drawn
+	int cols = 0;
+	// a line taller than the screen only has the rows from top on it, viewport is set while
+	// that is so and room has been made for a screenful of rows
+	int top = 0;
+	bool viewport = false;
+	int pageTop = -1;		// the top rows asked for by a page up/down, >= 0 for the next Refresh
+	LineLayout layout;		// of prompt and text
+	// an autosuggestion drawn after the text is in cells [suggestCell, suggestEnd)
+	std::string suggestion;
+	int suggestCell = 0;
+	int suggestEnd = 0;
+	// the screen cell of pos, counted from the start of the first row shown
+	int Cell(const int pos) const { return layout.Cell(prompt.length() + pos) - top * cols; }
+};
+
+#define CROSS_TOKEN_TEXT		256		// the least text a highlighter is given from a token
+
+// The highlighter's tokens for the line last drawn, with the lexer state after each, so after
+// an edit the lexing only starts again from the token before the change
+struct LineColors {
+	struct Token {
+		size_t end;
+		int state;
+		crossline_color_e color;
+	};
+	std::vector<Token> tokens;
+	const EditBuffer *from = nullptr;	// tokens are for this buffer, as it was last coloured
+	size_t length = 0;					// and this long
+	std::vector<Token> lexed;
+	std::string scratch;	// the text of a token that runs across the gap
+
+	// Lex what has changed in buf, the colours of [dirtyFrom, dirtyTo) may be different
+	void Update(HighlighterClass &hl, const EditBuffer &buf, size_t &dirtyFrom, size_t &dirtyTo);
+	// the token pos is in
+	size_t Find(const size_t pos) const;
 };
 
 // a class for storing private hidden variables
+#define CROSS_INPUT_BUF_LEN		(1 << 20)	// read size for non-interactive input
+
+// Non-interactive input, split into lines here rather than by stdio.  stdin is mapped if it is
+// a regular file, otherwise read in large blocks into buf, growing it for long lines.
+// Returned lines are views into the map or buf
+struct CrosslineInput {
+	bool started = false;
+	bool eof = false;
+	const char *map = nullptr;
+	size_t mapLen = 0;
+	std::vector<char> buf;
+	size_t head = 0;    // unread data is [head, tail)
+	size_t tail = 0;
+	CrosslineTerminal *io = nullptr;    // the session's terminal, read when not interactive
+
+	~CrosslineInput();
+	void Start();
+	bool Fill();
+	// The next line, refilling the buffer if needed, which invalidates earlier views
+	bool Take(std::string_view &line, const bool refill);
+	size_t TakeBatch(std::vector<std::string_view> &lines, const size_t max);
+};
+
+// A line being edited, kept between keys so the edit can be driven from ReadlineEdit's
+// loop or from FeedInput
+struct EditState {
+	std::string *buf = nullptr;		// where the line goes when the edit ends
+	EditBuffer text;
+	std::string prompt;
+	bool edit_only = false;
+	StrVec choices;
+	bool clear = false;
+	int pos = 0;
+	int num = 0;
+	int read_end = 0;
+	int copy_buf = 0;
+	bool canHis = true;     // are we moving back through history or searching
+	bool is_choice = false;
+	bool has_his = false;
+	int32_t history_id = 0;
+	std::string input;      // the line as typed, while moving through history
+	std::string partial;    // a UTF-8 character whose first bytes have been typed
+	// the newest history entry starting with suggested (empty if there is none), and whether
+	// the line has changed so that it has to be looked up again
+	std::string suggested;
+	std::string suggestion;
+	bool suggestDue = false;
+};
+
+#define CROSS_SUGGEST_MAX		4096	// longer lines get no autosuggestion
+#define CROSS_SUGGEST_COLOR		crossline_color_e(CROSSLINE_FGCOLOR_BRIGHT | CROSSLINE_FGCOLOR_BLACK)
+
+// Keys map to what they do with an open addressing hash table.  The default one is built at
+// compile time; binding a key copies it, so each key is one lookup either way
+#define CROSS_KEYMAP_BITS		8		// 256 slots, it is kept at most 3/4 full
+#define CROSS_KEYMAP_SLOTS		(1 << CROSS_KEYMAP_BITS)
+#define CROSS_KEYMAP_MAX		(CROSS_KEYMAP_SLOTS * 3 / 4)
+#define CROSS_KEY_UNUSED		INT_MIN	// not a key code, marks an empty slot
+
+using CrosslineAction = Crossline::KeyAction;
+
+struct CrosslineKeyBinding {
+	int key;
+	CrosslineAction action;
+};
+
+// A key's action is a Crossline::KeyAction, or COUNT + n for the nth custom function
+struct CrosslineKeymap {
+	struct Slot {
+		int key = CROSS_KEY_UNUSED;
+		uint16_t action = 0;
+	};
+	Slot slots[CROSS_KEYMAP_SLOTS] = {};
+	size_t used = 0;
+
+	static constexpr size_t Hash(const int key) {
+		return (uint32_t(key) * 0x9e3779b1u) >> (32 - CROSS_KEYMAP_BITS);
+	}
+	// the slot key is in, or the empty one it would go in
+	constexpr size_t Find(const int key) const {
+		size_t i = Hash(key);
+		while ((slots[i].key != key) && (slots[i].key != CROSS_KEY_UNUSED)) {
+			i = (i + 1) & (CROSS_KEYMAP_SLOTS - 1);
+		}
+		return i;
+	}
+	constexpr uint16_t Get(const int key) const {
+		return slots[Find(key)].action;
+	}
+	constexpr bool Bound(const int key) const {
+		return slots[Find(key)].key == key;
+	}
+	constexpr bool Set(const int key, const uint16_t action) {
+		const size_t i = Find(key);
+		if (slots[i].key == CROSS_KEY_UNUSED) {
+			if (used >= CROSS_KEYMAP_MAX) {
+				return false;
+			}
+			slots[i].key = key;
+			used++;
+		}
+		slots[i].action = action;
+		return true;
+	}
+};
+
+// The shortcuts in the F1 help, and the other sequences terminals send for the same keys
+static constexpr CrosslineKeyBinding s_default_keys[] = {
+	{KEY_WAKE,			CrosslineAction::COMPLETION_RESULTS},
+	{KEY_RESIZE,		CrosslineAction::REDRAW},
+
+	/* Misc Commands */
+	{KEY_F1,			CrosslineAction::HELP},
+	{KEY_DEBUG,			CrosslineAction::DEBUG_KEYS},
+	{CTRL_KEY('L'),		CrosslineAction::CLEAR_SCREEN},
+
+	/* Move Commands */
+	{KEY_LEFT,			CrosslineAction::MOVE_LEFT},
+	{CTRL_KEY('B'),		CrosslineAction::MOVE_LEFT},
+	{KEY_RIGHT,			CrosslineAction::MOVE_RIGHT},
+	{CTRL_KEY('F'),		CrosslineAction::MOVE_RIGHT},
+	{ALT_KEY('b'),		CrosslineAction::MOVE_WORD_LEFT},
+	{ALT_KEY('B'),		CrosslineAction::MOVE_WORD_LEFT},
+	{KEY_CTRL_LEFT,		CrosslineAction::MOVE_WORD_LEFT},
+	{KEY_ALT_LEFT,		CrosslineAction::MOVE_WORD_LEFT},
+	{ALT_KEY('f'),		CrosslineAction::MOVE_WORD_RIGHT},
+	{ALT_KEY('F'),		CrosslineAction::MOVE_WORD_RIGHT},
+	{KEY_CTRL_RIGHT,	CrosslineAction::MOVE_WORD_RIGHT},
+	{KEY_ALT_RIGHT,		CrosslineAction::MOVE_WORD_RIGHT},
+	{CTRL_KEY('A'),		CrosslineAction::MOVE_HOME},
+	{KEY_HOME,			CrosslineAction::MOVE_HOME},
+	{CTRL_KEY('E'),		CrosslineAction::MOVE_END},
+	{KEY_END,			CrosslineAction::MOVE_END},
+	{KEY_CTRL_UP,		CrosslineAction::MOVE_ROW_UP},
+	{KEY_ALT_UP,		CrosslineAction::MOVE_ROW_UP},
+	{KEY_CTRL_DOWN,		CrosslineAction::MOVE_ROW_DOWN},
+	{KEY_ALT_DOWN,		CrosslineAction::MOVE_ROW_DOWN},
+
+	/* Edit Commands */
+	{KEY_BACKSPACE,		CrosslineAction::DELETE_BACK},
+	{KEY_DEL2,			CrosslineAction::DELETE_BACK},
+	{KEY_DEL,			CrosslineAction::DELETE_CHAR},
+	{CTRL_KEY('D'),		CrosslineAction::DELETE_CHAR_OR_EOF},
+	{ALT_KEY('u'),		CrosslineAction::UPCASE_WORD},
+	{ALT_KEY('U'),		CrosslineAction::UPCASE_WORD},
+	{ALT_KEY('l'),		CrosslineAction::DOWNCASE_WORD},
+	{ALT_KEY('L'),		CrosslineAction::DOWNCASE_WORD},
+	{ALT_KEY('c'),		CrosslineAction::CAPITALIZE_WORD},
+	{ALT_KEY('C'),		CrosslineAction::CAPITALIZE_WORD},
+	{ALT_KEY('\\'),		CrosslineAction::DELETE_SPACE},
+	{CTRL_KEY('T'),		CrosslineAction::TRANSPOSE},
+
+	/* Cut&Paste Commands */
+	{CTRL_KEY('K'),		CrosslineAction::CUT_TO_END},
+	{KEY_CTRL_END,		CrosslineAction::CUT_TO_END},
+	{KEY_ALT_END,		CrosslineAction::CUT_TO_END},
+	{CTRL_KEY('U'),		CrosslineAction::CUT_TO_START},
+	{KEY_CTRL_HOME,		CrosslineAction::CUT_TO_START},
+	{KEY_ALT_HOME,		CrosslineAction::CUT_TO_START},
+	{CTRL_KEY('X'),		CrosslineAction::CUT_LINE},
+	{ALT_KEY('r'),		CrosslineAction::REVERT_LINE},
+	{ALT_KEY('R'),		CrosslineAction::REVERT_LINE},
+	{CTRL_KEY('W'),		CrosslineAction::CUT_TO_SPACE},
+	{KEY_ALT_BACKSPACE,	CrosslineAction::CUT_WORD_LEFT},
+	{KEY_CTRL_BACKSPACE,	CrosslineAction::CUT_WORD_LEFT},
+	{ALT_KEY('d'),		CrosslineAction::CUT_WORD_RIGHT},
+	{ALT_KEY('D'),		CrosslineAction::CUT_WORD_RIGHT},
+	{KEY_ALT_DEL,		CrosslineAction::CUT_WORD_RIGHT},
+	{KEY_CTRL_DEL,		CrosslineAction::CUT_WORD_RIGHT},
+	{CTRL_KEY('Y'),		CrosslineAction::PASTE},
+	{CTRL_KEY('V'),		CrosslineAction::PASTE},
+	{KEY_INSERT,		CrosslineAction::PASTE},
+
+	/* Complete Commands */
+	{KEY_TAB,			CrosslineAction::COMPLETE},
+	{ALT_KEY('='),		CrosslineAction::LIST_COMPLETIONS},
+	{ALT_KEY('?'),		CrosslineAction::LIST_COMPLETIONS},
+
+	/* History Commands */
+	{KEY_UP,			CrosslineAction::HISTORY_PREV},
+	{CTRL_KEY('P'),		CrosslineAction::HISTORY_PREV},
+	{KEY_DOWN,			CrosslineAction::HISTORY_NEXT},
+	{CTRL_KEY('N'),		CrosslineAction::HISTORY_NEXT},
+	{ALT_KEY('<'),		CrosslineAction::HISTORY_FIRST},
+	{KEY_PGUP,			CrosslineAction::PAGE_UP},
+	{ALT_KEY('>'),		CrosslineAction::HISTORY_LAST},
+	{KEY_PGDN,			CrosslineAction::PAGE_DOWN},
+	{CTRL_KEY('R'),		CrosslineAction::SEARCH_BACKWARD},
+	{CTRL_KEY('S'),		CrosslineAction::SEARCH_FORWARD},
+	{KEY_F4,			CrosslineAction::SEARCH_HISTORY},
+	{KEY_F2,			CrosslineAction::SHOW_HISTORY},
+	{KEY_F3,			CrosslineAction::CLEAR_HISTORY},
+
+	/* Control Commands */
+	{KEY_ENTER,			CrosslineAction::ACCEPT},
+	{KEY_ENTER2,		CrosslineAction::ACCEPT},
+	{CTRL_KEY('C'),		CrosslineAction::INTERRUPT},
+	{CTRL_KEY('G'),		CrosslineAction::ABORT},
+	{CTRL_KEY('Z'),		CrosslineAction::SUSPEND},
+
+#ifndef _WIN32
+	{KEY_HOME2,			CrosslineAction::MOVE_HOME},
+	{KEY_END2,			CrosslineAction::MOVE_END},
+	{KEY_CTRL_UP2,		CrosslineAction::MOVE_ROW_UP},
+	{KEY_CTRL_DOWN2,	CrosslineAction::MOVE_ROW_DOWN},
+	{KEY_CTRL_LEFT2,	CrosslineAction::MOVE_WORD_LEFT},
+	{KEY_CTRL_RIGHT2,	CrosslineAction::MOVE_WORD_RIGHT},
+	{KEY_F1_2,			CrosslineAction::HELP},
+	{KEY_F2_2,			CrosslineAction::SHOW_HISTORY},
+	{KEY_F3_2,			CrosslineAction::CLEAR_HISTORY},
+	{KEY_F4_2,			CrosslineAction::SEARCH_HISTORY},
+	{KEY_PASTE_BEGIN,	CrosslineAction::PASTE_BEGIN},
+	{KEY_PASTE_END,		CrosslineAction::DO_NOTHING},	// stray end marker
+#endif
+};
+
+static constexpr CrosslineKeymap crossline_default_keymap ()
+{
+	CrosslineKeymap map;
+	for (const CrosslineKeyBinding &b : s_default_keys) {
+		map.Set(b.key, uint16_t(b.action));
+	}
+	return map;
+}
+
+static constexpr CrosslineKeymap s_default_keymap = crossline_default_keymap();
+
+// Set of the bytes that separate words, one bit each
+struct CrosslineCharClass {
+	uint64_t bits[4] = {};
+
+	void Set(const std::string &chars) {
+		memset(bits, 0, sizeof(bits));
+		bits[0] = 1;	// the NUL past the end of the text ends a word too
+		for (const char ch : chars) {
+			const unsigned char c = ch;
+			bits[c >> 6] |= uint64_t(1) << (c & 63);
+		}
+	}
+	bool Has(const char ch) const {
+		const unsigned char c = ch;
+		return (bits[c >> 6] >> (c & 63)) & 1;
+	}
+};
+
+#define CROSS_LOG_RECORDS		1024	// messages the log ring holds, a power of 2
+#define CROSS_LOG_TEXT_LEN		240		// longest message, longer ones are cut
+#define CROSS_LOG_FLUSH_MS		100		// how often the log is written
+
+// Log messages go into a preallocated ring (a bounded multi-producer queue) and a background
+// thread writes them to the file, so logging is a snprintf and two atomics.  When the ring is
+// full messages are dropped and counted, a caller is never held up
+struct CrosslineLog {
+	typedef Crossline::LogLevel Level;
+
+	struct Record {
+		std::atomic<size_t> seq;
+		uint64_t usec;
+		Level level;
+		uint16_t len;
+		char text[CROSS_LOG_TEXT_LEN];
+	};
+
+	std::atomic<int> level{int(Level::NONE)};
+	std::string file;
+	std::unique_ptr<Record[]> ring;
+	std::atomic<size_t> head{0};    // next record to claim
+	size_t tail = 0;                // next record to write, writer thread only
+	std::atomic<size_t> dropped{0};
+	std::chrono::steady_clock::time_point start;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stop = false;
+
+	~CrosslineLog();
+	bool Enabled(const Level lvl) const {
+		return int(lvl) <= level.load(std::memory_order_relaxed);
+	}
+	void SetLevel(const Level lvl);
+	void Add(const Level lvl, const char *fmt, va_list args);
+	void Add(const Level lvl, const char *fmt, ...);
+	void Write(FILE *fp);
+};
+
 struct CrosslinePrivate {
 
 	TerminalClass term;
 	bool history_noSearchRepeats;
 	int history_search_no;  // the number of history items to show
+	int history_search_threads;	// threads a history search scans with, 0 for one per core
 
 	std::string word_delimiter;
-    bool got_resize; // Window size changed
+	CrosslineCharClass delimiters;	// word_delimiter as a table
+
+	// the keymap in use, the default until a key is bound and userKeys is made from it
+	const CrosslineKeymap *keymap = &s_default_keymap;
+	std::unique_ptr<CrosslineKeymap> userKeys;
+	std::vector<Crossline::KeyFunction> keyFunctions;
+
+	// Cached screen size, refreshed when the terminal reports a resize
+	int screenRows;
+	int screenCols;
+	unsigned int screenResizeCount;
 
 	std::string	clip_buf; // Buf to store cut text
+	std::string	last_search; // Last incremental search pattern, Ctrl-R on an empty search repeats it
 	// crossline_completion_callback completion_callback = nullptr;
 
     int paging_print_line = 0; // For paging control
     crossline_color_e prompt_color = CROSSLINE_COLOR_DEFAULT;
 
 	bool allowEscCombo;
-
-	std::string logFile;
-
-    int last_print_num;   // store the size of the last printed string
-
-	CrosslinePrivate(const bool log);
-
+	int escTimeoutMs;       // how long to wait for the rest of an escape sequence
+
+	CrosslineLog log;
+	CrosslineStatsData stats;
+
+    int last_print_num;   // store the cells the last printed line takes
+
+	// what Refresh last drew, so only the cells that change need to be sent
+	ShownLine shown;
+	EditBuffer refreshText;		// a std::string being drawn, swapped in
+	LineColors colors;
+	bool highlightOn = false;	// the line being edited is highlighted, not a search pattern
+	bool suggestOn = false;		// history autosuggestions
+
+	int interactive = -1;       // stdin is a usable terminal, worked out on the first read
+	std::unique_ptr<EditState> feed;    // the edit driven by FeedInput
+	std::string feedBuf;
+	CrosslineInput input;
+	std::string inputLine;      // interactive line for ReadLines
+
+	// Async completion: compThread runs FindItems for the latest job, compMutex guards the
+	// job.  compWaiting (edit loop only) is set while a job's result is still wanted
+	bool compAsync = false;
+	int compBudgetMs = 0;
+	std::thread compThread;
+	std::mutex compMutex;
+	std::condition_variable compCv;
+	bool compStop = false;
+	bool compQueued = false;
+	unsigned int compGen = 0;       // the latest job
+	unsigned int compDoneGen = 0;   // the last one finished
+	std::string compBuf;            // what the latest job is completing
+	int compPos = 0;
+	bool compTab = false;
+	bool compWaiting = false;
+
+	CrosslinePrivate(const bool log, CrosslineTerminal *terminal);
+
+	// after a key started at start (Start) has been handled, reads is term.readCount then
+	void KeyTimed(const uint64_t start, const unsigned int reads);
 	void LogMessage(const std::string &st);
-	bool IsLogging() const;
+	bool IsLogging(const Crossline::LogLevel level=Crossline::LogLevel::TRACE) const;
 
-	// Get screen rows and columns
+	// Get screen rows and columns, from the cache unless there has been a resize
 	void ScreenGet (int &pRows, int &pCols);
 
-
 };
 
 
 bool Crossline::isdelim(const char ch)
 {
 	// Check ch is word delimiter
-	return NULL != strchr(privData->word_delimiter.c_str(), ch);
+	return privData->delimiters.Has(ch);
 }
 
 
@@ -320,7 +1073,7 @@ static std::string s_crossline_help[] = {
 " | Ctrl-N, Down            |  Fetch next line in history.                     |",
 " | Alt-<,  PgUp            |  Move to first line in history.                  |",
 " | Alt->,  PgDn            |  Move to end of input history.                   |",
-" | Ctrl-R, Ctrl-S          |  Search history.                                 |",
+" | Ctrl-R, Ctrl-S          |  Incremental search of history.                  |",
 " | F4                      |  Search history with current input.              |",
 " | F1                      |  Show search help when in search mode.           |",
 " | F2                      |  Show history.                                   |",
@@ -358,36 +1111,178 @@ static std::string s_search_help[] = {
 
 /*****************************************************************************/
 
-// Main API to read a line, return buf if get line, return NULL if EOF.
+// Terminals that can't be edited on, only the process's own terminal is described by TERM
+static bool crossline_term_usable ()
+{
+	char *term = getenv("TERM");
+	if (NULL != term) {
+		if (!strcasecmp(term, "dumb") || !strcasecmp(term, "cons25") ||  !strcasecmp(term, "emacs"))
+			{ return false; }
+	}
+	return true;
+}
+
 bool Crossline::ReadLine (const std::string &prompt, std::string &buf, const bool useBuf)
 {
-	int not_support = 0;
+	if (privData->interactive < 0) {
+		privData->interactive = privData->term.Terminal().Interactive();
+	}
+	if (!privData->interactive) {
+		std::string_view line;
+		if (!privData->input.Take(line, true)) {
+			buf.clear();
+			return false;
+		}
+		buf.assign(line.data(), line.length());
+		return true;
+	}
+
+	return ReadlineEdit (buf, prompt, useBuf, false, StrVec());
+}
+
+size_t Crossline::ReadLines (const std::string &prompt, std::vector<std::string_view> &lines, const size_t max)
+{
+	lines.clear();
+	if (privData->interactive < 0) {
+		privData->interactive = privData->term.Terminal().Interactive();
+	}
+	if (!privData->interactive) {
+		return privData->input.TakeBatch(lines, std::max<size_t>(max, 1));
+	}
+	if (!ReadLine(prompt, privData->inputLine)) {
+		return 0;
+	}
+	lines.push_back(privData->inputLine);
+	return 1;
+}
+
+CrosslineInput::~CrosslineInput()
+{
+	if (map != nullptr) {
+#ifdef _WIN32
+		UnmapViewOfFile(map);
+#else
+		munmap((void*)map, mapLen);
+#endif
+	}
+}
 
-	if (!isatty(STDIN_FILENO)) {  // input is not from a terminal
-		not_support = 1;
+// Map the input if it is a regular file, starting from where its offset is now
+void CrosslineInput::Start()
+{
+	started = true;
+#ifdef _WIN32
+	const int fd = (io->InputHandle() == GetStdHandle(STD_INPUT_HANDLE)) ? STDIN_FILENO : -1;
+	struct _stat64 st;
+	if ((fd >= 0) && (_fstat64(fd, &st) == 0) && (st.st_mode & _S_IFREG) && (st.st_size > 0)) {
+		HANDLE file = (HANDLE)_get_osfhandle(fd);
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping != NULL) {
+			map = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);   // the view keeps the mapping
+		}
+		if (map != nullptr) {
+			mapLen = (size_t)st.st_size;
+			head = (size_t)std::max<__int64>(0, _lseeki64(fd, 0, SEEK_CUR));
+		}
+	}
+#else
+	const int fd = io->InputFd();
+	struct stat st;
+	if ((fd >= 0) && (fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			map = (const char*)p;
+			mapLen = st.st_size;
+			head = (size_t)std::max<off_t>(0, lseek(fd, 0, SEEK_CUR));
+		}
+	}
+#endif
+	if (map != nullptr) {
+		tail = mapLen;
+		head = std::min(head, tail);
+		eof = true;     // nothing more to read, and the file offset is moved to the end
+#ifdef _WIN32
+		_lseeki64(fd, mapLen, SEEK_SET);
+#else
+		lseek(fd, mapLen, SEEK_SET);
+#endif
 	} else {
-		char *term = getenv("TERM");
-		if (NULL != term) {
-			if (!strcasecmp(term, "dumb") || !strcasecmp(term, "cons25") ||  !strcasecmp(term, "emacs"))
-				{ not_support = 1; }
-		}
-	}
-	if (not_support) {
-        const unsigned int CROSS_HISTORY_BUF_LEN = 4096;
-		char tmpBuf[CROSS_HISTORY_BUF_LEN];
-		int sz = CROSS_HISTORY_BUF_LEN;
-        if (NULL == fgets(tmpBuf, sz, stdin)) {
-        	buf.clear();
-        	return false;
-        }
-        buf = tmpBuf;
-        return true;
+		buf.resize(CROSS_INPUT_BUF_LEN);
 	}
+}
 
-	return ReadlineEdit (buf, prompt, useBuf, false, StrVec());
+// Read another block after the unread data, false at the end of input
+bool CrosslineInput::Fill()
+{
+	if (eof) {
+		return false;
+	}
+	if (head > 0) {
+		memmove(buf.data(), buf.data() + head, tail - head);
+		tail -= head;
+		head = 0;
+	}
+	if (tail == buf.size()) {   // a line longer than the buffer
+		buf.resize(buf.size() * 2);
+	}
+	while (true) {
+		int n = io->Read(buf.data() + tail, std::min<size_t>(buf.size() - tail, INT_MAX), -1);
+		if (0 == n) {   // woken, nothing read
+			continue;
+		}
+		if (n < 0) {
+			eof = true;
+			return false;
+		}
+		tail += n;
+		return true;
+	}
 }
 
+bool CrosslineInput::Take(std::string_view &line, const bool refill)
+{
+	if (!started) {
+		Start();
+	}
+	while (true) {
+		const char *data = (map != nullptr) ? map : buf.data();
+		const char *nl = (const char*)memchr(data + head, '\n', tail - head);
+		if (nl != nullptr) {
+			size_t len = nl - (data + head);
+			if ((len > 0) && (nl[-1] == '\r')) {
+				len--;
+			}
+			line = std::string_view(data + head, len);
+			head = nl - data + 1;
+			return true;
+		}
+		if (!eof && refill && Fill()) {
+			continue;
+		}
+		if (eof && (head < tail)) {     // last line without a newline
+			line = std::string_view(data + head, tail - head);
+			head = tail;
+			return true;
+		}
+		return false;
+	}
+}
 
+size_t CrosslineInput::TakeBatch(std::vector<std::string_view> &lines, const size_t max)
+{
+	// only the first line may refill, that would move the lines already taken
+	std::string_view line;
+	if (!Take(line, true)) {
+		return 0;
+	}
+	lines.push_back(line);
+	while ((lines.size() < max) && Take(line, false)) {
+		lines.push_back(line);
+	}
+	return lines.size();
+}
 
 
 // Set move/cut word delimiter, defaut is all not digital and alphabetic characters.
@@ -395,36 +1290,214 @@ void  Crossline::SetDelimiter (const std::string &delim)
 {
 	if (delim.length() > 0) {
 		privData->word_delimiter = delim;
+		privData->delimiters.Set(delim);
+	}
+}
+
+// Keys by name for KeyBind, with the other code some terminals send for the same key
+struct CrosslineKeyName {
+	const char *name;
+	int key;
+	int key2;
+};
+
+static const CrosslineKeyName s_key_names[] = {
+	{"Tab",				KEY_TAB,			CROSS_KEY_UNUSED},
+	{"Enter",			KEY_ENTER,			KEY_ENTER2},
+	{"Backspace",		KEY_BACKSPACE,		KEY_DEL2},
+	{"Insert",			KEY_INSERT,			CROSS_KEY_UNUSED},
+	{"Del",				KEY_DEL,			CROSS_KEY_UNUSED},
+	{"PgUp",			KEY_PGUP,			CROSS_KEY_UNUSED},
+	{"PgDn",			KEY_PGDN,			CROSS_KEY_UNUSED},
+	{"Up",				KEY_UP,				CROSS_KEY_UNUSED},
+	{"Down",			KEY_DOWN,			CROSS_KEY_UNUSED},
+	{"Left",			KEY_LEFT,			CROSS_KEY_UNUSED},
+	{"Right",			KEY_RIGHT,			CROSS_KEY_UNUSED},
+	{"Ctrl-Home",		KEY_CTRL_HOME,		CROSS_KEY_UNUSED},
+	{"Ctrl-End",		KEY_CTRL_END,		CROSS_KEY_UNUSED},
+	{"Ctrl-Del",		KEY_CTRL_DEL,		CROSS_KEY_UNUSED},
+	{"Ctrl-Backspace",	KEY_CTRL_BACKSPACE,	CROSS_KEY_UNUSED},
+	{"Alt-Up",			KEY_ALT_UP,			CROSS_KEY_UNUSED},
+	{"Alt-Down",		KEY_ALT_DOWN,		CROSS_KEY_UNUSED},
+	{"Alt-Left",		KEY_ALT_LEFT,		CROSS_KEY_UNUSED},
+	{"Alt-Right",		KEY_ALT_RIGHT,		CROSS_KEY_UNUSED},
+	{"Alt-Home",		KEY_ALT_HOME,		CROSS_KEY_UNUSED},
+	{"Alt-End",			KEY_ALT_END,		CROSS_KEY_UNUSED},
+	{"Alt-Del",			KEY_ALT_DEL,		CROSS_KEY_UNUSED},
+	{"Alt-Backspace",	KEY_ALT_BACKSPACE,	CROSS_KEY_UNUSED},
+#ifdef _WIN32
+	{"Home",			KEY_HOME,			CROSS_KEY_UNUSED},
+	{"End",				KEY_END,			CROSS_KEY_UNUSED},
+	{"Ctrl-Up",			KEY_CTRL_UP,		CROSS_KEY_UNUSED},
+	{"Ctrl-Down",		KEY_CTRL_DOWN,		CROSS_KEY_UNUSED},
+	{"Ctrl-Left",		KEY_CTRL_LEFT,		CROSS_KEY_UNUSED},
+	{"Ctrl-Right",		KEY_CTRL_RIGHT,		CROSS_KEY_UNUSED},
+	{"F1",				KEY_F1,				CROSS_KEY_UNUSED},
+	{"F2",				KEY_F2,				CROSS_KEY_UNUSED},
+	{"F3",				KEY_F3,				CROSS_KEY_UNUSED},
+	{"F4",				KEY_F4,				CROSS_KEY_UNUSED},
+#else // Linux
+	{"Home",			KEY_HOME,			KEY_HOME2},
+	{"End",				KEY_END,			KEY_END2},
+	{"Ctrl-Up",			KEY_CTRL_UP,		KEY_CTRL_UP2},
+	{"Ctrl-Down",		KEY_CTRL_DOWN,		KEY_CTRL_DOWN2},
+	{"Ctrl-Left",		KEY_CTRL_LEFT,		KEY_CTRL_LEFT2},
+	{"Ctrl-Right",		KEY_CTRL_RIGHT,		KEY_CTRL_RIGHT2},
+	{"F1",				KEY_F1,				KEY_F1_2},
+	{"F2",				KEY_F2,				KEY_F2_2},
+	{"F3",				KEY_F3,				KEY_F3_2},
+	{"F4",				KEY_F4,				KEY_F4_2},
+#endif
+};
+
+static bool crossline_same_name (const std::string &name, const size_t len, const char *known)
+{
+	size_t i = 0;
+	for (; (i < len) && known[i]; i++) {
+		if (tolower((unsigned char)name[i]) != tolower((unsigned char)known[i])) {
+			return false;
+		}
+	}
+	return (i == len) && !known[i];
+}
+
+// The codes the key called name sends, false if there isn't one
+static bool crossline_key_codes (const std::string &name, int codes[2])
+{
+	codes[0] = codes[1] = CROSS_KEY_UNUSED;
+	for (const CrosslineKeyName &k : s_key_names) {
+		if (crossline_same_name(name, name.length(), k.name)) {
+			codes[0] = k.key;
+			codes[1] = k.key2;
+			return true;
+		}
+	}
+	if (1 == name.length()) {
+		codes[0] = (unsigned char)name[0];
+		return true;
+	}
+	if ((6 == name.length()) && crossline_same_name(name, 5, "Ctrl-")) {
+		const int ch = toupper((unsigned char)name[5]);
+		if ((ch >= '@') && (ch <= '_')) {
+			codes[0] = CTRL_KEY(ch);
+			return true;
+		}
+	} else if ((5 == name.length()) && crossline_same_name(name, 4, "Alt-")) {
+		const unsigned char ch = name[4];
+		codes[0] = ALT_KEY(tolower(ch));
+		codes[1] = ALT_KEY(toupper(ch));
+		return true;
+	}
+	return false;
+}
+
+// Bind the key called name to action, the first binding makes the keymap its own copy
+static bool crossline_key_bind (CrosslinePrivate &priv, const std::string &name, const uint16_t action)
+{
+	int codes[2];
+	if (!crossline_key_codes(name, codes)) {
+		return false;
+	}
+	if (!priv.userKeys) {
+		priv.userKeys.reset(new CrosslineKeymap(s_default_keymap));
+		priv.keymap = priv.userKeys.get();
+	}
+	// all or nothing, a custom action's function is dropped if it can't be bound
+	size_t adding = 0;
+	for (const int code : codes) {
+		adding += ((CROSS_KEY_UNUSED != code) && !priv.userKeys->Bound(code)) ? 1 : 0;
+	}
+	if (priv.userKeys->used + adding > CROSS_KEYMAP_MAX) {
+		return false;
+	}
+	for (const int code : codes) {
+		if (CROSS_KEY_UNUSED != code) {
+			priv.userKeys->Set(code, action);
+		}
+	}
+	return true;
+}
+
+bool Crossline::KeyBind (const std::string &key, const KeyAction action)
+{
+	if (action >= KeyAction::COUNT) {
+		return false;
+	}
+	return crossline_key_bind(*privData, key, uint16_t(action));
+}
+
+bool Crossline::KeyBind (const std::string &key, KeyFunction fn)
+{
+	if (!fn) {
+		return KeyBind(key, KeyAction::NONE);
+	}
+	std::vector<KeyFunction> &fns = privData->keyFunctions;
+	if (uint16_t(KeyAction::COUNT) + fns.size() >= UINT16_MAX) {
+		return false;
+	}
+	fns.push_back(std::move(fn));
+	if (!crossline_key_bind(*privData, key, uint16_t(uint16_t(KeyAction::COUNT) + fns.size() - 1))) {
+		fns.pop_back();
+		return false;
 	}
+	return true;
 }
 
 void Crossline::HistoryShow (void)
 {
+	history->HistorySync(true);
 	int noHist = history->Size();
 	for (int i = 0; i < noHist; i++) {
-		HistoryItemPtr hisPtr = history->GetHistoryItem(i);
-		const std::string &hisItem = hisPtr->item;
-		PrintStr(hisItem);
+		PrintStr(std::string(history->GetHistoryView(i)));
 }
 }
 
 
 
-int HistoryClass::HistorySave (const std::string &filename) const
+// A compacted journal starts with a header giving its generation (one more than the file it
+// replaced) and where the entries it was made with end, so a session that still had the file
+// it replaced open knows where the newer ones start.  The loaders skip it
+#define CROSS_JOURNAL_HEADER		"#crossline journal "
+#define CROSS_JOURNAL_HEADER_LEN	(sizeof(CROSS_JOURNAL_HEADER) - 1 + 42)	// two 20 digit numbers
+
+// whether data starts with the header, its newline may have been taken off
+static bool crossline_journal_header (const std::string_view &data)
+{
+    return (data.length() >= CROSS_JOURNAL_HEADER_LEN - 1) &&
+           (data.compare(0, sizeof(CROSS_JOURNAL_HEADER) - 1, CROSS_JOURNAL_HEADER) == 0);
+}
+
+static bool crossline_file_replace (const std::string &from, const std::string &to);
+static void crossline_file_remove (const std::string &path);
+
+// The whole history is saved, so a mapped load is finished first.  It is written beside
+// filename and renamed over it: filename may be the mapped file the entries are read from
+int HistoryClass::HistorySave (const std::string &filename)
 {
+	CrosslineStatsTimer timer(stats, stats ? stats->historySave : s_no_stats.historySave);
 	if (filename.length() == 0) {
 		return -1;
-	} else {
-		FILE *file = fopen(filename.c_str(), "wt");
-		if (file == NULL) {	return -1;	}
+	}
+	HistorySync(true);
+	const std::string temp = filename + ".save";
+	FILE *file = fopen(temp.c_str(), "wt");
+	if (file == NULL) {	return -1;	}
 
-		int noHist = Size();
-		for (int i = 0; i < noHist; i++) {
-			HistoryItemPtr hisPtr = GetHistoryItem(i);
-			const std::string &hisItem = hisPtr->item;
-			fprintf (file, "%s\n", hisItem.c_str());
-		}
-		fclose(file);
+	int noHist = Size();
+	for (int i = 0; i < noHist; i++) {
+		std::string_view hisItem = GetHistoryView(i);
+		fwrite (hisItem.data(), 1, hisItem.length(), file);
+		fputc ('\n', file);
+	}
+	bool ok = !ferror(file);
+	ok = (fclose(file) == 0) && ok;
+#ifdef _WIN32
+	// a mapped file can't be replaced
+	MapRelease();
+#endif
+	if (!ok || !crossline_file_replace(temp, filename)) {
+		crossline_file_remove(temp);
+		return -1;
 	}
 	return 0;
 }
@@ -432,6 +1505,7 @@ int HistoryClass::HistorySave (const std::string &filename) const
 int HistoryClass::HistoryLoad (const std::string &filename)
 {
     // Load a simple file with a command on a single line
+	CrosslineStatsTimer timer(stats, stats ? stats->historyLoad : s_no_stats.historyLoad);
 	int		len;
 	if (filename.length() == 0)	{
 		return -1;
@@ -442,26 +1516,17 @@ int HistoryClass::HistoryLoad (const std::string &filename)
         return -1;
 		}
     bool found = false;
-    for (std::string line; std::getline(inp, line);) {
-        HistoryItemPtr item = std::make_shared<HistoryItem>(line);
-        Add(item);
+    size_t no = 0;
+    for (std::string line; std::getline(inp, line); no++) {
+        if ((no > 0) || !crossline_journal_header(line)) {
+            Add(line);
+        }
 	}
 
 	return 0;
 }
 
 
-void HistoryClass::Add(const std::string &item)
-{
-    HistoryItemPtr ptr = std::make_shared<HistoryItem>(item);
-    Add(ptr);
-}
-
-HistoryItemPtr HistoryClass::GetHistoryItem(const ssize_t n) const
-{
-	int ind = n;
-	return MakeItemPtr(Get(ind));
-}
 
 void Crossline::HistorySetup(const bool noSearchRepeats)
 {
@@ -473,6 +1538,17 @@ void Crossline::HistorySetSearchMaxCount(const ssize_t n)
 	privData->history_search_no = n;
 }
 
+void Crossline::HistorySetSearchThreads(const int threads)
+{
+	privData->history_search_threads = std::max(threads, 0);
+}
+
+void Crossline::HistorySuggest(const bool enable, const int delayMs)
+{
+	privData->suggestOn = enable;
+	hintDelay = std::max(delayMs, 0);
+}
+
 /*****************************************************************************/
 
 bool Crossline::PagingSet (const bool enable)
@@ -487,7 +1563,7 @@ int Crossline::PagingCheck (int line_len)
 	std::string paging_hints("*** Press <Space> or <Enter> to continue . . .");
 	int	i, ch, rows, cols, len = paging_hints.length();
 
-	if ((privData->paging_print_line < 0) || !isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))	{
+	if ((privData->paging_print_line < 0) || !privData->term.IsTty())	{
 		return 0;
 	}
 	ScreenGet (rows, cols);
@@ -517,13 +1593,21 @@ void  Crossline::PromptColorSet (crossline_color_e color)
 
 void Crossline::ScreenClear ()
 {
-	int ret = system (s_crossline_win ? "cls" : "clear");
-	(void) ret;
+	privData->term.Clear();
+	privData->term.Flush();
+	privData->term.ColorReset();
+}
+
+bool Crossline::CursorGet (int &rows, int &cols)
+{
+	return privData->term.CursorGet(rows, cols);
 }
 
+// anything printed outside Refresh means the edit line has to be drawn again
 void Crossline::PrintStr(const std::string st)
 {
     privData->term.Print(st);
+    privData->shown.valid = false;
 }
 
 int Crossline::Getch (void)
@@ -536,6 +1620,21 @@ void Crossline::ShowCursor(const bool show)
     privData->term.ShowCursor(show);
 }
 
+void Crossline::CursorSet (const int row, const int col)
+{
+	privData->term.CursorSet(row, col);
+}
+
+void Crossline::CursorMove (const int row_off, const int col_off)
+{
+	privData->term.CursorMove(row_off, col_off);
+}
+
+void Crossline::ColorSet (crossline_color_e color)
+{
+	privData->term.ColorSet(color);
+}
+
 
 void Crossline::ScreenGet(int &pRows, int &pCols)
 {
@@ -545,97 +1644,175 @@ void Crossline::ScreenGet(int &pRows, int &pCols)
 
 #ifdef _WIN32	// Windows
 
-int TerminalClass::RawGetChar()
+struct CrosslineConsole::Data {
+	HANDLE hIn;
+	HANDLE hOut;
+	HANDLE wakeEvent;
+	bool inConsole;     // otherwise input is a file or pipe, read with _read
+	bool outConsole;
+	bool interactive;
+};
+
+CrosslineConsole::CrosslineConsole() : data(new Data())
 {
-	return _getch();
+	data->hIn = GetStdHandle(STD_INPUT_HANDLE);
+	data->hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+	data->wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	data->inConsole = isatty(STDIN_FILENO);
+	data->outConsole = isatty(STDOUT_FILENO);
+	data->interactive = data->inConsole && crossline_term_usable();
 }
 
-template <typename T>
-void printAllImpl(T item) {
-  std::cout << item << ' ';
+CrosslineConsole::~CrosslineConsole()
+{
+	CloseHandle(data->wakeEvent);
+	delete data;
 }
 
-template <typename T, typename ...Args>
-void printAllImpl(T item, Args ... args) {
-  printAllImpl(item);
-  printAllImpl(args...);
+// Wait for a key, noting any WINDOW_BUFFER_SIZE_EVENT on the way.  _getch gives a byte at a
+// time, function keys as two with 0 or 224 first
+int CrosslineConsole::Read(char *buf, const size_t len, const int timeoutMs)
+{
+	if (len == 0) {
+		return 0;
+	}
+	if (!data->inConsole) {
+		int n = _read(STDIN_FILENO, buf, (unsigned int)std::min<size_t>(len, INT_MAX));
+		return (n > 0) ? n : -1;
+	}
+	const unsigned int resizeStart = resizes;
+	INPUT_RECORD rec;
+	DWORD n;
+	while (!_kbhit()) {
+		if (resizes != resizeStart) {
+			return 0;
+		}
+		if (!PeekConsoleInput(data->hIn, &rec, 1, &n) || (0 == n)) {
+			HANDLE waitFor[2] = {data->hIn, data->wakeEvent};
+			if (WaitForMultipleObjects(2, waitFor, FALSE, (timeoutMs < 0) ? INFINITE : (DWORD)timeoutMs) != WAIT_OBJECT_0) {
+				return 0;   // woken or timed out
+			}
+			continue;
+		}
+		if ((KEY_EVENT == rec.EventType) && rec.Event.KeyEvent.bKeyDown) {
+			break;      // _getch will pick this up
+		}
+		// discard everything else, counting resizes
+		ReadConsoleInput(data->hIn, &rec, 1, &n);
+		if (WINDOW_BUFFER_SIZE_EVENT == rec.EventType) {
+			resizes++;
+		}
+	}
+	buf[0] = (char)_getch();
+	return 1;
 }
 
-#ifdef TODO
-template <typename... Args>
-void TerminalClass::Print(const char* fmt, Args&&... args) {
-  printAllImpl(std::forward<Args>(args) ...);
-  std::cout << '\n';
+bool CrosslineConsole::Write(const char *st, const size_t len)
+{
+	if (!data->outConsole) {
+		return fwrite(st, 1, len, stdout) == len;
+	}
+	fflush(stdout);     // anything the application printed goes first
+	return WriteConsole(data->hOut, st, (DWORD)len, nullptr, nullptr) != 0;
 }
-#endif
 
+void CrosslineConsole::Flush()
+{
+	fflush(stdout);
+}
 
-void TerminalClass::Print(const std::string &st)
+bool CrosslineConsole::Size(int &rows, int &cols)
 {
-	// printf(st.c_str());
-	WriteConsole(hConsole, st.c_str(), st.size(), nullptr, nullptr);
+	CONSOLE_SCREEN_BUFFER_INFO inf;
+	if (!GetConsoleScreenBufferInfo (data->hOut, &inf)) {
+		return false;
+	}
+	cols = inf.srWindow.Right - inf.srWindow.Left + 1;
+	rows = inf.srWindow.Bottom - inf.srWindow.Top + 1;
+	return true;
 }
 
+unsigned int CrosslineConsole::ResizeCount() const
+{
+	return resizes;
+}
 
-void TerminalClass::ShowCursor(const bool show)
+void CrosslineConsole::Wake()
 {
-  CONSOLE_CURSOR_INFO curInfo;
-  if (!GetConsoleCursorInfo(hConsole, &curInfo)) {
-  	return;
-  }
-  curInfo.bVisible = show;
-  SetConsoleCursorInfo(hConsole, &curInfo);
+	SetEvent(data->wakeEvent);
 }
 
+// Console input is already unbuffered when read with _getch
+void CrosslineConsole::SetRaw(const bool raw, const bool paste)
+{
+}
 
-void CrosslinePrivate::ScreenGet (int &pRows, int &pCols)
+void CrosslineConsole::Suspend()
 {
-	CONSOLE_SCREEN_BUFFER_INFO inf;
-	GetConsoleScreenBufferInfo (term.hConsole, &inf);
-	pCols = inf.srWindow.Right - inf.srWindow.Left + 1;
-	pRows = inf.srWindow.Bottom - inf.srWindow.Top + 1;
-	pCols = pCols > 1 ? pCols : 160;
-	pRows = pRows > 1 ? pRows : 24;
 }
 
-bool Crossline::CursorGet (int &pRow, int &pCol)
+bool CrosslineConsole::Interactive() const
 {
-	CONSOLE_SCREEN_BUFFER_INFO inf;
-	GetConsoleScreenBufferInfo (privData->term.hConsole, &inf);
-	pRow = inf.dwCursorPosition.Y - inf.srWindow.Top;
-	pCol = inf.dwCursorPosition.X - inf.srWindow.Left;
-	return true;
+	return data->interactive;
 }
 
-void Crossline::CursorSet (const int row, const int col)
+bool CrosslineConsole::OutputTty() const
 {
-	CONSOLE_SCREEN_BUFFER_INFO inf;
-	GetConsoleScreenBufferInfo (privData->term.hConsole, &inf);
-	inf.dwCursorPosition.Y = (SHORT)row + inf.srWindow.Top;
-	inf.dwCursorPosition.X = (SHORT)col + inf.srWindow.Left;
-	SetConsoleCursorPosition (privData->term.hConsole, inf.dwCursorPosition);
+	return data->outConsole;
 }
 
-void Crossline::CursorMove (const int row_off, const int col_off)
+bool CrosslineConsole::Ansi() const
+{
+	return false;
+}
+
+void *CrosslineConsole::InputHandle() const
+{
+	return data->hIn;
+}
+
+void *CrosslineConsole::EventHandle() const
+{
+	return data->wakeEvent;
+}
+
+// The console API versions of the cursor and colour calls, they act immediately so pending
+// text is written first
+
+static void crossline_console_cursor(HANDLE hConsole, const bool show)
+{
+	CONSOLE_CURSOR_INFO curInfo;
+	if (!GetConsoleCursorInfo(hConsole, &curInfo)) {
+		return;
+	}
+	curInfo.bVisible = show;
+	SetConsoleCursorInfo(hConsole, &curInfo);
+}
+
+static void crossline_console_move(HANDLE hConsole, const bool relative, const int row, const int col)
 {
 	CONSOLE_SCREEN_BUFFER_INFO inf;
-	GetConsoleScreenBufferInfo (privData->term.hConsole, &inf);
-	inf.dwCursorPosition.Y += (SHORT)row_off;
-	inf.dwCursorPosition.X += (SHORT)col_off;
-	SetConsoleCursorPosition (privData->term.hConsole, inf.dwCursorPosition);
+	GetConsoleScreenBufferInfo (hConsole, &inf);
+	if (relative) {
+		inf.dwCursorPosition.Y += (SHORT)row;
+		inf.dwCursorPosition.X += (SHORT)col;
+	} else {
+		inf.dwCursorPosition.Y = (SHORT)row + inf.srWindow.Top;
+		inf.dwCursorPosition.X = (SHORT)col + inf.srWindow.Left;
+	}
+	SetConsoleCursorPosition (hConsole, inf.dwCursorPosition);
 }
 
-void Crossline::ColorSet (crossline_color_e color)
+static void crossline_console_color(HANDLE hConsole, WORD &dftAttributes, const crossline_color_e color)
 {
     CONSOLE_SCREEN_BUFFER_INFO scrInfo;
-	static WORD dft_wAttributes = 0;
 	WORD wAttributes = 0;
-	if (!dft_wAttributes) {
-		GetConsoleScreenBufferInfo(privData->term.hConsole, &scrInfo);
-		dft_wAttributes = scrInfo.wAttributes;
+	if (!dftAttributes) {
+		GetConsoleScreenBufferInfo(hConsole, &scrInfo);
+		dftAttributes = scrInfo.wAttributes;
 	}
 	if (CROSSLINE_FGCOLOR_DEFAULT == (color&CROSSLINE_FGCOLOR_MASK)) {
-		wAttributes |= dft_wAttributes & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY);
+		wAttributes |= dftAttributes & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY);
 	} else {
 		wAttributes |= (color&CROSSLINE_FGCOLOR_BRIGHT) ? FOREGROUND_INTENSITY : 0;
 		switch (color&CROSSLINE_FGCOLOR_MASK) {
@@ -650,7 +1827,7 @@ void Crossline::ColorSet (crossline_color_e color)
 		}
 	}
 	if (CROSSLINE_BGCOLOR_DEFAULT == (color&CROSSLINE_BGCOLOR_MASK)) {
-		wAttributes |= dft_wAttributes & (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE | BACKGROUND_INTENSITY);
+		wAttributes |= dftAttributes & (BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE | BACKGROUND_INTENSITY);
 	} else {
 		wAttributes |= (color&CROSSLINE_BGCOLOR_BRIGHT) ? BACKGROUND_INTENSITY : 0;
 		switch (color&CROSSLINE_BGCOLOR_MASK) {
@@ -665,291 +1842,1047 @@ void Crossline::ColorSet (crossline_color_e color)
 	}
 	if (color & CROSSLINE_UNDERLINE)
 		{ wAttributes |= COMMON_LVB_UNDERSCORE; }
-	SetConsoleTextAttribute(privData->term.hConsole, wAttributes);
+	SetConsoleTextAttribute(hConsole, wAttributes);
 }
 
 
 #else // Linux
 
-int TerminalClass::RawGetChar()
-{
-	char ch = 0;
-	struct termios old_term, cur_term;
-	fflush (stdout);
-	if (tcgetattr(STDIN_FILENO, &old_term) < 0)	{ perror("tcsetattr"); }
-	cur_term = old_term;
-	cur_term.c_lflag &= ~(ICANON | ECHO | ISIG); // echoing off, canonical off, no signal chars
-	cur_term.c_cc[VMIN] = 1;
-	cur_term.c_cc[VTIME] = 0;
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &cur_term) < 0)	{ perror("tcsetattr"); }
-	if (read(STDIN_FILENO, &ch, 1) < 0)	{ /* perror("read()"); */ } // signal will interrupt
-	if (tcsetattr(STDIN_FILENO, TCSADRAIN, &old_term) < 0)	{ perror("tcsetattr"); }
-	return ch;
+// Only the session on the process's own terminal touches these: signals are process wide, so
+// the terminal settings to put back if the process is terminated while in a raw session, and
+// the resize count, can't be kept per session.
+// Only async-signal-safe calls are made on these from the handlers
+static struct termios s_raw_orig_term;
+static volatile sig_atomic_t s_raw_active = 0;
+static struct sigaction s_raw_old_actions[4];
+static const int s_raw_signals[4] = {SIGTERM, SIGHUP, SIGQUIT, SIGABRT};
+
+static volatile sig_atomic_t s_paste_active = 0;
+
+static void crossline_raw_restore ()
+{
+	if (s_paste_active) {
+		s_paste_active = 0;
+		ssize_t ret = write(STDOUT_FILENO, "\x1b[?2004l", 8);
+		(void) ret;
+	}
+	if (s_raw_active) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &s_raw_orig_term);
+		s_raw_active = 0;
+	}
 }
 
-void TerminalClass::Print(const std::string &st)
+static void crossline_raw_signal (int sig)
 {
-	printf("%s", st.c_str());
+	crossline_raw_restore();
+	// pass the signal on to whatever handler was installed before us
+	for (int i = 0; i < 4; i++) {
+		if (s_raw_signals[i] == sig) {
+			sigaction(sig, &s_raw_old_actions[i], NULL);
+		}
+	}
+	raise(sig);
 }
 
-void TerminalClass::ShowCursor(const bool show)
+// SIGWINCH counts resizes and writes to the wake pipe of the session in raw mode on the
+// terminal, so its blocked read wakes up at once
+static volatile sig_atomic_t s_winch_count = 0;
+static volatile sig_atomic_t s_winch_wake = -1;
+
+static void crossline_winchg_event (int arg)
 {
- 	printf("\e[?25%c", show?'h':'l');
+	int err = errno;
+	s_winch_count = s_winch_count + 1;
+	if (s_winch_wake >= 0) {
+		ssize_t ret = write(s_winch_wake, "w", 1);
+		(void) ret;
+	}
+	errno = err;
 }
 
-void CrosslinePrivate::ScreenGet (int &pRows, int &pCols)
+static void crossline_winchg_reg ()
 {
-	struct winsize ws = {};
-	(void)ioctl (1, TIOCGWINSZ, &ws);
-	pCols = ws.ws_col;
-	pRows = ws.ws_row;
-	pCols = pCols > 1 ? pCols : 160;
-	pRows = pRows > 1 ? pRows : 24;
+	static bool registered = false;
+	if (registered) {
+		return;
+	}
+	registered = true;
+	struct sigaction sa;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = &crossline_winchg_event;
+	sigaction (SIGWINCH, &sa, NULL);
 }
 
-bool Crossline::CursorGet (int &rows, int &cols)
+static void crossline_raw_reg ()
 {
-    fflush(stdout);
+	static bool registered = false;
+	if (registered) {
+		return;
+	}
+	registered = true;
+	atexit(crossline_raw_restore);
+	struct sigaction sa;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sa.sa_handler = &crossline_raw_signal;
+	for (int i = 0; i < 4; i++) {
+		sigaction(s_raw_signals[i], &sa, &s_raw_old_actions[i]);
+	}
+}
 
-    struct termios raw;
+struct CrosslineConsole::Data {
+	int inFd;
+	int outFd;
+	bool inTty;
+	bool outTty;
+	bool interactive;
+	bool controlling;       // stdin is a terminal: gets SIGWINCH, SIGSTOP and the restore on signals
+	int wakePipe[2];        // Wake() and resizes make the read end readable
+	bool raw;
+	struct termios origIOS;
+};
 
-    // 1. Save original terminal settings
-    tcgetattr(STDIN_FILENO, &privData->term.origIOS);
-    raw = privData->term.origIOS;
+CrosslineConsole::CrosslineConsole(const int inFd, const int outFd) : data(new Data())
+{
+	data->inFd = inFd;
+	data->outFd = outFd;
+	data->inTty = isatty(inFd);
+	data->outTty = isatty(outFd);
+	data->controlling = (STDIN_FILENO == inFd) && data->inTty;
+	data->interactive = data->inTty && ((STDIN_FILENO != inFd) || crossline_term_usable());
+	data->raw = false;
+	data->wakePipe[0] = data->wakePipe[1] = -1;
+	if (0 == pipe(data->wakePipe)) {
+		for (int i = 0; i < 2; i++) {
+			fcntl(data->wakePipe[i], F_SETFL, fcntl(data->wakePipe[i], F_GETFL) | O_NONBLOCK);
+			fcntl(data->wakePipe[i], F_SETFD, FD_CLOEXEC);
+		}
+	}
+}
 
-    // 2. Disable canonical mode (line buffering) and echoing
-    raw.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+CrosslineConsole::~CrosslineConsole()
+{
+	if (data->raw) {
+		SetRaw(false, false);
+	}
+	if (s_winch_wake == data->wakePipe[1]) {
+		s_winch_wake = -1;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (data->wakePipe[i] >= 0) {
+			close(data->wakePipe[i]);
+		}
+	}
+	delete data;
+}
 
-    // 3. Send the escape sequence for "Device Status Report"
-    // \033[6n
-    if (write(STDOUT_FILENO, "\033[6n", 4) != 4) {
-        tcsetattr(STDIN_FILENO, TCSAFLUSH, &privData->term.origIOS);
-        return false;
-    }
+int CrosslineConsole::Read(char *buf, const size_t len, const int timeoutMs)
+{
+	struct pollfd fds[2];
+	fds[0].fd = data->inFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = data->wakePipe[0];
+	fds[1].events = POLLIN;
+	int nfds = (data->wakePipe[0] >= 0) ? 2 : 1;
+	if (poll(fds, nfds, timeoutMs) < 0) {
+		return (EINTR == errno) ? 0 : -1;
+	}
+	if ((nfds > 1) && (fds[1].revents & POLLIN)) {
+		char drain[32];
+		while (read(data->wakePipe[0], drain, sizeof(drain)) > 0) ;
+	}
+	if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+		ssize_t n = read(data->inFd, buf, len);
+		if (n > 0) {
+			return (int)n;
+		}
+		return ((n < 0) && ((EINTR == errno) || (EAGAIN == errno))) ? 0 : -1;
+	}
+	return 0;
+}
 
-    // 4. Read the response: \033[rows;colsR
-    char buffer[32];
-    unsigned int i = 0;
-    while (i < sizeof(buffer) - 1) {
-        if (read(STDIN_FILENO, &buffer[i], 1) != 1) break;
-        if (buffer[i] == 'R') break;
-        i++;
-    }
-    buffer[i] = '\0';
+// Output to stdout goes through stdio so it stays in order with what the application prints
+bool CrosslineConsole::Write(const char *st, const size_t len)
+{
+	if (STDOUT_FILENO == data->outFd) {
+		return fwrite(st, 1, len, stdout) == len;
+	}
+	size_t left = len;
+	while (left > 0) {
+		ssize_t n = write(data->outFd, st, left);
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return false;
+		}
+		st += n;
+		left -= n;
+	}
+	return true;
+}
+
+void CrosslineConsole::Flush()
+{
+	if (STDOUT_FILENO == data->outFd) {
+		fflush(stdout);
+	}
+}
+
+bool CrosslineConsole::Size(int &rows, int &cols)
+{
+	struct winsize ws = {};
+	if ((ioctl(data->outFd, TIOCGWINSZ, &ws) < 0) && (ioctl(data->inFd, TIOCGWINSZ, &ws) < 0)) {
+		return false;
+	}
+	rows = ws.ws_row;
+	cols = ws.ws_col;
+	return (rows > 0) && (cols > 0);
+}
 
-    // 5. Restore original terminal settings immediately
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &privData->term.origIOS);
+unsigned int CrosslineConsole::ResizeCount() const
+{
+	return data->controlling ? s_winch_count + resizes : (unsigned int)resizes;
+}
 
-    // 6. Parse the response (skipping the first two characters '\033[')
-    rows = 0;
-    cols = 0;
-    if (buffer[0] != '\033' || buffer[1] != '[') return false;
-    if (sscanf(&buffer[2], "%d;%d", &rows, &cols) != 2) return false;
+void CrosslineConsole::Wake()
+{
+	if (data->wakePipe[1] >= 0) {
+		ssize_t ret = write(data->wakePipe[1], "k", 1);
+		(void) ret;
+	}
+}
 
-    rows--;
-    cols--;
-    return true;
+void CrosslineConsole::SetRaw(const bool raw, const bool paste)
+{
+	if (!raw) {
+		CrosslineTerminal::SetRaw(false, false);
+		if (data->controlling) {
+			s_paste_active = 0;
+		}
+	}
+	if (raw && !data->raw && data->inTty) {
+		struct termios cur_term;
+		if (tcgetattr(data->inFd, &data->origIOS) < 0)	{ perror("tcgetattr"); return; }
+		cur_term = data->origIOS;
+		cur_term.c_lflag &= ~(ICANON | ECHO | ISIG); // echoing off, canonical off, no signal chars
+		cur_term.c_cc[VMIN] = 1;
+		cur_term.c_cc[VTIME] = 0;
+		if (data->controlling) {
+			crossline_raw_reg();
+			crossline_winchg_reg();
+			s_raw_orig_term = data->origIOS;
+			s_raw_active = 1;
+			s_winch_wake = data->wakePipe[1];
+		}
+		data->raw = true;
+		if (tcsetattr(data->inFd, TCSANOW, &cur_term) < 0)	{ perror("tcsetattr"); }
+	} else if (!raw && data->raw) {
+		if (data->controlling) {
+			s_raw_active = 0;
+		}
+		data->raw = false;
+		if (tcsetattr(data->inFd, TCSADRAIN, &data->origIOS) < 0)	{ perror("tcsetattr"); }
+	}
+	if (raw) {
+		CrosslineTerminal::SetRaw(true, paste);
+		if (data->controlling) {
+			s_paste_active = pasteOn;
+		}
+	}
 }
 
-void Crossline::CursorSet (int row, int col)
+void CrosslineConsole::Suspend()
 {
-	printf("\e[%d;%dH", row+1, col+1);
+	if (data->controlling) {
+		raise(SIGSTOP);    // Suspend current process
+	}
 }
 
-void Crossline::CursorMove (int row_off, int col_off)
+bool CrosslineConsole::Interactive() const
 {
-	if (col_off > 0)		{ printf ("\e[%dC", col_off);  }
-	else if (col_off < 0)	{ printf ("\e[%dD", -col_off); }
-	if (row_off > 0)		{ printf ("\e[%dB", row_off);  }
-	else if (row_off < 0)	{ printf ("\e[%dA", -row_off); }
+	return data->interactive;
 }
 
-void Crossline::ColorSet (crossline_color_e color)
+bool CrosslineConsole::OutputTty() const
 {
-	if (!isatty(STDOUT_FILENO))		{ return; }
-	printf ("\033[m");
-	if (CROSSLINE_FGCOLOR_DEFAULT != (color&CROSSLINE_FGCOLOR_MASK))
-		{ printf ("\033[%dm", 29 + (color&CROSSLINE_FGCOLOR_MASK) + ((color&CROSSLINE_FGCOLOR_BRIGHT)?60:0)); }
-	if (CROSSLINE_BGCOLOR_DEFAULT != (color&CROSSLINE_BGCOLOR_MASK))
-		{ printf ("\033[%dm", 39 + ((color&CROSSLINE_BGCOLOR_MASK)>>8) + ((color&CROSSLINE_BGCOLOR_BRIGHT)?60:0)); }
-	if (color & CROSSLINE_UNDERLINE)
-		{ printf ("\033[4m"); }
+	return data->outTty;
+}
+
+bool CrosslineConsole::Ansi() const
+{
+	return true;
+}
+
+int CrosslineConsole::InputFd() const
+{
+	return data->inFd;
+}
+
+int CrosslineConsole::EventFd() const
+{
+	return data->wakePipe[0];
 }
 
 #endif // #ifdef _WIN32
 
 /*****************************************************************************/
 
-static void crossline_show_help (Crossline &cLine, int show_search)
+// Bracketed paste for xterm alike terminals, pastes then arrive between Esc[200~ and Esc[201~
+void CrosslineTerminal::SetRaw(const bool raw, const bool paste)
 {
-	int	i;
-	std::string *help = show_search ? s_search_help : s_crossline_help;
- 	cLine.PrintStr(" \b\n");
-	for (i = 0; help[i].length()>0; ++i) {
-		cLine.PrintStr(help[i] + "\n");
-		if (cLine.PagingCheck (help[i].length()+1))
-			{ break; }
+	const bool on = raw && paste && Ansi() && OutputTty();
+	if (on != pasteOn) {
+		pasteOn = on;
+		Write(on ? "\x1b[?2004h" : "\x1b[?2004l", 8);
+		Flush();
 	}
 }
 
-static void str_to_lower (std::string &str)
+void TerminalClass::RawBegin(const bool paste)
 {
-	for (int i = 0; i < str.length(); i++) {
-		str[i] = (char)tolower (str[i]);
+	if (rawDepth++ == 0) {
+		Flush();
+		resizeReported = ResizeCount();   // the first draw uses the current size anyway
+		pasteWanted = paste;
+		io->SetRaw(true, paste);
 	}
 }
 
-// Match including(no prefix) and excluding(with prefix: '-') patterns.
-static bool crossline_match_patterns (const std::string &str, std::vector<std::string> &word, int num)
+void TerminalClass::RawEnd()
 {
-	int i;
-	std::string buf;
-
-	buf = str;
-	str_to_lower (buf);
-	for (i = 0; i < num; ++i) {
-		std::string::const_iterator wp = word[i].begin();
-		if ('-' == word[i][0]) {
-			if (NULL != strstr (buf.c_str(), &*(wp+1))) {
-				return false;
-			}
-		} else if (NULL == strstr (buf.c_str(), &*wp)) {
-			return false;
-		}
+	if ((rawDepth > 0) && (--rawDepth == 0)) {
+		Flush();
+		io->SetRaw(false, false);
 	}
-	return true;
 }
 
-// Split pattern string to individual pattern list, handle composite words embraced with " ".
-static int crossline_split_patterns (std::string &patterns, std::vector<std::string> &pat_list)
+void TerminalClass::Suspend()
 {
-	int i, num = 0;
+	Flush();
+	if (rawDepth > 0) {
+		io->SetRaw(false, false);
+	}
+	io->Suspend();
+	if (rawDepth > 0) {
+		io->SetRaw(true, pasteWanted);
+	}
+}
 
-	if (patterns.length() == 0) {
+// Read whatever is available into the input buffer with one read from the terminal.
+// Outside a raw session the terminal is only switched for this read.
+// Returns -1 if woken by a resize or Wake() and allowEvent, otherwise the number of bytes read,
+// 0 at the end of input or once timeoutMs has passed
+int TerminalClass::ReadInput(const bool allowEvent, const int timeoutMs)
+{
+	int space;
+	if (inTail >= inHead) {
+		space = InBufLen - inTail - (inHead == 0 ? 1 : 0);
+	} else {
+		space = inHead - inTail - 1;
+	}
+	if (space <= 0) {
 		return 0;
 	}
-
-	std::string::iterator pch = patterns.begin();
-	while (' ' == *pch)	{
-		++pch;
+	Flush();
+	const bool temp = rawDepth == 0;
+	if (temp) { io->SetRaw(true, false); }
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeoutMs, 0));
+	int n = 0;
+	while (true) {
+		if (allowEvent && EventPending()) {
+			n = -1;
+			break;
+		}
+		int wait = timeoutMs;
+		if (timeoutMs > 0) {
+			wait = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+			wait = std::max(wait, 0);
+		}
+		n = io->Read((char*)inBuf + inTail, space, wait);
+		if (n > 0) {
+			inTail = (inTail + n) % InBufLen;
+			readCount++;
+			break;
+		}
+		if ((n < 0) || ((timeoutMs >= 0) && (wait == 0))) {
+			n = 0;
+			break;
+		}
 	}
-	while ((pch != patterns.end())) {
-		if (('"' == *pch) || (('-' == *pch) && ('"' == *(pch+1)))) {
-			if ('"' != *pch)	{
-				*(pch+1) = '-';
-			}
-			pat_list.push_back(&*(++pch));
-			num++;
-
-			int pos = pch - patterns.begin();
-			int ind = patterns.find("\"", pos);
-			if (ind != patterns.npos) {
-				pch = patterns.begin() + pos;
-				*pch = '\0';
-				pch++;
-				while (' ' == *pch)	{ ++pch; }
-			} else {
-				pch = patterns.end();
-			}
-		} else {
-			pat_list.push_back(&*pch);
-			num++;
-			int pos = pch - patterns.begin();
-			int ind = patterns.find(" ", pos);
-			if (ind != patterns.npos) {
-				pch = patterns.begin() + pos;
-				*pch = '\0';
-				pch++;
-				while (' ' == *pch)	{ ++pch; }
-			} else {
-				pch = patterns.end();
-			}
+	if (temp) { io->SetRaw(false, false); }
+	return n;
+}
 
+int TerminalClass::RawGetChar(const bool allowEvent)
+{
+	while (inHead == inTail) {
+		int n = ReadInput(allowEvent);
+		if (n < 0) {
+			return KEY_RESIZE;    // an event, GetChar sorts out which
+		} else if (0 == n) {
+			inputEnded = true;
+			return 0;
 		}
 	}
-	for (i = 0; i < num; ++i)
-		{ str_to_lower (pat_list[i]); }
+	inputEnded = false;
+	int ch = inBuf[inHead];
+	inHead = (inHead + 1) % InBufLen;
+	return ch;
+}
 
-	return num;
+unsigned int TerminalClass::ResizeCount() const
+{
+	return io->ResizeCount();
 }
 
+void TerminalClass::Wake()
+{
+	wakeCount++;
+	io->Wake();
+}
 
-std::vector<char> MakeIndexKeys()
+bool TerminalClass::InputReady()
 {
-	const int maxKeys = 9 + 2*26;
-	std::vector<char> keys(maxKeys, ' ');
+	if ((curBuf >= 0) || (inHead != inTail) || EventPending()) {
+		return true;
+	}
+	// a zero timeout read also drains the wake pipe, the counts say what happened so a
+	// caller's poll doesn't spin
+	return (ReadInput(false, 0) > 0) || EventPending();
+}
 
-	char noKeys[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
-	for (int i = 0; i < 9; i++) {
-		keys[i] = noKeys[i];
+bool TerminalClass::InputWait(const int ms)
+{
+	if ((curBuf >= 0) || (inHead != inTail) || EventPending()) {
+		return true;
 	}
-	int k = 9;
-	for (char c = 'a'; c <= 'z'; c++) {
-		keys[k++] = c;
+	return (ReadInput(true, std::max(ms, 0)) != 0) || EventPending();
+}
+
+int TerminalClass::GetCharWait(const int ms)
+{
+	if (curBuf >= 0) {
+		return buffer[curBuf--];
 	}
-	for (char c = 'A'; c <= 'Z'; c++) {
-		keys[k++] = c;
+	if ((inHead == inTail) && (ReadInput(false, std::max(ms, 0)) <= 0)) {
+		return -1;
 	}
+	return RawGetChar(false);
+}
 
-	return keys;
+void TerminalClass::Flush()
+{
+	if (outBuf.length() > 0) {
+		if (stats && stats->On()) {
+			stats->Count(stats->frames);
+			stats->Count(stats->writes);
+			stats->Count(stats->bytes, outBuf.length());
+			stats->frameBytes.Add(outBuf.length());
+		}
+		io->Write(outBuf.data(), outBuf.length());
+		outBuf.clear();
+	}
+	io->Flush();
 }
 
+void TerminalClass::ShowCursor(const bool show)
+{
+#ifdef _WIN32
+	if (!ansi) {
+		Flush();
+		crossline_console_cursor(hConsole, show);
+		return;
+	}
+#endif
+	Print(show ? "\x1b[?25h" : "\x1b[?25l", 6);
+}
 
-// If patterns is not NULL, will filter history.
+void TerminalClass::ScreenQuery (int &pRows, int &pCols)
+{
+	if (!io->Size(pRows, pCols)) {
+		pRows = pCols = 0;
+	}
+	pCols = pCols > 1 ? pCols : 160;
+	pRows = pRows > 1 ? pRows : 24;
+}
+
+bool TerminalClass::CursorGet (int &row, int &col)
+{
+#ifdef _WIN32
+	if (!ansi) {
+		Flush();
+		CONSOLE_SCREEN_BUFFER_INFO inf;
+		if (!GetConsoleScreenBufferInfo (hConsole, &inf)) {
+			return false;
+		}
+		row = inf.dwCursorPosition.Y - inf.srWindow.Top;
+		col = inf.dwCursorPosition.X - inf.srWindow.Left;
+		return true;
+	}
+#endif
+	Flush();
+	const bool temp = rawDepth == 0;
+	if (temp) { io->SetRaw(true, false); }
+
+	// Send the "Device Status Report" request and read the response: \033[rows;colsR
+	// Keys typed ahead of the response are kept for GetChar
+	bool ok = io->Write("\033[6n", 4);
+	io->Flush();
+	char reply[32];
+	unsigned int len = 0;
+	while (ok && (len < sizeof(reply) - 1)) {
+		char ch;
+		if (io->Read(&ch, 1, 500) != 1) {
+			break;
+		}
+		if ((0 == len) && (ch != '\033')) {
+			PushInput(ch);
+			continue;
+		}
+		if ('R' == ch) {
+			break;
+		}
+		reply[len++] = ch;
+	}
+	reply[len] = '\0';
+
+	if (temp) { io->SetRaw(false, false); }
+
+	// Parse the response (skipping the first two characters '\033[')
+	row = 0;
+	col = 0;
+	if (reply[0] != '\033' || reply[1] != '[') return false;
+	if (sscanf(&reply[2], "%d;%d", &row, &col) != 2) return false;
+
+	row--;
+	col--;
+	return true;
+}
+
+void TerminalClass::CursorSet (const int row, const int col)
+{
+#ifdef _WIN32
+	if (!ansi) {
+		Flush();
+		crossline_console_move(hConsole, false, row, col);
+		return;
+	}
+#endif
+	char seq[32];
+	int len = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row+1, col+1);
+	Print(seq, len);
+}
+
+void TerminalClass::CursorMove (const int row_off, const int col_off)
+{
+#ifdef _WIN32
+	if (!ansi) {
+		Flush();
+		crossline_console_move(hConsole, true, row_off, col_off);
+		return;
+	}
+#endif
+	char seq[32];
+	int len = 0;
+	if (col_off > 0)		{ len += snprintf (seq, sizeof(seq), "\x1b[%dC", col_off);  }
+	else if (col_off < 0)	{ len += snprintf (seq, sizeof(seq), "\x1b[%dD", -col_off); }
+	if (row_off > 0)		{ len += snprintf (seq+len, sizeof(seq)-len, "\x1b[%dB", row_off);  }
+	else if (row_off < 0)	{ len += snprintf (seq+len, sizeof(seq)-len, "\x1b[%dA", -row_off); }
+	if (len > 0) {
+		Print(seq, len);
+	}
+}
+
+// Send the whole colour as one SGR sequence, nothing if it is already set
+void TerminalClass::ColorSet (const crossline_color_e color)
+{
+#ifdef _WIN32
+	if (!ansi) {
+		Flush();
+		crossline_console_color(hConsole, dftAttributes, color);
+		return;
+	}
+#endif
+	if (!io->OutputTty() || (color == curColor))		{ return; }
+	curColor = color;
+	char seq[32];
+	int len = snprintf (seq, sizeof(seq), "\033[0");
+	if (CROSSLINE_FGCOLOR_DEFAULT != (color&CROSSLINE_FGCOLOR_MASK))
+		{ len += snprintf (seq+len, sizeof(seq)-len, ";%d", 29 + (color&CROSSLINE_FGCOLOR_MASK) + ((color&CROSSLINE_FGCOLOR_BRIGHT)?60:0)); }
+	if (CROSSLINE_BGCOLOR_DEFAULT != (color&CROSSLINE_BGCOLOR_MASK))
+		{ len += snprintf (seq+len, sizeof(seq)-len, ";%d", 39 + ((color&CROSSLINE_BGCOLOR_MASK)>>8) + ((color&CROSSLINE_BGCOLOR_BRIGHT)?60:0)); }
+	if (color & CROSSLINE_UNDERLINE)
+		{ len += snprintf (seq+len, sizeof(seq)-len, ";4"); }
+	len += snprintf (seq+len, sizeof(seq)-len, "m");
+	Print(seq, len);
+}
+
+void TerminalClass::Clear ()
+{
+#ifdef _WIN32
+	if (!ansi) {
+		Flush();
+		int ret = system ("cls");
+		(void) ret;
+		return;
+	}
+#endif
+	Print("\x1b[H\x1b[2J", 7);
+}
+
+/*****************************************************************************/
+
+static void crossline_show_help (Crossline &cLine, int show_search)
+{
+	int	i;
+	std::string *help = show_search ? s_search_help : s_crossline_help;
+ 	cLine.PrintStr(" \b\n");
+	for (i = 0; help[i].length()>0; ++i) {
+		cLine.PrintStr(help[i] + "\n");
+		if (cLine.PagingCheck (help[i].length()+1))
+			{ break; }
+	}
+}
+
+// History search patterns
+
+static inline unsigned char crossline_fold (unsigned char c)
+{
+	return ((c >= 'A') && (c <= 'Z')) ? (c | 0x20) : c;
+}
+
+// Patterns compiled once into lower case needles, matched against each line with no allocation
+struct CrosslinePatterns {
+	std::vector<std::string> include;
+	std::vector<std::string> exclude;
+
+	bool Empty() const { return include.empty() && exclude.empty(); }
+	int  Find(const std::string_view &st) const;
+	bool Match(const std::string_view &st) const { return Find(st) >= 0; }
+};
+
+// needle[1..n-2] against hay, the first and last chars are already known to match
+static inline bool crossline_match_inner (const char *hay, const std::string &needle)
+{
+	for (size_t j = 1; j+1 < needle.length(); j++) {
+		if (crossline_fold(hay[j]) != (unsigned char)needle[j]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Case insensitive (ASCII) search for a lower case needle.  Candidate positions are those where
+// the first and last chars of the needle match, checked a vector at a time; letters are folded
+// by OR-ing in 0x20, which is exact for ASCII letters.  Returns the offset or npos
+static size_t crossline_find_nocase (const char *hay, size_t len, const std::string &needle)
+{
+	const size_t n = needle.length();
+	if (n == 0) {
+		return 0;
+	}
+	if (n > len) {
+		return std::string::npos;
+	}
+	const unsigned char first = needle[0], last = needle[n-1];
+	const unsigned char firstMask = isalpha(first) ? 0x20 : 0, lastMask = isalpha(last) ? 0x20 : 0;
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	const __m256i vFirst = _mm256_set1_epi8((char)first), vLast = _mm256_set1_epi8((char)last);
+	const __m256i vFirstMask = _mm256_set1_epi8((char)firstMask), vLastMask = _mm256_set1_epi8((char)lastMask);
+	for (; i + n - 1 + 32 <= len; i += 32) {
+		__m256i blockFirst = _mm256_loadu_si256((const __m256i*)(hay + i));
+		__m256i blockLast = _mm256_loadu_si256((const __m256i*)(hay + i + n - 1));
+		__m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(blockFirst, vFirstMask), vFirst),
+		                              _mm256_cmpeq_epi8(_mm256_or_si256(blockLast, vLastMask), vLast));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (crossline_match_inner(hay + i + bit, needle)) {
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	const __m128i vFirst = _mm_set1_epi8((char)first), vLast = _mm_set1_epi8((char)last);
+	const __m128i vFirstMask = _mm_set1_epi8((char)firstMask), vLastMask = _mm_set1_epi8((char)lastMask);
+	for (; i + n - 1 + 16 <= len; i += 16) {
+		__m128i blockFirst = _mm_loadu_si128((const __m128i*)(hay + i));
+		__m128i blockLast = _mm_loadu_si128((const __m128i*)(hay + i + n - 1));
+		__m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(blockFirst, vFirstMask), vFirst),
+		                           _mm_cmpeq_epi8(_mm_or_si128(blockLast, vLastMask), vLast));
+		unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+		while (mask) {
+  #ifdef _MSC_VER
+			unsigned long bit;
+			_BitScanForward(&bit, mask);
+  #else
+			int bit = __builtin_ctz(mask);
+  #endif
+			if (crossline_match_inner(hay + i + bit, needle)) {
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t vFirst = vdupq_n_u8(first), vLast = vdupq_n_u8(last);
+	const uint8x16_t vFirstMask = vdupq_n_u8(firstMask), vLastMask = vdupq_n_u8(lastMask);
+	for (; i + n - 1 + 16 <= len; i += 16) {
+		uint8x16_t blockFirst = vld1q_u8((const uint8_t*)(hay + i));
+		uint8x16_t blockLast = vld1q_u8((const uint8_t*)(hay + i + n - 1));
+		uint8x16_t eq = vandq_u8(vceqq_u8(vorrq_u8(blockFirst, vFirstMask), vFirst),
+		                         vceqq_u8(vorrq_u8(blockLast, vLastMask), vLast));
+		// narrow to 4 bits per byte, there is no movemask
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+		while (mask) {
+			int bit = __builtin_ctzll(mask) >> 2;
+			if (crossline_match_inner(hay + i + bit, needle)) {
+				return i + bit;
+			}
+			mask &= ~(0xfULL << (bit*4));
+		}
+	}
+#endif
+
+	for (; i + n <= len; i++) {
+		if ((crossline_fold(hay[i]) == first) && (crossline_fold(hay[i+n-1]) == last) &&
+		    crossline_match_inner(hay + i, needle)) {
+			return i;
+		}
+	}
+	return std::string::npos;
+}
+
+// Match including(no prefix) and excluding(with prefix: '-') patterns.
+// Returns where the first including pattern is in st, -1 if st doesn't match
+int CrosslinePatterns::Find(const std::string_view &st) const
+{
+	for (const std::string &pat : exclude) {
+		if (crossline_find_nocase(st.data(), st.length(), pat) != std::string::npos) {
+			return -1;
+		}
+	}
+	int first = 0;
+	for (size_t i = 0; i < include.size(); i++) {
+		size_t at = crossline_find_nocase(st.data(), st.length(), include[i]);
+		if (at == std::string::npos) {
+			return -1;
+		}
+		if (i == 0) {
+			first = at;
+		}
+	}
+	return first;
+}
+
+// Entries which may hold the patterns, from the trigram index on the longest including pattern.
+// Returns false if the index can't help and everything has to be checked
+static bool crossline_pattern_candidates (HistoryClass &history, const CrosslinePatterns &pat, std::vector<int> &cand)
+{
+	if (pat.include.empty()) {
+		return false;
+	}
+	const std::string *longest = &pat.include[0];
+	for (const std::string &p : pat.include) {
+		if (p.length() > longest->length())		{ longest = &p; }
+	}
+	return history.IndexCandidates(*longest, cand);
+}
+
+// Whatever matches to also matches from, so to's matches can be found among from's
+static bool crossline_patterns_narrow (const CrosslinePatterns &from, const CrosslinePatterns &to)
+{
+	if (!from.exclude.empty() || !to.exclude.empty()) {
+		return false;
+	}
+	for (const std::string &oldPat : from.include) {
+		bool found = false;
+		for (const std::string &newPat : to.include) {
+			if (newPat.find(oldPat) != newPat.npos) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Split pattern string to individual pattern list, handle composite words embraced with " ".
+static int crossline_split_patterns (const std::string &patterns, CrosslinePatterns &pat)
+{
+	pat.include.clear();
+	pat.exclude.clear();
+
+	size_t pos = 0, len = patterns.length();
+	while (pos < len) {
+		while ((pos < len) && (' ' == patterns[pos])) {
+			pos++;
+		}
+		if (pos >= len) {
+			break;
+		}
+		bool excl = false;
+		if (('-' == patterns[pos]) && (pos+1 < len) && (' ' != patterns[pos+1])) {
+			excl = true;
+			pos++;
+		}
+		size_t end;
+		if ('"' == patterns[pos]) {
+			pos++;
+			end = patterns.find('"', pos);
+		} else {
+			end = patterns.find(' ', pos);
+		}
+		if (end == patterns.npos) {
+			end = len;
+		}
+		std::string word = patterns.substr(pos, end-pos);
+		for (size_t i = 0; i < word.length(); i++) {
+			word[i] = crossline_fold(word[i]);
+		}
+		if (word.length() > 0) {
+			(excl ? pat.exclude : pat.include).push_back(word);
+		}
+		pos = end + 1;
+	}
+
+	return pat.include.size() + pat.exclude.size();
+}
+
+
+/*****************************************************************************/
+
+// Incremental history search
+
+// Search results are ranked by age plus a penalty for where the match is in the line
+#define CROSS_SEARCH_POS_WEIGHT		4
+// How many results are ranked at a time
+#define CROSS_SEARCH_RANK_PAGE		16
+
+// A history entry matching the search and where the first pattern is in it
+struct CrosslineSearchHit {
+	int ind;
+	int pos;
+};
+
+// The matches for one search pattern, each key typed adds a level and Backspace pops it
+struct CrosslineSearchLevel {
+	std::string pattern;
+	CrosslinePatterns pat;
+	std::vector<CrosslineSearchHit> hits;  // in history order
+	std::vector<CrosslineSearchHit> top;   // best first, only the part that has been shown
+	bool topAll = false;                   // top holds all the hits
+};
+
+// Find the hits for level.pat among from's hits, or in all the history if from is NULL
+static void crossline_search_filter (HistoryClass &history, CrosslineSearchLevel &level,
+                                     const CrosslineSearchLevel *from, const bool noRepeats)
+{
+	level.hits.clear();
+	level.top.clear();
+	level.topAll = false;
+	if (level.pat.Empty()) {
+		return;
+	}
+	if (from != NULL) {
+		for (const CrosslineSearchHit &hit : from->hits) {
+			int pos = level.pat.Find(history.GetHistoryView(hit.ind));
+			if (pos >= 0) {
+				level.hits.push_back({hit.ind, pos});
+			}
+		}
+		return;
+	}
+	std::vector<int> cand;
+	bool useCand = crossline_pattern_candidates (history, level.pat, cand);
+	int noHist = useCand ? cand.size() : history.Size();
+	for (int i = 0; i < noHist; i++) {
+		int ind = useCand ? cand[i] : i;
+		if (noRepeats && history.IsRepeat(ind)) {
+			continue;   // only the newest is shown
+		}
+		int pos = level.pat.Find(history.GetHistoryView(ind));
+		if (pos >= 0) {
+			level.hits.push_back({ind, pos});
+		}
+	}
+}
+
+// Rank at least want hits into level.top, only the top few are sorted
+static void crossline_search_rank (HistoryClass &history, CrosslineSearchLevel &level, size_t want)
+{
+	const int noHist = history.Size();
+	auto better = [noHist](const CrosslineSearchHit &a, const CrosslineSearchHit &b) {
+		int64_t sa = (int64_t)(noHist - a.ind) + CROSS_SEARCH_POS_WEIGHT * a.pos;
+		int64_t sb = (int64_t)(noHist - b.ind) + CROSS_SEARCH_POS_WEIGHT * b.pos;
+		return (sa != sb) ? (sa < sb) : (a.ind > b.ind);
+	};
+	size_t k = std::min(want, level.hits.size());
+	level.top.resize(k);
+	std::partial_sort_copy(level.hits.begin(), level.hits.end(), level.top.begin(), level.top.end(), better);
+	level.topAll = (k == level.hits.size());
+}
+
+std::vector<char> MakeIndexKeys()
+{
+	const int maxKeys = 9 + 2*26;
+	std::vector<char> keys(maxKeys, ' ');
+
+	char noKeys[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+	for (int i = 0; i < 9; i++) {
+		keys[i] = noKeys[i];
+	}
+	int k = 9;
+	for (char c = 'a'; c <= 'z'; c++) {
+		keys[k++] = c;
+	}
+	for (char c = 'A'; c <= 'Z'; c++) {
+		keys[k++] = c;
+	}
+
+	return keys;
+}
+
+
+// If patterns is not NULL, will filter history.
 // matches gives a list matching the dump id with the index in history
 // update to assume that patterns is a string to be matched in the history
 // if forward then move from 0 to no
+#define CROSS_SCAN_CHUNK		16384	// entries a search thread takes at a time
+
+// Check entries [beg, end) of the scan order (newest first unless forward, through cand if
+// the index gave candidates) and add the matching ones to found until it has limit.  When
+// cutoff goes below chunk the rest of these entries aren't needed and the scan stops
+static void crossline_scan_history (HistoryClass &history, const CrosslinePatterns &pat, const std::vector<int> *cand,
+                                    const int noHist, const bool forward, const bool noRepeats, const int beg,
+                                    const int end, const size_t limit, std::vector<std::pair<std::string, int>> &found,
+                                    const std::atomic<int> *cutoff, const int chunk)
+{
+	for (int i = beg; (i < end) && (found.size() < limit); i++) {
+		if ((cutoff != nullptr) && !((i - beg) & 0xff) && (chunk > cutoff->load(std::memory_order_relaxed))) {
+			return;
+		}
+		int ind = forward ? i : noHist - 1 - i;
+		if (cand != nullptr) {
+			ind = (*cand)[ind];
+		}
+		std::string_view hisView = history.GetHistoryView(ind);
+		if (hisView.length() > 0) {
+			if (!pat.Empty() && !pat.Match(hisView)) {
+				continue;
+			}
+			// avoid repeats, only the newest is shown
+			if (noRepeats && history.IsRepeat(ind)) {
+				continue;
+			}
+			found.push_back({std::string(hisView), ind});
+		}
+	}
+}
+
+// The same scan split into chunks of CROSS_SCAN_CHUNK entries, which threads take in order.
+// Once the chunks up to one have all been scanned and have limit matches between them the
+// later ones are given up, so a search that finds its matches among the newest entries
+// stops about as soon as it would on one thread
+static void crossline_scan_parallel (HistoryClass &history, const CrosslinePatterns &pat, const std::vector<int> *cand,
+                                     const int noHist, const bool forward, const bool noRepeats, const int threads,
+                                     const size_t limit, std::vector<std::pair<std::string, int>> &found)
+{
+	const int chunks = (noHist + CROSS_SCAN_CHUNK - 1) / CROSS_SCAN_CHUNK;
+	std::vector<std::vector<std::pair<std::string, int>>> results(chunks);
+	std::vector<bool> done(chunks, false);
+	std::atomic<int> next(0);
+	std::atomic<int> cutoff(INT_MAX);	// the last chunk needed
+	std::mutex doneMutex;
+	int doneTo = 0;			// chunks [0, doneTo) have been scanned
+	size_t doneFound = 0;	// and matched this many
+
+	if (noRepeats && (noHist > 0)) {
+		// brings the fingerprints up to date, the threads only read them
+		history.IsRepeat((cand != nullptr) ? (*cand)[0] : 0);
+	}
+	auto work = [&]() {
+		for (int c = next++; (c < chunks) && (c <= cutoff.load()); c = next++) {
+			crossline_scan_history (history, pat, cand, noHist, forward, noRepeats, c * CROSS_SCAN_CHUNK,
+			                        std::min(noHist, (c + 1) * CROSS_SCAN_CHUNK), limit, results[c], &cutoff, c);
+			std::lock_guard<std::mutex> lock(doneMutex);
+			done[c] = true;
+			while ((doneTo < chunks) && done[doneTo] && (doneFound < limit)) {
+				doneFound += results[doneTo++].size();
+			}
+			if (doneFound >= limit) {
+				cutoff = std::min(cutoff.load(), doneTo - 1);
+			}
+		}
+	};
+	std::vector<std::thread> pool;
+	for (int t = 1; t < std::min(threads, chunks); t++) {
+		pool.emplace_back(work);
+	}
+	work();
+	for (std::thread &t : pool) {
+		t.join();
+	}
+
+	// the chunks up to cutoff are complete, in order they are the matches a single scan finds
+	for (int c = 0; (c < chunks) && (found.size() < limit); c++) {
+		for (size_t k = 0; (k < results[c].size()) && (found.size() < limit); k++) {
+			found.push_back(std::move(results[c][k]));
+		}
+	}
+}
+
 int Crossline::HistoryDump(const bool print_id, std::string patterns,
                            std::map<std::string, int> &matches,
                            const int maxNo, const bool forward)
 {
-	int	id = 0, num=0;
-	std::vector<std::string> pat_list;
+    CrosslineStatsTimer timer(&privData->stats, privData->stats.historyDump);
     matches.clear();
+	history->HistorySync(true);   // search everything
 
 	bool noRepeats = privData->history_noSearchRepeats;
-	std::map<std::string, int> matched;
-    std::vector<std::string> patMatches;
+    std::vector<std::pair<std::string, int>> patMatches;
 
 	std::vector<char> keys = MakeIndexKeys();
 	int maxKeys = keys.size();
 
-	// first get up to maxKeys matches
-	int noHist = history->Size();
-	int count = 0;
-	for (int i = 0; i < noHist; i++) {
-		// std::string &history = cLine.info->s_history_items[i];
-		int ind = i;
-		if (!forward) {
-			ind = noHist - 1 - i;
-		}
-		HistoryItemPtr hisPtr = history->GetHistoryItem(ind);
-		const std::string &hisSt = hisPtr->item;
-		if (hisSt.length() > 0) {
-			if ((patterns.length() > 0) && hisSt.find(patterns) == hisSt.npos) {
-				continue;
-			}
-			// avoid repeats
-            if (noRepeats && matched.count(hisSt)) {
-				continue;
-			}
-			matched[hisSt] = ind;
-			patMatches.push_back(hisSt);
-			if (++count > maxKeys) {
-				break;
-				}
-		}
+	CrosslinePatterns pat;
+	crossline_split_patterns (patterns, pat);
+
+	// the trigram index, when enabled, narrows the scan to entries that can match
+	std::vector<int> cand;
+	bool useCand = crossline_pattern_candidates (*history, pat, cand);
+
+	// first get up to maxKeys matches, newest first unless forward
+	int noHist = useCand ? cand.size() : history->Size();
+	int threads = privData->history_search_threads;
+	if (threads <= 0) {
+		threads = std::max<int>(std::thread::hardware_concurrency(), 1);
 	}
+	if ((threads > 1) && (noHist >= 2 * CROSS_SCAN_CHUNK)) {
+		crossline_scan_parallel (*history, pat, useCand ? &cand : nullptr, noHist, forward, noRepeats,
+		                         threads, maxKeys, patMatches);
+	} else {
+		crossline_scan_history (*history, pat, useCand ? &cand : nullptr, noHist, forward, noRepeats,
+		                        0, noHist, maxKeys, patMatches, nullptr, 0);
+	}
+	int count = patMatches.size();
 
-	// num = crossline_split_patterns (patterns, pat_list);
 	int noShow = count;
 	if (maxNo > 0 and noShow > maxNo) {
 		noShow = maxNo;
 	}
 
 	for (int i = 0; i < noShow; i++) {
-		std::string &hisSt = patMatches[i];
+		std::string &hisSt = patMatches[i].first;
 				if (print_id) {
 
 				    std::ostringstream msg;
@@ -962,7 +2895,7 @@ int Crossline::HistoryDump(const bool print_id, std::string patterns,
 
 					msg.str(std::string()); // clear
 			msg << k;
-			matches[msg.str()] = matched[hisSt];
+			matches[msg.str()] = patMatches[i].second;
 				} else {
 			PrintStr(hisSt + "\n");
 		}
@@ -1022,1523 +2955,4846 @@ std::pair<int, std::string> Crossline::HistorySearch (std::string &input)
 }
 
 
-// Show completions returned by callback.
-int Crossline::ShowCompletions (std::map<std::string, int> &matches)
+// Move off rows up (<0) or down, through Refresh so a line taller than the screen scrolls
+bool Crossline::UpdownMove (const std::string &prompt, EditBuffer &buf, int &pCurPos, int &pCurNum, const int off,
+						     const bool bForce)
 {
-	int ret = 0, word_len = 0, with_help = 0;
-
-    if ((completer->HasHint()) || (completer->Size() > 0)) {
-		PrintStr(" \b\n");
-		ret = 1;
-	}
-	// Print syntax hints.
-    if (completer->HasHint()) {
-		PrintStr("Please input: ");
-        ColorSet (completer->GetHintColor());
-        PrintStr(completer->GetHint());
-		ColorSet (CROSSLINE_COLOR_DEFAULT);
-		PrintStr("\n");
+	int rows, cols, len = prompt.length();
+	int new_pos = pCurPos;
+	ScreenGet (rows, cols);
+	if (!bForce && (pCurPos == pCurNum)) {
+		return false;
+	} // at end of last line
+	// the cells come from the layout of the line as drawn
+	LineLayout &layout = privData->shown.layout;
+	if (layout.length != (size_t)(len + pCurNum) || (layout.cols != cols)) {
+		layout.Build(prompt, buf, cols, 0);
 	}
-    if (0 == completer->Size()) {
-		return ret;
+	const int curCell = layout.Cell(len + pCurPos);
+	const int endCell = layout.Cell(len + pCurNum);
+	if (off < 0) {
+		if (curCell/cols == 0) {
+			return false;
+		} // at first line
+		new_pos = std::max((int)layout.At(std::max(curCell - cols * -off, 0)) - len, 0);
+	} else {
+		if (curCell/cols == endCell/cols) {
+			return false;
+		} // at last line
+		new_pos = (int)layout.At(curCell + cols * off) - len;
+		if (new_pos >= pCurNum) {
+			new_pos = buf.CharBefore(pCurNum);
+		} // one char left to avoid history shortcut
 	}
+	Refresh(prompt, buf, pCurPos, pCurNum, new_pos, pCurNum, UpdateType::MOVE_CURSOR, 0);
+	return true;
+}
 
-    // get maximum length
-    for (int i = 0; i < completer->Size(); ++i) {
-        CompletionItemPtr comp = completer->MakeItemPtr(completer->Get(i));
-        const std::string &word = comp->GetWord();
-        if (word.length() > word_len) {
-            word_len = word.length();
-		}
-        const std::string &help = comp->GetHelp();
-        if (help.length() > 0)  {
-			with_help = 1;
-		}
-	}
-
-    std::vector<char> keys = MakeIndexKeys();
-    int maxKeys = keys.size();
+// Rows shown of a line taller than the screen, one is left for the cursor after the last
+static int crossline_view_rows (const int rows)
+{
+	return std::max(rows - 1, 1);
+}
 
-	// limit the number shown to the number of keys - should remove this restriction, but 36 entries should be enough for now
-    int no = completer->Size();;
-	if (no > maxKeys) {
-		no = maxKeys;
+// PgUp/PgDn a screenful of rows at a time in a line taller than the screen, false if the
+// line fits or the cursor is on its first/last row
+bool Crossline::PageMove (const std::string &prompt, EditBuffer &buf, int &pos, int &num, const int dir)
+{
+	int rows, cols;
+	ScreenGet (rows, cols);
+	const int vis = crossline_view_rows(rows);
+	if (privData->shown.layout.Cell(prompt.length() + num) / cols < vis) {
+		return false;
 	}
+	// the text moves by a page and the cursor stays on the same row of the screen
+	ShownLine &shown = privData->shown;
+	shown.pageTop = std::max(shown.top + dir * vis, 0);
+	bool moved = UpdownMove(prompt, buf, pos, num, dir * vis, true);
+	shown.pageTop = -1;
+	return moved;
+}
 
-	if (with_help) {
-		// Print words with help format.
-		for (int i = 0; i < no; ++i) {
-            CompletionItemPtr comp = completer->MakeItemPtr(completer->Get(i));
-            const std::string &word = comp->GetWord();
-            ColorSet (comp->GetColor());
+/*****************************************************************************/
+// UTF-8 and how many cells characters take
 
-		    std::ostringstream msg;
-            msg << std::setw(4) << keys[i] << ":  " << word;
+// Bytes in the UTF-8 character lead starts, 1 for a stray continuation byte
+static inline size_t crossline_utf8_len (const unsigned char lead)
+{
+	return (lead < 0xc0) ? 1 : (lead < 0xe0) ? 2 : (lead < 0xf0) ? 3 : (lead < 0xf8) ? 4 : 1;
+}
 
-			PrintStr(msg.str());
-            int l = 4 + word_len - word.length();
-			if (l > 0) {
-				std::string spaces(l, ' ');
-				PrintStr(spaces);
-			}
-            ColorSet (comp->GetHelpColor());
-            PrintStr(comp->GetHelp());
-			ColorSet (CROSSLINE_COLOR_DEFAULT);
-			PrintStr("\n");
-            if (PagingCheck(comp->GetHelp().length()+4+word_len+1))
-				{ break; }
+static inline bool crossline_utf8_cont (const unsigned char ch)
+{
+	return 0x80 == (ch & 0xc0);
+}
 
-			msg.str(std::string()); // clear
-			msg << keys[i];
-			matches[msg.str()] = i;
+// Decode the character at byte i (of end) given by byte(i), a bad sequence is taken as
+// its first byte on its own.  Returns the bytes used
+template <typename ByteAt>
+static size_t crossline_utf8_decode (const ByteAt &byte, const size_t i, const size_t end, uint32_t &cp)
+{
+	const unsigned char lead = byte(i);
+	const size_t n = crossline_utf8_len(lead);
+	cp = lead;
+	if ((1 == n) || (i + n > end)) {
+		return 1;
+	}
+	uint32_t code = lead & (0x7f >> n);
+	for (size_t k = 1; k < n; k++) {
+		const unsigned char ch = byte(i + k);
+		if (!crossline_utf8_cont(ch)) {
+			return 1;
 		}
-		return ret;
+		code = (code << 6) | (ch & 0x3f);
 	}
+	cp = code;
+	return n;
+}
 
-	// Print words list in multiple columns.
-	int rows, cols;
-	ScreenGet (rows, cols);
+struct CrosslineRange {
+	uint32_t first;
+	uint32_t last;
+};
 
-	int extra = 4;                                               // in each column have "____: word_len____"
-	int word_num = std::min(cols / (word_len + 6 + extra), 3);   // 6 = "____: ""
+// Combining marks, zero width spaces and joiners, variation selectors
+static const CrosslineRange s_zero_width[] = {
+	{0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+	{0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+	{0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711},
+	{0x0730, 0x074A}, {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x0819}, {0x081B, 0x0823},
+	{0x0825, 0x0827}, {0x0829, 0x082D}, {0x0859, 0x085B}, {0x08D3, 0x08E1}, {0x08E3, 0x0902},
+	{0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+	{0x0962, 0x0963}, {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD},
+	{0x09E2, 0x09E3}, {0x0A01, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A42}, {0x0A47, 0x0A48},
+	{0x0A4B, 0x0A4D}, {0x0A51, 0x0A51}, {0x0A70, 0x0A71}, {0x0A75, 0x0A75}, {0x0A81, 0x0A82},
+	{0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC5}, {0x0AC7, 0x0AC8}, {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3},
+	{0x0B01, 0x0B01}, {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B4D},
+	{0x0B56, 0x0B56}, {0x0B62, 0x0B63}, {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD},
+	{0x0C00, 0x0C00}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C48}, {0x0C4A, 0x0C4D}, {0x0C55, 0x0C56},
+	{0x0C62, 0x0C63}, {0x0C81, 0x0C81}, {0x0CBC, 0x0CBC}, {0x0CBF, 0x0CBF}, {0x0CC6, 0x0CC6},
+	{0x0CCC, 0x0CCD}, {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D},
+	{0x0D62, 0x0D63}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD4}, {0x0DD6, 0x0DD6}, {0x0E31, 0x0E31},
+	{0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD},
+	{0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F71, 0x0F7E},
+	{0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC}, {0x0FC6, 0x0FC6}, {0x102D, 0x1030},
+	{0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060},
+	{0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D}, {0x109D, 0x109D},
+	{0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714}, {0x1732, 0x1734}, {0x1752, 0x1753},
+	{0x1772, 0x1773}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3},
+	{0x17DD, 0x17DD}, {0x180B, 0x180E}, {0x18A9, 0x18A9}, {0x1920, 0x1922}, {0x1927, 0x1928},
+	{0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B}, {0x1A56, 0x1A56},
+	{0x1A58, 0x1A60}, {0x1A62, 0x1A62}, {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F}, {0x1AB0, 0x1AFF},
+	{0x1B00, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42},
+	{0x1B6B, 0x1B73}, {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5}, {0x1BA8, 0x1BA9}, {0x1BAB, 0x1BAD},
+	{0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9}, {0x1BED, 0x1BED}, {0x1BEF, 0x1BF1}, {0x1C2C, 0x1C33},
+	{0x1C36, 0x1C37}, {0x1CD0, 0x1CD2}, {0x1CD4, 0x1CE0}, {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED},
+	{0x1CF4, 0x1CF4}, {0x1CF8, 0x1CF9}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E},
+	{0x2060, 0x2064}, {0x206A, 0x206F}, {0x20D0, 0x20FF}, {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F},
+	{0x2DE0, 0x2DFF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D},
+	{0xA69E, 0xA69F}, {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806}, {0xA80B, 0xA80B},
+	{0xA825, 0xA826}, {0xA8C4, 0xA8C5}, {0xA8E0, 0xA8F1}, {0xA926, 0xA92D}, {0xA947, 0xA951},
+	{0xA980, 0xA982}, {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BD}, {0xAA29, 0xAA2E},
+	{0xAA31, 0xAA32}, {0xAA35, 0xAA36}, {0xAA43, 0xAA43}, {0xAA4C, 0xAA4C}, {0xAAB0, 0xAAB0},
+	{0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8}, {0xAABE, 0xAABF}, {0xAAC1, 0xAAC1}, {0xABE5, 0xABE5},
+	{0xABE8, 0xABE8}, {0xABED, 0xABED}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+	{0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB}, {0x101FD, 0x101FD}, {0x10A01, 0x10A03}, {0x10A05, 0x10A06},
+	{0x10A0C, 0x10A0F}, {0x10A38, 0x10A3A}, {0x10A3F, 0x10A3F}, {0x11001, 0x11001}, {0x11038, 0x11046},
+	{0x1107F, 0x11081}, {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x11100, 0x11102}, {0x11127, 0x1112B},
+	{0x1112D, 0x11134}, {0x16F8F, 0x16F92}, {0x1BC9D, 0x1BC9E}, {0x1D167, 0x1D169}, {0x1D173, 0x1D182},
+	{0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244}, {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A},
+	{0xE0001, 0xE0001}, {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
 
-	for (int i = 0; i < no; ++i) {
-        CompletionItemPtr comp = completer->MakeItemPtr(completer->Get(i));
-        const std::string &word = comp->GetWord();
-        ColorSet (comp->GetColor());
-	    std::ostringstream msg;
+// East Asian Wide and Fullwidth characters and emoji take two cells
+static const CrosslineRange s_wide[] = {
+	{0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+	{0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+	{0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+	{0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+	{0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+	{0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+	{0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+	{0x2E80, 0x303E}, {0x3041, 0x3247}, {0x3250, 0x4DBF}, {0x4E00, 0xA4CF}, {0xA960, 0xA97F},
+	{0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60},
+	{0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+	{0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B},
+	{0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320}, {0x1F32D, 0x1F335},
+	{0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0},
+	{0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D},
+	{0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4},
+	{0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7},
+	{0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+	{0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
 
-  		msg << std::setw(4) << keys[i] << ":  ";
-		PrintStr(msg.str());
-  		ColorSet(CROSSLINE_FGCOLOR_BLACK | CROSSLINE_FGCOLOR_BRIGHT);
-        PrintStr(word);
-		ColorSet (CROSSLINE_COLOR_DEFAULT);
+static bool crossline_in_ranges (const uint32_t cp, const CrosslineRange *ranges, const size_t n)
+{
+	const CrosslineRange *end = ranges + n;
+	const CrosslineRange *r = std::lower_bound(ranges, end, cp,
+		[](const CrosslineRange &range, const uint32_t c) { return range.last < c; });
+	return (r != end) && (r->first <= cp);
+}
 
-		msg.str(std::string()); // clear
-		msg << keys[i];
-		matches[msg.str()] = i;
+// The cells a character takes, 0 for one that combines with the character before
+static int crossline_char_width (const uint32_t cp)
+{
+	if (cp < 0x300) {
+		return 1;
+	}
+	if (crossline_in_ranges(cp, s_zero_width, sizeof(s_zero_width) / sizeof(s_zero_width[0]))) {
+		return 0;
+	}
+	if ((cp >= 0x1100) && crossline_in_ranges(cp, s_wide, sizeof(s_wide) / sizeof(s_wide[0]))) {
+		return 2;
+	}
+	return 1;
+}
 
-        int l = word_len - word.length();
-		if ((i+1) % word_num > 0) {
-			l += extra;
-		}
-		if (l > 0) {
-			std::string spaces(l, ' ');
-			PrintStr(spaces);
-		}
+// The number of bytes above 0x7f in s, counted a vector at a time, so a line can be found
+// to be ASCII (a byte a cell) without looking at its characters
+static size_t crossline_high_bytes (const char *s, const size_t len)
+{
+	size_t n = 0;
+	size_t i = 0;
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		n += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(s + i))));
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	for (; i + 16 <= len; i += 16) {
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i)));
+  #ifdef _MSC_VER
+		n += __popcnt(mask);
+  #else
+		n += __builtin_popcount(mask);
+  #endif
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= len; i += 16) {
+		// the top bits, added up in pairs
+		uint8x16_t high = vshrq_n_u8(vld1q_u8((const uint8_t*)(s + i)), 7);
+		uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(high)));
+		n += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+	}
+#endif
+	for (; i < len; i++) {
+		n += (unsigned char)s[i] >> 7;
+	}
+	return n;
+}
 
-		if (0 == ((i+1) % word_num)) {
-			PrintStr("\n");
-			if (PagingCheck (word_len)) {
-				return ret;
-			}
+// The cell after laying out text from cell col, as LineLayout::Build does
+static int crossline_cells_after (int col, const int cols, const std::string_view &text)
+{
+	auto byte = [&text](const size_t k) { return (unsigned char)text[k]; };
+	for (size_t i = 0; i < text.length(); ) {
+		uint32_t cp;
+		i += crossline_utf8_decode(byte, i, text.length(), cp);
+		const int w = crossline_char_width(cp);
+		if ((2 == w) && (col % cols == cols - 1)) {
+			col++;
 		}
+		col += w;
 	}
-
-    if (completer->Size() % word_num) {
-        PrintStr("\n");
-    }
-	return ret;
+	return col;
 }
 
-bool Crossline::UpdownMove (const std::string &prompt, int &pCurPos, const int pCurNum, const int off,
-						     const bool bForce)
+size_t EditBuffer::CharStart(const size_t at) const
 {
-	int rows, cols, len = prompt.length();
-	int cur_pos=pCurPos;
-	ScreenGet (rows, cols);
-	if (!bForce && (pCurPos == pCurNum)) {
-		return false;
-	} // at end of last line
-	if (off < 0) {
-		if ((pCurPos+len)/cols == 0) {
-			return false;
-		} // at first line
-		pCurPos -= cols;
-		if (pCurPos < 0) {
-			pCurPos = 0;
+	auto byte = [this](const size_t k) { return (unsigned char)(*this)[k]; };
+	size_t pos = std::min(at, Length());
+	while (true) {
+		while ((pos > 0) && crossline_utf8_cont(byte(pos))) {
+			pos--;
 		}
-		CursorMove (-1, (pCurPos+len)%cols-(cur_pos+len)%cols);
-	} else {
-		if ((pCurPos+len)/cols == (pCurNum+len)/cols) {
-			return false;
-		} // at last line
-		pCurPos += cols;
-		if (pCurPos > pCurNum) {
-			pCurPos = pCurNum - 1;
-		} // one char left to avoid history shortcut
-		CursorMove (1, (pCurPos+len)%cols-(cur_pos+len)%cols);
+		if ((0 == pos) || (byte(pos) < 0x80)) {
+			return pos;
+		}
+		uint32_t cp;
+		crossline_utf8_decode(byte, pos, Length(), cp);
+		if (crossline_char_width(cp) > 0) {
+			return pos;
+		}
+		pos--;	// a combining character goes with the one before it
 	}
-	return true;
 }
 
-// refresh current print line and move cursor to new_pos.
-// UpdateType is DRAW_ALL, DRAW_FROM_POS, MOVE_CURSOR
-// cursor pos is one past the position
-void Crossline::Refresh(const std::string &prompt, std::string &buf, int &pCurPos, int &pCurNum,
-						 const int new_pos, const int new_num, const UpdateType updateType,
-						 const int drawPosIn)
+size_t EditBuffer::CharAfter(const size_t at) const
 {
-    int prLen = prompt.length();
-    int drawPos = drawPosIn;
-    if (updateType == UpdateType::DRAW_ALL) {
-        drawPos = 0;
-    }
-
-	if (s_crossline_win) {
-		ScreenGet (privData->term.screenRows, privData->term.screenCols);
+	auto byte = [this](const size_t k) { return (unsigned char)(*this)[k]; };
+	const size_t len = Length();
+	size_t pos = at;
+	if (pos >= len) {
+		return len;
 	}
-	int rows = privData->term.screenRows;
-	int cols = privData->term.screenCols;
-
-	std::ostringstream msg;
-
-    if (privData->IsLogging()) {
-        msg << "Writing " << buf << "\n";
-        msg << "   with: updateType, drawPos = " << int(updateType) << ", " << drawPos << "\n";
-    }
-
-    if (updateType == UpdateType::MOVE_CURSOR) {  // just move cursor
-        int pos_row = (new_pos+prLen)/(cols) - (pCurPos+prLen)/(cols);
-        int pos_col = (new_pos+prLen)%(cols) - (pCurPos+prLen)%(cols);
-		CursorMove (pos_row, pos_col);
-        if (privData->IsLogging()) {
-		  msg << "\n0. Cursor move only (row, col) " << pos_row << " " << pos_col << "\n";
-		    // msg << "\nbChg 0. Cursor move (row, col) " << theRow << " " << theCol << "\n";
-
-			int origCurRow, origCurCol;
-			CursorGet(origCurRow, origCurCol);
-		    msg << "1. Cursor pos (row, col) " << origCurRow << " " << origCurCol << "\n";
-		}
-	} else {
-    	int cursRows = 0;
-    	int cursCols = (prLen + pCurPos) % (cols);   // Col where cursor is
-    	// bool res = CursorGet(cursRows, cursCols);
-    	// if (!res) {
-    	//     PrintStr("Cannot obtain cursor position. Try again");
-    	// 	return;
-    	// }
-		ShowCursor(false);
-		// build a single string to write - try to reduce flicker.
-		// start at current cursor position - if writing the whole buffer
-		// we need to move the cursor to the start of the line
-		std::string writeBuf;
-
-        if (privData->IsLogging()) {
-	      msg << "0. Cursor pos (row, col) " << cursRows << " " << cursCols << "\n";
-	    }
-
-		if (new_num > 0) {
-			if (new_num < buf.length()) {
-				buf = buf.substr(0, new_num);
-			}
-		} else {
-			buf.clear();
+	uint32_t cp;
+	pos += crossline_utf8_decode(byte, pos, len, cp);
+	while (pos < len && (byte(pos) >= 0x80)) {
+		size_t n = crossline_utf8_decode(byte, pos, len, cp);
+		if (crossline_char_width(cp) > 0) {
+			break;
 		}
+		pos += n;
+	}
+	return pos;
+}
 
-		// need to store lenWritten as some of the chars in buf are \r \n
-		int lenWritten = 0;
-		if (updateType == UpdateType::DRAW_FROM_POS) { // refresh the least possbile
-			std::string::const_iterator it = buf.begin();
-			// cLine.PrintStr(&*(it + bChg - 1));
-			writeBuf += buf.substr(drawPos);
-			// need to include the length already written on the line
- 			lenWritten = drawPos;
-
-            int writeCol = (prLen + drawPos) % (cols);   // chg                            // bChg-1 is start of refresh
-            int rowOff = (drawPos + prLen - 1)/(cols) - (pCurPos + prLen)/(cols);  // chg        // bChg-1 is start of refresh
-			// if we are updating from some posn and not writing the whole line, then move cursor
-			CursorMove(rowOff, -cursCols+writeCol);
-			cursRows += rowOff;
-			cursCols = writeCol;
-
-            if (privData->IsLogging()) {
-                int tmpCurRow, tmpCurCol;
-				CursorGet(tmpCurRow, tmpCurCol);
-			    msg << "1. bChg cursor pos (row, col) " << tmpCurRow << " " << tmpCurCol << "\n";
-			}
-
-		} else {
-		    // Redraw everything
-			// if the text fills n lines we need to move the cursor back before writing
-            int pos_row = (pCurPos + prLen) / (cols);    // -1 as have length but using pos
-			CursorMove(-pos_row, -cursCols);
-			cursRows -= pos_row;
-			cursCols = 0;
-
-            if (privData->IsLogging()) {
-			    msg << "1. Cursor move (row, col) " << -pos_row << " " << -cursCols << "\n";
-			    msg << "1. Row move " << pCurPos + prLen - 1 << " " << cols << "\n";
-
-				int tmpCurRow, tmpCurCol;
-				CursorGet(tmpCurRow, tmpCurCol);
-			    msg << "1. Cursor pos (row, col) " << tmpCurRow << " " << tmpCurCol << "\n";
-			}
-
-			ColorSet (privData->prompt_color);
-			// cLine.PrintStr("\r" + prompt);
-			PrintStr(prompt);
-			// writePos = prompt.length();
-			ColorSet (CROSSLINE_COLOR_DEFAULT);
-			// cLine.PrintStr(buf);
-			writeBuf += buf;
-
-            if (privData->IsLogging()) {
-                int tmpCurRow, tmpCurCol;
-				CursorGet(tmpCurRow, tmpCurCol);
-			    msg << "2. Cursor pos (row, col) " << tmpCurRow << " " << tmpCurCol << "\n";
-			}
-
-		}
-		lenWritten += writeBuf.length();
+bool EditBuffer::Ascii() const
+{
+	if (SIZE_MAX == highBytes) {
+		std::string_view head, tail;
+		Pieces(0, Length(), head, tail);
+		highBytes = crossline_high_bytes(head.data(), head.length()) + crossline_high_bytes(tail.data(), tail.length());
+	}
+	return 0 == highBytes;
+}
 
-        if (privData->IsLogging()) {
-            msg << "lenWritten " << lenWritten << " " << writeBuf.length() << "\n";
-        }
-        if (!s_crossline_win && new_num>0 && !((new_num+prLen)%cols)) {
-			// cLine.PrintStr("\n");
-			writeBuf += "\n";
-		}
-		// need to overwrite any old text
-		int cnt = pCurNum - new_num;
-		if (cnt > 0) {
-			std::string st(cnt, ' ');
-			// cLine.PrintStr(st);
-			writeBuf += st;
-			lenWritten += cnt;
-		}
-
-		// if we have scrolled to a new line, we need to blank out
-		int oldRows = (pCurNum + prLen) / cols;
-		int newRows = (lenWritten + prLen) / cols;
-		if (oldRows < newRows) {
-			int newCols = lenWritten % cols;
-			int blanks = cols - newCols;
-			std::string blankStr(blanks, ' ');
-			writeBuf += blankStr;
-			lenWritten += blanks;
-			cnt += blanks;
-		}
-
-		if (privData->IsLogging()) {
-            msg << "Adding " << cnt << " blanks to string" << "\n";
-            msg << "oldRows, newRows: " << oldRows << ", " << newRows << "\n";
-        }
+size_t LineLayout::Next(const int cell) const
+{
+	if (ascii) {
+		return std::min<size_t>(std::max(cell, 0), length);
+	}
+	return std::lower_bound(cells.begin(), cells.begin() + length, cell) - cells.begin();
+}
 
-        if (!s_crossline_win && pCurNum>new_num && !((pCurNum+prLen)%cols)) {
-			// cLine.PrintStr("\n");
-			writeBuf += "\n";
-		}
-		// int pos_row = (new_num+len)/cols - (pCurNum+len)/cols;
-		// move to start of previous row - this should be done with curor posn not num
-#ifdef TODO
-		if (pos_row < 0) {
-			CursorMove (pos_row, 0);
-		}
-#endif
-		// !!!!! why was this "\r" here?
-		// cLine.PrintStr("\r");
-		// writeBuf += "\r";
-		if (privData->IsLogging()) {
-            msg << "String to write\n" << writeBuf << "\n";
-        }
+size_t LineLayout::At(const int cell) const
+{
+	if (ascii) {
+		return std::min<size_t>(std::max(cell, 0), length);
+	}
+	if (cell >= cells[length]) {
+		return length;
+	}
+	size_t i = std::upper_bound(cells.begin(), cells.begin() + length, cell) - cells.begin();
+	if (0 == i) {
+		return 0;
+	}
+	// the bytes of a character, and any combining ones after it, share its cell
+	return std::lower_bound(cells.begin(), cells.begin() + i, cells[i-1]) - cells.begin();
+}
 
-		PrintStr(writeBuf);
+bool LineLayout::Filler(const size_t i) const
+{
+	return !ascii && std::binary_search(fillers.begin(), fillers.end(), i);
+}
 
-        if (privData->IsLogging()) {
-            int tmpCurRow, tmpCurCol;
-			CursorGet(tmpCurRow, tmpCurCol);
-		    msg << "3. Cursor pos (row, col) " << tmpCurRow << " " << tmpCurCol << "\n";
+void LineLayout::Build(const std::string &prompt, const EditBuffer &buf, const int colsIn, size_t from)
+{
+	const size_t prLen = prompt.length();
+	const size_t len = prLen + buf.Length();
+	const int oldCols = cols;
+	cols = std::max(colsIn, 1);
+	if (buf.Ascii() && (0 == crossline_high_bytes(prompt.data(), prLen))) {
+		ascii = true;
+		length = len;
+		cells.clear();
+		fillers.clear();
+		return;
+	}
+	if (ascii || (oldCols != cols)) {
+		from = 0;
+	}
+	// go back to the start of the row, its cell doesn't depend on what is before it, only
+	// whether the row before ends in a filler does
+	size_t i = 0;
+	int col = 0;
+	from = std::min(from, length);
+	if (from > 0) {
+		col = (cells[from] / cols) * cols;
+		i = Next(col);
+		col = cells[i] - (Filler(i) ? 1 : 0);
+	}
+	ascii = false;
+	length = len;
+	cells.resize(len + 1);
+	fillers.erase(std::lower_bound(fillers.begin(), fillers.end(), i), fillers.end());
+
+	auto byte = [&prompt, &buf, prLen](const size_t k) {
+		return (unsigned char)((k < prLen) ? prompt[k] : buf[k - prLen]);
+	};
+	int prev = col;
+	while (i < len) {
+		uint32_t cp;
+		const size_t n = crossline_utf8_decode(byte, i, (i < prLen) ? prLen : len, cp);
+		const int w = crossline_char_width(cp);
+		int cell = prev;
+		if ((w > 0) || (0 == i)) {
+			if ((2 == w) && (col % cols == cols - 1)) {
+				col++;
+				fillers.push_back(i);
+			}
+			cell = col;
+			col += w;
 		}
-		// now the cursor is at the end of the text, move to cursor pos
-        int nowRow = (lenWritten + prLen - 1) / (cols);     // -1 as have length but using pos
-        int posRow = (new_pos + prLen) / (cols);    // chg
-		int rMove =  nowRow - posRow;
-		if (rMove < 0) {
-			rMove = 0;
+		for (size_t k = 0; k < n; k++) {
+			cells[i + k] = cell;
 		}
+		prev = cell;
+		i += n;
+	}
+	cells[len] = col;
+}
 
-		// need to find the cursor column
-        int curCPos = (lenWritten + prLen) % (cols);   // chg      // -1 as need pos not len
-        int reqCPos = (new_pos + prLen) % (cols);    // chg     // using posn
-		// there seems to be an issue if the column should be zero
-		int cMove = reqCPos - curCPos;
-		CursorMove (-rMove, cMove);
-		cursRows -= rMove;
-		cursCols = cMove;
-
-        if (privData->IsLogging()) {
-		    msg << "4. Cursor move (row, col) " << -rMove << " " << cMove << "\n";
+// Move the gap to pos, only the text between the two is moved
+void EditBuffer::MoveGap(const size_t pos)
+{
+	if (0 == gapLen) {
+		gap = pos;
+	} else if (pos < gap) {
+		memmove(&data[pos + gapLen], &data[pos], gap - pos);
+	} else if (pos > gap) {
+		memmove(&data[gap], &data[gap + gapLen], pos - gap);
+	}
+	gap = pos;
+}
 
-			int tmpCurRow, tmpCurCol;
-			CursorGet(tmpCurRow, tmpCurCol);
-		    msg << "4. Cursor pos (row, col) " << tmpCurRow << " " << tmpCurCol << "\n";
+void EditBuffer::Close()
+{
+	if (gapLen > 0) {
+		MoveGap(Length());
+		data.resize(Length());
+		gapLen = 0;
+	}
+	gap = data.size();
+}
 
-		    msg << "drawPos, curPos, new_pos " << drawPos << " " << pCurPos << " " << new_pos << "\n";
-            msg << "moveRow, origCol, len: "<< rMove << " " << cursCols << " " << prLen << "\n";
-	  		msg << "nowRow, posRow, lenWritten, cols: " << nowRow << " " << posRow << " " << lenWritten << " " << cols << "\n";
-	  		msg << "cMove, curCPos, reqCPos " << cMove << " " << curCPos << " " << reqCPos << "\n";
-		}
-		ShowCursor(true);
+void EditBuffer::Insert(const size_t at, const char *st, const size_t len)
+{
+	if (0 == len) {
+		return;
 	}
-	pCurPos = new_pos;
-	pCurNum = new_num;
-	privData->last_print_num = new_num + prLen;
-	if (privData->IsLogging()) {
-	    privData->LogMessage(msg.str());
+	const size_t pos = std::min(at, Length());
+	MoveGap(pos);
+	if (gapLen < len) {
+		// grow by half the text at least, so a run of inserts is amortised O(1)
+		size_t grow = std::max(len - gapLen, std::max<size_t>(64, data.size() / 2));
+		data.insert(gap + gapLen, grow, '\0');
+		gapLen += grow;
+	}
+	if (SIZE_MAX != highBytes) {
+		highBytes += crossline_high_bytes(st, len);
 	}
+	memcpy(&data[gap], st, len);
+	gap += len;
+	gapLen -= len;
+	Changed(pos, SIZE_MAX);
+	Kept(Length() - gap);
 }
 
-void Crossline::RefreshFull(const std::string &prompt, std::string &buf, int &pCurPos, int &pCurNum, int new_pos, int new_num)
+void EditBuffer::Erase(const size_t at, const size_t len)
 {
-	pCurPos = pCurNum = 0;
-	Refresh(prompt, buf, pCurPos, pCurNum, new_pos, new_num, UpdateType::DRAW_ALL, 0);
+	const size_t pos = std::min(at, Length());
+	const size_t n = std::min(len, Length() - pos);
+	if (0 == n) {
+		return;
+	}
+	MoveGap(pos);
+	if (SIZE_MAX != highBytes) {
+		highBytes -= crossline_high_bytes(&data[gap + gapLen], n);
+	}
+	gapLen += n;
+	Changed(pos, SIZE_MAX);
+	Kept(Length() - pos);
 }
 
-// Copy part text[cut_beg, cut_end] from src to dest
-void Crossline::TextCopy (std::string &dest, const std::string &src, int cut_beg, int cut_end)
+void EditBuffer::Set(const size_t pos, const char ch)
 {
-	int len = cut_end - cut_beg;
-	if (len > 0) {
-		if (cut_beg == 0 && len == src.length()) {
-			dest = src;
-		} else {
-			dest = src.substr(cut_beg, len);
+	if (pos < Length()) {
+		char &at = data[(pos < gap) ? pos : pos + gapLen];
+		if (SIZE_MAX != highBytes) {
+			highBytes = highBytes + ((unsigned char)ch >> 7) - ((unsigned char)at >> 7);
 		}
-	} else {
-		dest.clear();
+		at = ch;
+		Changed(pos, pos + 1);
+		Kept(Length() - pos - 1);
 	}
 }
 
-// Copy from history buffer to buf
-void Crossline::CopyFromHistory (const std::string &prompt, std::string &buf, int &pos, int &num, int history_id)
+void EditBuffer::Assign(const std::string &st)
 {
-    HistoryItemPtr it = history->GetHistoryItem(history_id);
-	buf = it->item;;
-	Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_ALL, 0);
+	data = st;
+	gap = data.size();
+	gapLen = 0;
+	highBytes = SIZE_MAX;
+	Changed(0, SIZE_MAX);
+	Kept(0);
 }
 
-/*****************************************************************************/
+void EditBuffer::Swap(std::string &st)
+{
+	Close();
+	data.swap(st);
+	gap = data.size();
+	highBytes = SIZE_MAX;
+	Changed(0, SIZE_MAX);
+	Kept(0);
+}
 
-// Convert ESC+Key to Alt-Key
-static int crossline_key_esc2alt (int ch)
+void EditBuffer::Pieces(const size_t beg, const size_t endIn, std::string_view &head, std::string_view &tail) const
 {
-	switch (ch) {
-	case KEY_DEL:	ch = KEY_ALT_DEL;	break;
-	case KEY_HOME:	ch = KEY_ALT_HOME;	break;
-	case KEY_END:	ch = KEY_ALT_END;	break;
-	case KEY_UP:	ch = KEY_ALT_UP;	break;
-	case KEY_DOWN:	ch = KEY_ALT_DOWN;	break;
-	case KEY_LEFT:	ch = KEY_ALT_LEFT;	break;
-	case KEY_RIGHT:	ch = KEY_ALT_RIGHT;	break;
-	case KEY_BACKSPACE:	ch = KEY_ALT_BACKSPACE;	break;
+	const size_t end = std::min(endIn, Length());
+	head = tail = std::string_view();
+	if (beg >= end) {
+		return;
+	}
+	if (end <= gap) {
+		head = std::string_view(data.data() + beg, end - beg);
+	} else if (beg >= gap) {
+		head = std::string_view(data.data() + beg + gapLen, end - beg);
+	} else {
+		head = std::string_view(data.data() + beg, gap - beg);
+		tail = std::string_view(data.data() + gap + gapLen, end - gap);
 	}
-	return ch;
 }
 
-// Map other function keys to main key
-static int crossline_key_mapping (int ch)
+void EditBuffer::Copy(std::string &dest, const size_t beg, const size_t end) const
 {
-	switch (ch) {
-#ifndef _WIN32
-	case KEY_HOME2:			ch = KEY_HOME;			break;
-	case KEY_END2:			ch = KEY_END;			break;
-	case KEY_CTRL_UP2:		ch = KEY_CTRL_UP;		break;
-	case KEY_CTRL_DOWN2:	ch = KEY_CTRL_DOWN;		break;
-	case KEY_CTRL_LEFT2:	ch = KEY_CTRL_LEFT;		break;
-	case KEY_CTRL_RIGHT2:	ch = KEY_CTRL_RIGHT;	break;
-	case KEY_F1_2:			ch = KEY_F1;			break;
-	case KEY_F2_2:			ch = KEY_F2;			break;
-	case KEY_F3_2:			ch = KEY_F3;			break;
-	case KEY_F4_2:			ch = KEY_F4;			break;
-#endif
-	case KEY_DEL2:			ch = KEY_BACKSPACE;		break;
+	std::string_view head, tail;
+	Pieces(beg, end, head, tail);
+	dest.assign(head.data(), head.length());
+	dest.append(tail.data(), tail.length());
+}
+
+bool EditBuffer::Equals(const std::string &st) const
+{
+	if (st.length() != Length()) {
+		return false;
 	}
-	return ch;
+	std::string_view head, tail;
+	Pieces(0, Length(), head, tail);
+	return (st.compare(0, head.length(), head) == 0) && (st.compare(head.length(), tail.length(), tail) == 0);
 }
 
-#ifdef _WIN32	// Windows
-// Read a KEY from keyboard, is_esc indicats whether it's a function key.
-static int crossline_getkey (Crossline &cLine, bool &is_esc, const bool check_esc)
+std::string &EditBuffer::Str()
 {
-	int ch = cLine.Getch();
-	is_esc = KEY_ESC == ch;
+	Close();
+	Changed(0, SIZE_MAX);   // the caller may change any of it
+	Kept(0);
+	highBytes = SIZE_MAX;
+	return data;
+}
 
-	if ((GetKeyState (VK_CONTROL) & 0x8000) && (KEY_DEL2 == ch)) {
-		ch = KEY_CTRL_BACKSPACE;
-	} else if ((224 == ch) || (0 == ch)) {
-		is_esc = true;
-		ch = cLine.Getch ();
-		ch = (GetKeyState (VK_MENU) & 0x8000) ? ALT_KEY(ch) : ch + (KEY_ESC<<8);
-	} else if (check_esc && KEY_ESC == ch) { // Handle ESC+Key
-		bool esc;
-		ch = crossline_getkey (cLine, esc, check_esc);
-		ch = crossline_key_esc2alt (ch);
-	} else if (GetKeyState (VK_MENU) & 0x8000 && !(GetKeyState (VK_CONTROL) & 0x8000) ) {
-		is_esc = true;
-		ch = ALT_KEY(ch);
+void LineColors::Update(HighlighterClass &hl, const EditBuffer &buf, size_t &dirtyFrom, size_t &dirtyTo)
+{
+	const size_t len = buf.Length();
+	size_t changed = 0;		// text before here and the last keep characters are as they were
+	size_t keep = 0;
+	if (from == &buf) {
+		if (buf.changedFrom == SIZE_MAX) {
+			return;
+		}
+		changed = std::min(buf.changedFrom, len);
+		keep = std::min(std::min(buf.unchangedTail, len - changed), length);
+	} else {
+		tokens.clear();
+		length = 0;
 	}
-	return ch;
-}
 
-void crossline_winchg_reg (Crossline &)	{ }
+	// a token's colour can depend on the character after it, so the one ending at the change
+	// is lexed again too
+	size_t k = std::lower_bound(tokens.begin(), tokens.end(), changed,
+		[](const Token &t, const size_t pos) { return t.end < pos; }) - tokens.begin();
+	size_t pos = (k > 0) ? tokens[k-1].end : 0;
+	int state = (k > 0) ? tokens[k-1].state : 0;
+	dirtyFrom = std::min(dirtyFrom, pos);
+
+	// lex until a token ends in the unchanged tail where an old one did, in the same state,
+	// from there on the old tokens are right once moved
+	const size_t settled = len - keep;
+	size_t j = k;
+	size_t join = tokens.size();
+	lexed.clear();
+	while (pos < len) {
+		std::string_view head, tail;
+		buf.Pieces(pos, len, head, tail);
+		if ((head.length() < CROSS_TOKEN_TEXT) && !tail.empty()) {
+			buf.Copy(scratch, pos, std::min(pos + CROSS_TOKEN_TEXT, len));
+			head = scratch;
+		}
+		crossline_color_e color = CROSSLINE_COLOR_DEFAULT;
+		size_t n = hl.Token(head, state, color);
+		pos += std::max<size_t>(1, std::min(n, head.length()));
+		lexed.push_back({pos, state, color});
+		if (pos >= settled) {
+			const size_t old = pos + length - len;
+			while ((j < tokens.size()) && (tokens[j].end < old)) {
+				j++;
+			}
+			if ((j < tokens.size()) && (tokens[j].end == old) && (tokens[j].state == state)) {
+				join = j + 1;
+				break;
+			}
+		}
+	}
+	dirtyTo = std::max(dirtyTo, pos);
 
-#else // Linux
+	if (len != length) {
+		for (size_t i = join; i < tokens.size(); i++) {
+			tokens[i].end = tokens[i].end + len - length;
+		}
+	}
+	tokens.erase(tokens.begin() + k, tokens.begin() + std::max(join, k));
+	tokens.insert(tokens.begin() + k, lexed.begin(), lexed.end());
+	from = &buf;
+	length = len;
+}
 
-// Convert escape sequences to internal special function key
-static int crossline_get_esckey (Crossline &cLine, int ch)
+size_t LineColors::Find(const size_t pos) const
 {
-	int ch2;
-	if (0 == ch)	{ ch = cLine.Getch (); }
-	if ('[' == ch) {
-		ch = cLine.Getch ();
-		if ((ch>='0') && (ch<='6')) {
-			ch2 = cLine.Getch ();
-			if ('~' == ch2)	{ ch = ESC_KEY4 (ch, ch2); } // ex. Esc[4~
-			else if (';' == ch2) {
-				ch2 = cLine.Getch();
-				if (('5' != ch2) && ('3' != ch2))
-					{ return 0; }
-				ch = ESC_KEY6 (ch, ch2, cLine.Getch()); // ex. Esc[1;5B
-			}
-		} else if ('[' == ch) {
-			ch = ESC_KEY4 ('[', cLine.Getch());	// ex. Esc[[A
-		} else { ch = ESC_KEY3 (ch); }	// ex. Esc[A
-	} else if ('O' == ch) {
-		ch = ESC_OKEY (cLine.Getch());	// ex. EscOP
-	} else { ch = ALT_KEY (ch); } // ex. Alt+Backspace
-	return ch;
+	return std::upper_bound(tokens.begin(), tokens.end(), pos,
+		[](const size_t p, const Token &t) { return p < t.end; }) - tokens.begin();
 }
 
-// Read a KEY from keyboard, is_esc indicats whether it's a function key.
-static int crossline_getkey (Crossline &cLine, bool &is_esc, const bool check_esc)
+// Bring the colours of buf up to date, nullptr if it isn't highlighted.  The colours of
+// [dirtyFrom, dirtyTo) may not be what they were when buf was last drawn
+static const LineColors *crossline_colors(CrosslinePrivate &priv, HighlighterClass *hl, const EditBuffer &buf,
+                                          size_t &dirtyFrom, size_t &dirtyTo)
 {
-	int ch = cLine.Getch();
-	is_esc = KEY_ESC == ch;
-	if (check_esc && is_esc) {
-		ch = cLine.Getch ();
-		if (KEY_ESC == ch) { // Handle ESC+Key
-			ch = crossline_get_esckey (cLine, 0);
-			ch = crossline_key_mapping (ch);
-			ch = crossline_key_esc2alt (ch);
-		} else { ch = crossline_get_esckey (cLine, ch); }
+	LineColors &colors = priv.colors;
+	dirtyFrom = SIZE_MAX;
+	dirtyTo = 0;
+	if ((nullptr == hl) || !priv.highlightOn) {
+		if (colors.from == &buf) {	// it was drawn in colour
+			colors.from = nullptr;
+			colors.tokens.clear();
+			dirtyFrom = 0;
+			dirtyTo = buf.Length();
+		}
+		return nullptr;
 	}
-	return ch;
+	colors.Update(*hl, buf, dirtyFrom, dirtyTo);
+	return &colors;
 }
 
-// not ideal, but a temporary solution
-static bool *s_got_resize_ptr = nullptr;
-
-static void crossline_winchg_event (int arg)
+// Print buf[beg, end), a run of cells of the same colour at a time
+static void crossline_print_colored(TerminalClass &term, const EditBuffer &buf, const LineColors *colors,
+                                    const size_t beg, const size_t end)
 {
-	*s_got_resize_ptr = true;
+	std::string_view head, tail;
+	if (nullptr == colors) {
+		buf.Pieces(beg, end, head, tail);
+		term.Print(head.data(), head.length());
+		term.Print(tail.data(), tail.length());
+		return;
+	}
+	const std::vector<LineColors::Token> &tokens = colors->tokens;
+	size_t i = colors->Find(beg);
+	size_t pos = beg;
+	while (pos < end) {
+		crossline_color_e color = (i < tokens.size()) ? tokens[i].color : CROSSLINE_COLOR_DEFAULT;
+		size_t stop = end;
+		while ((i < tokens.size()) && (tokens[i].color == color)) {
+			stop = std::min(tokens[i++].end, end);
+			if (stop == end) {
+				break;
+			}
+		}
+		term.ColorSet(color);
+		buf.Pieces(pos, stop, head, tail);
+		term.Print(head.data(), head.length());
+		term.Print(tail.data(), tail.length());
+		pos = stop;
+	}
+	term.ColorSet(CROSSLINE_COLOR_DEFAULT);
 }
 
-static void crossline_winchg_reg (Crossline &cLine)
+// Print buf[beg, end) as laid out, with a space in the filler cells a wide character left
+// at the end of a row.  A filler before beg is printed if fillBeg, one before end always is
+static void crossline_print_cells(TerminalClass &term, const EditBuffer &buf, const LineColors *colors,
+                                  const LineLayout &layout, const size_t prLen, const size_t beg, const size_t end,
+                                  const bool fillBeg)
 {
-	s_got_resize_ptr = &cLine.privData->got_resize;
-	struct sigaction sa;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = 0;
-	sa.sa_handler = &crossline_winchg_event;
-	sigaction (SIGWINCH, &sa, NULL);
-	cLine.privData->got_resize = false;
+	size_t pos = beg;
+	if (!layout.ascii) {
+		auto f = std::lower_bound(layout.fillers.begin(), layout.fillers.end(), prLen + beg + (fillBeg ? 0 : 1));
+		for (; (f != layout.fillers.end()) && (*f <= prLen + end); ++f) {
+			crossline_print_colored(term, buf, colors, pos, *f - prLen);
+			term.Print(" ", 1);
+			pos = *f - prLen;
+		}
+	}
+	crossline_print_colored(term, buf, colors, pos, end);
 }
 
-#endif // #ifdef _WIN32
-
-bool Crossline::DoHistorySearch(const std::string &prompt, std::string &buf, int &pos, int &num,
-                                int &history_id)
+// One past the last byte of buf that differs from old, first being the first that does.  The
+// bytes after it are only left alone if they are still in the same cells, otherwise the rest
+// has changed.  If old was drawn from buf, buf knows where it has changed
+static int crossline_changed_end (const EditBuffer &buf, const std::string &old, const LineLayout &layout,
+                                  const int prLen, const int first, const bool known)
 {
-	// already have text so search
+	const int newNum = buf.Length();
+	if ((int)old.length() != newNum) {
+		return newNum;
+	}
+	int last = known ? (int)std::max<size_t>(std::min<size_t>(buf.changedTo, newNum), first) : newNum;
+	while ((last > first) && (old[last-1] == buf[last-1])) {
+		last--;
+	}
+	if ((last <= first) || (last >= newNum)) {
+		return last;
+	}
+	last = buf.CharAfter(buf.CharStart(last - 1));
+	if (layout.ascii && (0 == crossline_high_bytes(old.data() + first, last - first))) {
+		return last;
+	}
+	const int from = layout.Cell(prLen + first) - (layout.Filler(prLen + first) ? 1 : 0);
+	const int oldCell = crossline_cells_after(from, layout.cols, std::string_view(old).substr(first, last - first));
+	const int newCell = layout.Cell(prLen + last) - (layout.Filler(prLen + last) ? 1 : 0);
+	return (oldCell == newCell) ? last : newNum;
+}
+
+// Move the cursor between two cells of the edit line, cell 0 is the start of the prompt
+void Crossline::CursorMoveCell(const int fromCell, const int toCell, const int cols)
+{
+	CursorMove (toCell/cols - fromCell/cols, toCell%cols - fromCell%cols);
+}
+
+// refresh current print line and move cursor to new_pos.
+// UpdateType is DRAW_ALL, DRAW_CHANGED, DRAW_FROM_POS, MOVE_CURSOR
+//   DRAW_ALL redraws the prompt and text, DRAW_CHANGED compares with what was last
+//   drawn (privData->shown) and only sends the cells that differ
+// cursor pos is one past the position
+void Crossline::Refresh(const std::string &prompt, std::string &buf, int &pCurPos, int &pCurNum,
+						 const int new_pos, const int new_num, const UpdateType updateType,
+						 const int drawPos)
+{
+	EditBuffer &text = privData->refreshText;
+	text.Swap(buf);
+	Refresh(prompt, text, pCurPos, pCurNum, new_pos, new_num, updateType, drawPos);
+	text.Swap(buf);
+}
+
+void Crossline::Refresh(const std::string &prompt, EditBuffer &buf, int &pCurPos, int &pCurNum,
+						 const int new_pos, const int new_num, const UpdateType updateTypeIn,
+						 const int drawPosIn)
+{
+	TerminalClass &term = privData->term;
+	ShownLine &shown = privData->shown;
+	LineLayout &layout = shown.layout;
+    int prLen = prompt.length();
+    UpdateType updateType = updateTypeIn;
+
+	int rows, cols;
+	ScreenGet (rows, cols);
+
+	const size_t keep = std::max(new_num, 0);
+	if (keep < buf.Length()) {
+		buf.Erase(keep, buf.Length() - keep);
+	}
+	std::string_view head, tail;
+	buf.Pieces(0, buf.Length(), head, tail);
+
+	// where the cursor is now, if nothing was drawn it is at the start of a new line
+	int curCell = shown.valid ? shown.Cell(pCurPos) : 0;
+
+	// anything that changes the prompt or the wrapping needs everything redrawn
+	bool sameLayout = shown.valid && (shown.prompt == prompt) && (shown.cols == cols) &&
+	                  (shown.promptColor == privData->prompt_color);
+	if ((updateType != UpdateType::MOVE_CURSOR) && !sameLayout) {
+		updateType = UpdateType::DRAW_ALL;
+	}
+	if (privData->stats.On()) {
+		privData->stats.Count(privData->stats.refresh[int(updateType)]);
+	}
+
+	// the log records the cell model, asking the terminal where the cursor is would need a round trip
+	CrosslineLog &log = privData->log;
+	const bool logging = log.Enabled(LogLevel::TRACE);
+	if (logging) {
+		log.Add(LogLevel::TRACE, "Refresh \"%.*s%.*s\" updateType %d drawPos %d", int(head.length()), head.data(),
+		        int(tail.length()), tail.data(), int(updateType), drawPosIn);
+	}
+
+	// the first character that differs from what is shown, the cells are the same up to it
+	std::string &old = shown.text;
+	const int oldNum = old.length();
+	const int newNum = buf.Length();
+	// if old was drawn from buf, the buffer knows which part it has changed since
+	const bool known = (shown.from == &buf);
+	const int oldEnd = shown.valid ? layout.End() : 0;
+	int first = 0;
+	if ((updateType == UpdateType::DRAW_CHANGED) || (updateType == UpdateType::DRAW_FROM_POS)) {
+		// DRAW_FROM_POS gives an upper limit
+		int minNum = std::min(oldNum, newNum);
+		if (updateType == UpdateType::DRAW_FROM_POS) {
+			minNum = std::min(minNum, std::max(drawPosIn, 0));
+		}
+		first = known ? (int)std::min<size_t>(buf.changedFrom, minNum) : 0;
+		while ((first < minNum) && (old[first] == buf[first])) {
+			first++;
+		}
+		first = buf.CharStart(first);
+	}
+	if (updateType != UpdateType::MOVE_CURSOR) {
+		layout.Build(prompt, buf, cols, (updateType == UpdateType::DRAW_ALL) ? 0 : prLen + first);
+	}
+	const int newEnd = layout.End();
+
+	// taller than the screen (or was, until the viewport has been cleared), only what fits is drawn
+	const int vis = crossline_view_rows(rows);
+	if ((newEnd / cols >= vis) || (shown.valid && shown.viewport)) {
+		// any suggestion is on the rows the viewport is drawn over, it isn't shown in one
+		shown.suggestion.clear();
+		shown.suggestCell = shown.suggestEnd = 0;
+		RefreshViewport(prompt, buf, curCell, new_pos, updateType, first, oldEnd, vis, cols);
+		pCurPos = new_pos;
+		pCurNum = new_num;
+		privData->last_print_num = newEnd;
+		return;
+	}
+
+	int endCell = curCell;
+	bool wrote = false;
+	size_t hlFrom = SIZE_MAX, hlTo = 0;
+	if (updateType == UpdateType::MOVE_CURSOR) {  // just move cursor
+		endCell = curCell;
+	} else if (updateType == UpdateType::DRAW_ALL) {
+	    // Redraw everything, starting at the beginning of the prompt
+		if (shown.valid) {
+			CursorMoveCell(curCell, 0, cols);
+		}
+		ShowCursor(false);
+		ColorSet (privData->prompt_color);
+		term.Print(prompt);
+		ColorSet (CROSSLINE_COLOR_DEFAULT);
+		crossline_print_cells(term, buf, crossline_colors(*privData, highlighter, buf, hlFrom, hlTo), layout,
+		                      prLen, 0, newNum, true);
+		shown.text.assign(head.data(), head.length());
+		shown.text.append(tail.data(), tail.length());
+		endCell = newEnd;
+		// need to overwrite any old text and suggestion
+		const int oldTo = shown.valid ? std::max(oldEnd, shown.suggestEnd) : 0;
+		if (oldTo > endCell) {
+			term.Print(std::string(oldTo - endCell, ' '));
+			endCell = oldTo;
+		}
+		shown.suggestion.clear();
+		shown.suggestCell = shown.suggestEnd = 0;
+		wrote = endCell > 0;
+		ShowCursor(true);
+	} else {
+		const LineColors *colors = crossline_colors(*privData, highlighter, buf, hlFrom, hlTo);
+		if (!known && (colors != nullptr)) {
+			hlFrom = 0;		// old may not have been coloured the same
+			hlTo = newNum;
+		}
+		int last = crossline_changed_end(buf, old, layout, prLen, first, known);
+		// and the cells that only change colour
+		if ((hlFrom < hlTo) && ((int)hlFrom < newNum)) {
+			if ((last <= first) && (oldNum == newNum)) {
+				first = last = buf.CharStart(hlFrom);
+			}
+			first = std::min<int>(first, buf.CharStart(hlFrom));
+			last = std::max<int>(last, std::min<size_t>(hlTo, newNum));
+		}
+
+		if (last > first || oldEnd > newEnd) {
+			CursorMoveCell(curCell, layout.Cell(prLen + first) - (layout.Filler(prLen + first) ? 1 : 0), cols);
+			std::string_view changedHead, changedTail;
+			buf.Pieces(first, last, changedHead, changedTail);
+			crossline_print_cells(term, buf, colors, layout, prLen, first, last, true);
+			// bring the copy of what is shown up to date, the same part as was drawn
+			if (oldNum == newNum) {
+				old.replace(first, changedHead.length(), changedHead.data(), changedHead.length());
+				old.replace(first + changedHead.length(), changedTail.length(), changedTail.data(), changedTail.length());
+			} else {
+				old.resize(first);
+				old.append(changedHead.data(), changedHead.length());
+				old.append(changedTail.data(), changedTail.length());
+			}
+			endCell = layout.Cell(prLen + last);
+			// erase what is left of the old text
+			if ((last == newNum) && (oldEnd > newEnd)) {
+				term.Print(std::string(oldEnd - newEnd, ' '));
+				endCell = oldEnd;
+			}
+			wrote = true;
+		}
+		if (logging) {
+			log.Add(LogLevel::TRACE, "   changed bytes %d to %d of %d -> %d", first, last, oldNum, newNum);
+		}
+	}
+
+	// after writing the last column the terminal waits to wrap, move to the next row
+	// so the cursor is where the cell model says it is (Windows wraps immediately)
+	if (term.PendingWrap() && wrote && !(endCell % cols)) {
+		term.Print("\n", 1);
+	}
+	// now the cursor is at the end of the text, move to cursor pos
+	const int newCell = layout.Cell(prLen + new_pos);
+	CursorMoveCell(endCell, newCell, cols);
+
+	if (logging) {
+		log.Add(LogLevel::TRACE, "   cursor cell %d -> %d -> %d, cols %d", curCell, endCell, newCell, cols);
+	}
+
+	shown.valid = true;
+	shown.prompt = prompt;
+	shown.promptColor = privData->prompt_color;
+	shown.cols = cols;
+	shown.top = 0;
+	shown.viewport = false;
+	if (updateType != UpdateType::MOVE_CURSOR) {
+		shown.from = &buf;
+		buf.Drawn();
+	}
+
+	pCurPos = new_pos;
+	pCurNum = new_num;
+	privData->last_print_num = newEnd;
+}
+
+// Refresh of a line taller than the screen.  Only the vis rows from shown.top are on the
+// screen, scrolled to keep the cursor on them, and a row is only sent if what is in it has
+// changed, so what a key costs depends on the screen size rather than the length of the
+// line.  curCell is where the cursor is, counted from the first row shown, first is the first
+// byte that differs from what was drawn and oldEnd the cell after it
+void Crossline::RefreshViewport(const std::string &prompt, EditBuffer &buf, const int curCell, const int new_pos,
+                                const UpdateType updateType, const int first, const int oldEnd, const int vis,
+                                const int cols)
+{
+	TerminalClass &term = privData->term;
+	ShownLine &shown = privData->shown;
+	const LineLayout &layout = shown.layout;
+	const int prLen = prompt.length();
+	const int newEnd = layout.End();
+	const int oldTop = shown.valid ? shown.top : 0;
+
+	// keep the cursor row in view, moving as little as possible
+	const int curRow = layout.Cell(prLen + new_pos) / cols;
+	int top = (shown.pageTop >= 0) ? shown.pageTop : oldTop;
+	top = std::max(std::min(top, curRow), curRow - vis + 1);
+	top = std::max(0, std::min(top, newEnd / cols + 1 - vis));
+
+	const bool redraw = (updateType == UpdateType::DRAW_ALL) || !shown.viewport;
+	int cell = curCell;
+	if (!redraw && (updateType == UpdateType::MOVE_CURSOR) && (top == oldTop)) {
+		CursorMoveCell(cell, layout.Cell(prLen + new_pos) - top * cols, cols);
+		return;
+	}
+
+	size_t hlFrom, hlTo;
+	const bool known = (shown.from == &buf);
+	const LineColors *colors = crossline_colors(*privData, highlighter, buf, hlFrom, hlTo);
+	if (!known && (colors != nullptr)) {
+		hlFrom = 0;
+		hlTo = buf.Length();
+	}
+
+	// the cells that may not have what they should, rows outside them are left alone
+	int changeBeg = 0;
+	int changeEnd = INT_MAX;
+	if (!redraw && (top == oldTop) && (updateType != UpdateType::MOVE_CURSOR)) {
+		const int last = crossline_changed_end(buf, shown.text, layout, prLen, first, known);
+		changeBeg = layout.Cell(prLen + first) - 1;		// from a filler before it
+		changeEnd = (last == (int)buf.Length()) ? std::max(oldEnd, newEnd) : layout.Cell(prLen + last);
+		if ((last <= first) && (oldEnd == newEnd)) {
+			changeBeg = changeEnd = 0;
+		}
+	}
+	int colorBeg = 0;
+	int colorEnd = 0;
+	if (hlFrom < hlTo) {
+		colorBeg = layout.Cell(prLen + hlFrom) - 1;
+		colorEnd = layout.Cell(prLen + std::min(hlTo, buf.Length()));
+	}
+
+	ShowCursor(false);
+	if (redraw) {
+		// make room for the rows, newlines scroll the screen where moving the cursor can't
+		if (shown.valid) {
+			CursorMoveCell(cell, 0, cols);
+		}
+		term.Print(std::string(vis - 1, '\n'));
+		CursorMove(-(vis - 1), 0);
+		cell = 0;
+	}
+
+	for (int r = 0; r < vis; r++) {
+		const int rowCell = (top + r) * cols;
+		const int used = std::max(0, std::min(cols, newEnd - rowCell));
+		const bool changed = (rowCell < changeEnd) && (rowCell + cols > changeBeg);
+		const bool recolored = (rowCell < colorEnd) && (rowCell + cols > colorBeg);
+		if (!redraw && !changed && !recolored) {
+			continue;
+		}
+		const size_t beg = layout.Next(rowCell);
+		const size_t end = layout.Next(rowCell + cols);
+		CursorMoveCell(cell, r * cols, cols);
+		if (beg < (size_t)prLen) {
+			ColorSet (privData->prompt_color);
+			term.Print(prompt.c_str() + beg, std::min<size_t>(end, prLen) - beg);
+			ColorSet (CROSSLINE_COLOR_DEFAULT);
+		}
+		if (end > (size_t)prLen) {
+			// a filler before the first character is on the row before, unless the prompt is on this one
+			crossline_print_cells(term, buf, colors, layout, prLen, std::max<size_t>(beg, prLen) - prLen, end - prLen,
+			                      beg < (size_t)prLen);
+		}
+		if (used < cols) {
+			term.Print("\x1b[K", 3);
+			cell = r * cols + used;
+		} else {
+			// a full row leaves the cursor waiting to wrap on the last column (Windows wraps)
+			cell = term.PendingWrap() ? r * cols + cols - 1 : (r + 1) * cols;
+		}
+	}
+	ShowCursor(true);
+	CursorMoveCell(cell, layout.Cell(prLen + new_pos) - top * cols, cols);
+
+	if (privData->log.Enabled(LogLevel::TRACE)) {
+		privData->log.Add(LogLevel::TRACE, "   viewport rows %d to %d of %d, cursor row %d", top, top + vis, newEnd / cols + 1, curRow);
+	}
+
+	// the copy of the text only needs bringing up to date from where it was changed
+	size_t from = known ? std::min(buf.changedFrom, shown.text.length()) : 0;
+	std::string_view head, tail;
+	buf.Pieces(from, buf.Length(), head, tail);
+	shown.text.resize(from);
+	shown.text.append(head.data(), head.length());
+	shown.text.append(tail.data(), tail.length());
+	shown.from = &buf;
+	buf.Drawn();
+
+	shown.valid = true;
+	shown.prompt = prompt;
+	shown.promptColor = privData->prompt_color;
+	shown.cols = cols;
+	shown.top = top;
+	shown.viewport = newEnd / cols >= vis;   // once it fits the rows shown are the normal layout
+}
+
+// draw the prompt and text on a new line
+void Crossline::RefreshFull(const std::string &prompt, std::string &buf, int &pCurPos, int &pCurNum, int new_pos, int new_num)
+{
+	pCurPos = pCurNum = 0;
+	privData->shown.valid = false;
+	Refresh(prompt, buf, pCurPos, pCurNum, new_pos, new_num, UpdateType::DRAW_ALL, 0);
+}
+
+void Crossline::RefreshFull(const std::string &prompt, EditBuffer &buf, int &pCurPos, int &pCurNum, int new_pos, int new_num)
+{
+	pCurPos = pCurNum = 0;
+	privData->shown.valid = false;
+	Refresh(prompt, buf, pCurPos, pCurNum, new_pos, new_num, UpdateType::DRAW_ALL, 0);
+}
+
+// whether buf starts with st
+static bool crossline_starts_with (const EditBuffer &buf, const std::string_view &st)
+{
+	if (st.length() > buf.Length()) {
+		return false;
+	}
+	std::string_view head, tail;
+	buf.Pieces(0, st.length(), head, tail);
+	return (st.compare(0, head.length(), head) == 0) && (st.compare(head.length(), tail.length(), tail) == 0);
+}
+
+// The autosuggestion is the newest history entry starting with the line.  While more is
+// typed on the end it stays the newest one if it starts with the line, so only other edits
+// need a lookup, which waits until lookup and no more keys are waiting.  It is only shown
+// when the cursor is at the end of the line
+void Crossline::SuggestDraw(EditState &st, const bool lookup)
+{
+	EditBuffer &buf = st.text;
+	const size_t len = buf.Length();
+	const bool on = privData->suggestOn && !st.edit_only && st.choices.empty() && !st.read_end &&
+	                (len > 0) && (len <= CROSS_SUGGEST_MAX);
+	std::string_view ghost;
+	if (on && !buf.Equals(st.suggested)) {
+		if (!st.suggested.empty() && crossline_starts_with(buf, st.suggested) &&
+		    (st.suggestion.empty() || crossline_starts_with(buf, std::string_view(st.suggestion).substr(0, len)))) {
+			buf.Copy(st.suggested, 0, len);
+			st.suggestDue = false;
+		} else {
+			st.suggestDue = true;
+		}
+	}
+	if (on && st.suggestDue && lookup && (st.pos == st.num) && !privData->term.InputReady()) {
+		buf.Copy(st.suggested, 0, len);
+		const ssize_t ind = history->Suggest(st.suggested);
+		if (ind >= 0) {
+			std::string_view found = history->GetHistoryView(ind);
+			st.suggestion.assign(found.data(), found.length());
+		} else {
+			st.suggestion.clear();
+		}
+		st.suggestDue = false;
+	}
+	// until a lookup is done one that still fits the line is kept
+	if (on && (st.pos == st.num) && (st.suggestion.length() > len) &&
+	    crossline_starts_with(buf, std::string_view(st.suggestion).substr(0, len))) {
+		ghost = std::string_view(st.suggestion).substr(len);
+		for (const char c : ghost) {
+			if (((unsigned char)c < ' ') || (c == 0x7f)) {
+				ghost = std::string_view();
+				break;
+			}
+		}
+	}
+	SuggestShow(ghost, st.pos);
+}
+
+// Only the cells that don't already have what they should are drawn: typing the next
+// character of the suggestion leaves the rest of it where it is
+void Crossline::SuggestShow(const std::string_view &ghostIn, const int pos)
+{
+	ShownLine &shown = privData->shown;
+	if (!shown.valid || shown.viewport) {
+		shown.suggestion.clear();
+		shown.suggestCell = shown.suggestEnd = 0;
+		return;
+	}
+	TerminalClass &term = privData->term;
+	const LineLayout &layout = shown.layout;
+	const int cols = shown.cols;
+	const int textEnd = layout.End();
+	std::string_view ghost = ghostIn;
+	int end = crossline_cells_after(textEnd, cols, ghost);
+	int rows, scrCols;
+	ScreenGet (rows, scrCols);
+	if ((end - 1) / cols >= crossline_view_rows(rows)) {
+		ghost = std::string_view();   // it has to fit on the screen with the line
+		end = textEnd;
+	}
+	const int oldEnd = shown.suggestEnd;
+	if (ghost.empty() && (oldEnd <= textEnd)) {
+		shown.suggestion.clear();
+		shown.suggestCell = shown.suggestEnd = 0;
+		return;
+	}
+	// what is left of the one shown once the text has covered the start of it
+	const std::string &old = shown.suggestion;
+	if ((old.length() >= ghost.length()) && (end == oldEnd) &&
+	    (old.compare(old.length() - ghost.length(), ghost.length(), ghost) == 0) &&
+	    (crossline_cells_after(shown.suggestCell, cols, std::string_view(old).substr(0, old.length() - ghost.length())) == textEnd)) {
+		shown.suggestion.assign(ghost.data(), ghost.length());
+		shown.suggestCell = textEnd;
+		return;
+	}
+
+	const int cur = layout.Cell(shown.prompt.length() + pos);
+	CursorMoveCell(cur, textEnd, cols);
+	if (!ghost.empty()) {
+		ColorSet (CROSS_SUGGEST_COLOR);
+	}
+	auto byte = [&ghost](const size_t k) { return (unsigned char)ghost[k]; };
+	int col = textEnd;
+	for (size_t i = 0; i < ghost.length(); ) {
+		uint32_t cp;
+		const size_t n = crossline_utf8_decode(byte, i, ghost.length(), cp);
+		const int w = crossline_char_width(cp);
+		if ((2 == w) && (col % cols == cols - 1)) {
+			term.Print(" ", 1);   // the filler before a wide character that doesn't fit
+			col++;
+		}
+		term.Print(ghost.data() + i, n);
+		col += w;
+		i += n;
+	}
+	ColorSet (CROSSLINE_COLOR_DEFAULT);
+	if (oldEnd > end) {
+		term.Print(std::string(oldEnd - end, ' '));
+	}
+	// a full last row leaves the cursor waiting to wrap on its last column
+	int at = std::max(end, oldEnd);
+	if (term.PendingWrap() && (at > textEnd) && (at % cols == 0)) {
+		at--;
+	}
+	CursorMoveCell(at, cur, cols);
+
+	shown.suggestion.assign(ghost.data(), ghost.length());
+	shown.suggestCell = textEnd;
+	shown.suggestEnd = ghost.empty() ? 0 : end;
+}
+
+// Copy part text[cut_beg, cut_end] from src to dest
+void Crossline::TextCopy (std::string &dest, const std::string &src, int cut_beg, int cut_end)
+{
+	int len = cut_end - cut_beg;
+	if (len > 0) {
+		if (cut_beg == 0 && len == src.length()) {
+			dest = src;
+		} else {
+			dest = src.substr(cut_beg, len);
+		}
+	} else {
+		dest.clear();
+	}
+}
+
+// Copy from history buffer to buf
+void Crossline::CopyFromHistory (const std::string &prompt, std::string &buf, int &pos, int &num, int history_id)
+{
+	buf = history->GetHistoryView(history_id);
+	Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_CHANGED, 0);
+}
+
+/*****************************************************************************/
+
+// Convert ESC+Key to Alt-Key
+static int crossline_key_esc2alt (int ch)
+{
+	switch (ch) {
+	case KEY_DEL:	ch = KEY_ALT_DEL;	break;
+	case KEY_HOME:	ch = KEY_ALT_HOME;	break;
+	case KEY_END:	ch = KEY_ALT_END;	break;
+	case KEY_UP:	ch = KEY_ALT_UP;	break;
+	case KEY_DOWN:	ch = KEY_ALT_DOWN;	break;
+	case KEY_LEFT:	ch = KEY_ALT_LEFT;	break;
+	case KEY_RIGHT:	ch = KEY_ALT_RIGHT;	break;
+	case KEY_BACKSPACE:	ch = KEY_ALT_BACKSPACE;	break;
+	}
+	return ch;
+}
+
+// Map other function keys to main key, for the menus and searches (the edit keymap has them all)
+static int crossline_key_mapping (int ch)
+{
+	switch (ch) {
+#ifndef _WIN32
+	case KEY_HOME2:			ch = KEY_HOME;			break;
+	case KEY_END2:			ch = KEY_END;			break;
+	case KEY_CTRL_UP2:		ch = KEY_CTRL_UP;		break;
+	case KEY_CTRL_DOWN2:	ch = KEY_CTRL_DOWN;		break;
+	case KEY_CTRL_LEFT2:	ch = KEY_CTRL_LEFT;		break;
+	case KEY_CTRL_RIGHT2:	ch = KEY_CTRL_RIGHT;	break;
+	case KEY_F1_2:			ch = KEY_F1;			break;
+	case KEY_F2_2:			ch = KEY_F2;			break;
+	case KEY_F3_2:			ch = KEY_F3;			break;
+	case KEY_F4_2:			ch = KEY_F4;			break;
+#endif
+	case KEY_DEL2:			ch = KEY_BACKSPACE;		break;
+	}
+	return ch;
+}
+
+#ifdef _WIN32	// Windows
+// Read a KEY from keyboard, is_esc indicats whether it's a function key.
+static int crossline_getkey (Crossline &cLine, bool &is_esc, const bool check_esc)
+{
+	int ch = cLine.privData->term.GetChar(true);
+	is_esc = KEY_ESC == ch;
+
+	if (KEY_RESIZE == ch) {
+		return ch;
+	} else if ((GetKeyState (VK_CONTROL) & 0x8000) && (KEY_DEL2 == ch)) {
+		ch = KEY_CTRL_BACKSPACE;
+	} else if ((224 == ch) || (0 == ch)) {
+		is_esc = true;
+		ch = cLine.Getch ();
+		ch = (GetKeyState (VK_MENU) & 0x8000) ? ALT_KEY(ch) : ch + (KEY_ESC<<8);
+	} else if (check_esc && KEY_ESC == ch) { // Handle ESC+Key
+		bool esc;
+		ch = crossline_getkey (cLine, esc, check_esc);
+		ch = crossline_key_esc2alt (ch);
+	} else if (GetKeyState (VK_MENU) & 0x8000 && !(GetKeyState (VK_CONTROL) & 0x8000) ) {
+		is_esc = true;
+		ch = ALT_KEY(ch);
+	}
+	return ch;
+}
+
+
+#else // Linux
+
+#define CROSS_ESC_SEQ_MAX		32		// longest escape sequence accepted
+#define CROSS_ESC_PARAMS		4		// CSI parameters kept
+
+// Keys for escape sequence finals (and the numbers before ~), with the variants for the
+// xterm Ctrl and Alt modifiers where the edit loop has one
+struct CrosslineEscKey {
+	int code;
+	int key;
+	int ctrlKey;
+	int altKey;
+};
+
+static const CrosslineEscKey s_csi_final_keys[] = {	// Esc[A, Esc[1;5A
+	{'A',	KEY_UP,		KEY_CTRL_UP,	KEY_ALT_UP},
+	{'B',	KEY_DOWN,	KEY_CTRL_DOWN,	KEY_ALT_DOWN},
+	{'C',	KEY_RIGHT,	KEY_CTRL_RIGHT,	KEY_ALT_RIGHT},
+	{'D',	KEY_LEFT,	KEY_CTRL_LEFT,	KEY_ALT_LEFT},
+	{'H',	KEY_HOME2,	KEY_CTRL_HOME,	KEY_ALT_HOME},
+	{'F',	KEY_END2,	KEY_CTRL_END,	KEY_ALT_END},
+	{'P',	KEY_F1,		KEY_F1,			KEY_F1},
+	{'Q',	KEY_F2,		KEY_F2,			KEY_F2},
+	{'R',	KEY_F3,		KEY_F3,			KEY_F3},
+	{'S',	KEY_F4,		KEY_F4,			KEY_F4},
+};
+
+static const CrosslineEscKey s_csi_tilde_keys[] = {	// Esc[3~, Esc[3;5~
+	{1,		KEY_HOME,	KEY_CTRL_HOME,	KEY_ALT_HOME},
+	{2,		KEY_INSERT,	KEY_INSERT,		KEY_INSERT},
+	{3,		KEY_DEL,	KEY_CTRL_DEL,	KEY_ALT_DEL},
+	{4,		KEY_END,	KEY_CTRL_END,	KEY_ALT_END},
+	{5,		KEY_PGUP,	KEY_PGUP,		KEY_PGUP},
+	{6,		KEY_PGDN,	KEY_PGDN,		KEY_PGDN},
+	{7,		KEY_HOME,	KEY_CTRL_HOME,	KEY_ALT_HOME},	// rxvt
+	{8,		KEY_END,	KEY_CTRL_END,	KEY_ALT_END},
+	{11,	KEY_F1,		KEY_F1,			KEY_F1},
+	{12,	KEY_F2,		KEY_F2,			KEY_F2},
+	{13,	KEY_F3,		KEY_F3,			KEY_F3},
+	{14,	KEY_F4,		KEY_F4,			KEY_F4},
+	{200,	KEY_PASTE_BEGIN,	KEY_PASTE_BEGIN,	KEY_PASTE_BEGIN},
+	{201,	KEY_PASTE_END,		KEY_PASTE_END,		KEY_PASTE_END},
+};
+
+static const CrosslineEscKey s_ss3_keys[] = {		// EscOP, EscO5A
+	{'A',	KEY_CTRL_UP2,		KEY_CTRL_UP,	KEY_ALT_UP},
+	{'B',	KEY_CTRL_DOWN2,		KEY_CTRL_DOWN,	KEY_ALT_DOWN},
+	{'C',	KEY_CTRL_RIGHT2,	KEY_CTRL_RIGHT,	KEY_ALT_RIGHT},
+	{'D',	KEY_CTRL_LEFT2,		KEY_CTRL_LEFT,	KEY_ALT_LEFT},
+	{'H',	KEY_HOME2,	KEY_CTRL_HOME,	KEY_ALT_HOME},
+	{'F',	KEY_END2,	KEY_CTRL_END,	KEY_ALT_END},
+	{'P',	KEY_F1,		KEY_F1,			KEY_F1},
+	{'Q',	KEY_F2,		KEY_F2,			KEY_F2},
+	{'R',	KEY_F3,		KEY_F3,			KEY_F3},
+	{'S',	KEY_F4,		KEY_F4,			KEY_F4},
+};
+
+// Look code up in a key table, mod is the xterm modifier parameter (1 + shift 1, alt 2, ctrl 4, meta 8)
+template <size_t N>
+static int crossline_esc_lookup (const CrosslineEscKey (&table)[N], const int code, const int mod)
+{
+	const int bits = (mod > 1) ? mod - 1 : 0;
+	for (size_t i = 0; i < N; ++i) {
+		if (table[i].code == code) {
+			if (bits & 4)			{ return table[i].ctrlKey; }
+			if (bits & (2 | 8))		{ return table[i].altKey; }
+			return table[i].key;
+		}
+	}
+	return 0;
+}
+
+// A character with modifiers, from kitty's Esc[code;modu or xterm modifyOtherKeys Esc[27;mod;code~
+static int crossline_esc_modchar (int code, const int mod, bool &is_esc)
+{
+	const int bits = (mod > 1) ? mod - 1 : 0;
+	switch (code) {
+	case 13:	code = KEY_ENTER;	break;
+	case 9:		code = KEY_TAB;		break;
+	case 27:	return KEY_ESC;
+	case 8:
+	case 127:
+		if (bits & 4)	{ return KEY_CTRL_BACKSPACE; }
+		code = KEY_DEL2;
+		break;
+	}
+	if ((code <= 0) || (code >= 127)) {
+		return 0;   // only ASCII is handled
+	}
+	if ((bits & 1) && islower(code)) {
+		code = toupper(code);
+	}
+	if ((bits & 4) && (code >= '@') && (code <= 'z')) {
+		code = toupper(code) & 0x1f;
+	}
+	if (bits & (2 | 8)) {
+		return ALT_KEY(code);
+	}
+	is_esc = !isprint(code) && (code >= ' ');
+	return code;
+}
+
+// Esc[ params intermediates final, the start has been read.  Returns 0 for what isn't a key
+static int crossline_esc_csi (TerminalClass &term, const int timeout, bool &is_esc)
+{
+	int params[CROSS_ESC_PARAMS];
+	int np = 0;
+	int cur = -1;           // the parameter being read, -1 when it is absent
+	bool sub = false;       // in a : sub-parameter, which is skipped
+	int priv = 0;
+	int ch = term.GetCharWait(timeout);
+	if ('[' == ch) {    // linux console Esc[[A
+		ch = term.GetCharWait(timeout);
+		return (ch < 0) ? 0 : ESC_KEY4('[', ch);
+	}
+	for (int n = 0; n < CROSS_ESC_SEQ_MAX; ++n, ch = term.GetCharWait(timeout)) {
+		if (ch < 0) {
+			return 0;       // the rest of the sequence never came
+		}
+		if ((ch >= '0') && (ch <= '9')) {
+			if (!sub) {
+				cur = std::min((cur < 0 ? 0 : cur) * 10 + (ch - '0'), 0xfffff);
+			}
+		} else if (';' == ch) {
+			if (np < CROSS_ESC_PARAMS) { params[np++] = cur; }
+			cur = -1;
+			sub = false;
+		} else if (':' == ch) {
+			sub = true;
+		} else if ((ch >= '<') && (ch <= '?')) {
+			priv = ch;
+		} else if ((ch >= 0x20) && (ch <= 0x2f)) {
+			// intermediate bytes, none of the keys use them
+		} else if ((ch >= 0x40) && (ch <= 0x7e)) {
+			if (np < CROSS_ESC_PARAMS) { params[np++] = cur; }
+			break;
+		} else {
+			term.PutChar(ch);   // not part of a sequence, e.g. the next Esc
+			return 0;
+		}
+	}
+	if ((ch < 0x40) || (ch > 0x7e) || priv) {
+		return 0;
+	}
+	for (int i = np; i < CROSS_ESC_PARAMS; ++i) {
+		params[i] = -1;
+	}
+	if ('~' == ch) {
+		if ((27 == params[0]) && (params[2] >= 0)) {
+			return crossline_esc_modchar (params[2], params[1], is_esc);
+		}
+		return crossline_esc_lookup (s_csi_tilde_keys, params[0], params[1]);
+	}
+	if ('u' == ch) {
+		return crossline_esc_modchar (params[0], params[1], is_esc);
+	}
+	if (params[0] > 1) {
+		return 0;   // e.g. a cursor position report
+	}
+	return crossline_esc_lookup (s_csi_final_keys, ch, params[1]);
+}
+
+// Convert the escape sequence after an Esc to internal special function key.  Bytes still
+// to come are waited for up to timeout ms, so a lone Esc and sequences split across reads
+// are both decoded
+static int crossline_get_esckey (Crossline &cLine, bool &is_esc)
+{
+	TerminalClass &term = cLine.privData->term;
+	const int timeout = cLine.privData->escTimeoutMs;
+	int ch = term.GetCharWait(timeout);
+	if (ch < 0) {
+		return KEY_ESC;         // Esc on its own
+	}
+	if ('[' == ch) {
+		return crossline_esc_csi (term, timeout, is_esc);
+	}
+	if ('O' == ch) {
+		int mod = -1;
+		ch = term.GetCharWait(timeout);
+		if (ch < 0) {
+			return ALT_KEY('O');
+		}
+		while ((ch >= '0') && (ch <= '9')) {   // EscO5A
+			mod = ch - '0';
+			ch = term.GetCharWait(timeout);
+		}
+		return (ch < 0) ? 0 : crossline_esc_lookup (s_ss3_keys, ch, mod);
+	}
+	if (KEY_ESC == ch) {    // Handle ESC+Key
+		ch = crossline_get_esckey (cLine, is_esc);
+		if (KEY_ESC == ch) {
+			return ch;
+		}
+		is_esc = true;
+		ch = crossline_key_mapping (ch);
+		return crossline_key_esc2alt (ch);
+	}
+	return ALT_KEY (ch);    // ex. Alt+Backspace
+}
+
+// Read a KEY from keyboard, is_esc indicats whether it's a function key.
+static int crossline_getkey (Crossline &cLine, bool &is_esc, const bool check_esc)
+{
+	int ch = cLine.privData->term.GetChar(true);   // a resize can interrupt the wait for a key
+	is_esc = KEY_ESC == ch;
+	if (check_esc && is_esc) {
+		ch = crossline_get_esckey (cLine, is_esc);
+	}
+	return ch;
+}
+
+// Read the text of a bracketed paste up to Esc[201~, or what came of it if the input ends.
+// Runs of line breaks and tabs become a space and other control characters are dropped,
+// the paste is plain text
+static void crossline_read_paste (TerminalClass &term, std::string &paste)
+{
+	static const std::string endMark = "\x1b[201~";
+	paste.clear();
+	int matched = 0;
+	int prev = 0;
+	while (matched < (int)endMark.length()) {
+		int ch = term.GetChar();
+		if ((0 == ch) && term.InputEnded()) {
+			break;
+		}
+		if (ch == endMark[matched]) {
+			matched++;
+			continue;
+		}
+		if (matched > 0) {  // not the end marker after all
+			paste.append(endMark, 1, matched-1);
+			matched = (ch == endMark[0]) ? 1 : 0;
+			if (matched) {
+				continue;
+			}
+		}
+		const bool isBreak = (KEY_ENTER == ch) || (KEY_ENTER2 == ch);
+		if (isBreak && ((KEY_ENTER == prev) || (KEY_ENTER2 == prev))) {
+			// \r\n (or \n\n after the tty's CR->NL mapping) is one line break
+		} else if (isBreak || (KEY_TAB == ch)) {
+			paste += ' ';
+		} else if ((ch >= ' ') && (ch != KEY_DEL2)) {
+			paste += (char)ch;
+		}
+		prev = ch;
+	}
+}
+
+#endif // #ifdef _WIN32
+
+bool Crossline::DoHistorySearch(const std::string &prompt, std::string &buf, int &pos, int &num,
+                                int &history_id)
+{
+	// already have text so search
 	std::pair<int, std::string> res;
 	std::string search = buf;
 	res = HistorySearch(search);
 	history_id = res.first;
 
-	if (history_id < 0) {
-        PrintStr("\n");   // go to next line
-        Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_ALL, 0);
-		return false;
-	}
-	buf = res.second;
-	Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_ALL, 0);
-	return true;
+	if (history_id < 0) {
+        PrintStr("\n");   // go to next line
+        Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_CHANGED, 0);
+		return false;
+	}
+	buf = res.second;
+	Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_CHANGED, 0);
+	return true;
+}
+
+// Incremental (bash style) history search, the match is updated on every key.
+// Typing narrows the previous matches, Backspace goes back a level, Ctrl-R/Ctrl-S step to
+// older/newer matches, Enter or any other edit key keeps the match in buf, Ctrl-G/Ctrl-C cancel
+bool Crossline::IncrementalSearch(const std::string &prompt, std::string &buf, int &pos, int &num,
+                                  bool reverse)
+{
+	std::vector<CrosslineSearchLevel> levels(1);
+	std::string pattern, match;
+	const std::string input = buf;
+	const int inputPos = pos;
+	const bool noRepeats = privData->history_noSearchRepeats;
+	int sel = 0, matchPos = 0;
+	bool stepped = false, found = false;
+	int done = 0;
+	history->HistorySync(true);   // search everything
+
+	// add a level for pattern, narrowing the last level's hits when they must include all the new ones
+	auto pushLevel = [&]() {
+		CrosslineSearchLevel next;
+		next.pattern = pattern;
+		CrosslineSearchLevel &prev = levels.back();
+		crossline_split_patterns (pattern, next.pat);
+		bool narrow = !prev.pat.Empty() && crossline_patterns_narrow (prev.pat, next.pat);
+		crossline_search_filter (*history, next, narrow ? &prev : NULL, noRepeats);
+		levels.push_back(std::move(next));
+		sel = 0;
+	};
+
+	do {
+		CrosslineSearchLevel &level = levels.back();
+		if ((sel >= (int)level.top.size()) && !level.topAll) {
+			crossline_search_rank (*history, level, sel + CROSS_SEARCH_RANK_PAGE);
+		}
+		if (sel >= (int)level.top.size()) {
+			sel = std::max((int)level.top.size() - 1, 0);
+			if (stepped)	{ privData->term.Beep(); }
+		}
+		found = !level.top.empty();
+		match = found ? std::string(history->GetHistoryView(level.top[sel].ind)) : "";
+		matchPos = found ? level.top[sel].pos : 0;
+		stepped = false;
+
+		std::string searchPrompt = std::string((found || pattern.empty()) ? "(" : "(failed ") +
+		                           (reverse ? "reverse-i-search)`" : "i-search)`") + pattern + "': ";
+		Refresh(searchPrompt, match, pos, num, matchPos, match.length(), UpdateType::DRAW_CHANGED, 0);
+		privData->term.Flush();
+
+		bool is_esc;
+		int ch = crossline_getkey (*this, is_esc, privData->allowEscCombo);
+		ch = crossline_key_mapping (ch);
+
+		switch (ch) {
+		case KEY_WAKE:
+			break;
+
+		case KEY_RESIZE:	// draw again from the start of the line
+			if (privData->shown.valid) {
+				CursorMoveCell(privData->shown.Cell(pos), 0, privData->shown.cols);
+			}
+			PrintStr("\x1b[J");
+			pos = num = 0;
+			break;
+
+		case KEY_BACKSPACE:
+			if (pattern.empty()) {
+				privData->term.Beep();
+				break;
+			}
+			pattern.pop_back();
+			if (levels.size() > 1) {
+				levels.pop_back();
+			}
+			if (levels.back().pattern != pattern) {  // a paste added several chars at once
+				levels.resize(1);
+				if (!pattern.empty())	{ pushLevel(); }
+			}
+			sel = 0;
+			break;
+
+		case CTRL_KEY('R'):
+		case CTRL_KEY('S'):
+			if (pattern.empty() && !privData->last_search.empty()) {
+				pattern = privData->last_search;
+				pushLevel();
+				break;
+			}
+			reverse = (CTRL_KEY('R') == ch);
+			if (reverse) {
+				sel++;
+			} else if (sel > 0) {
+				sel--;
+			} else {
+				privData->term.Beep();
+			}
+			stepped = true;
+			break;
+
+		case KEY_ENTER:
+		case KEY_ENTER2:
+			done = 1;
+			break;
+
+		case CTRL_KEY('C'):
+		case CTRL_KEY('G'):
+			done = -1;
+			break;
+
+#ifndef _WIN32
+		case KEY_PASTE_BEGIN: {
+			std::string paste;
+			crossline_read_paste (privData->term, paste);
+			if (paste.length() > 0) {
+				pattern += paste;
+				pushLevel();
+			}
+			break;
+		}
+
+		case KEY_PASTE_END:
+			break;
+#endif
+
+		default:
+			if (!is_esc && isprint(ch)) {
+				pattern += (char)ch;
+				pushLevel();
+			} else if (is_esc && !privData->allowEscCombo) {
+				done = -1;
+			} else {
+				done = 1;   // leave the search and edit the match
+			}
+			break;
+		}
+	} while (!done);
+
+	if (!pattern.empty()) {
+		privData->last_search = pattern;
+	}
+	if ((done > 0) && found) {
+		buf = match;
+		Refresh(prompt, buf, pos, num, buf.length(), buf.length(), UpdateType::DRAW_CHANGED, 0);
+		return true;
+	}
+	buf = input;
+	Refresh(prompt, buf, pos, num, inputPos, buf.length(), UpdateType::DRAW_CHANGED, 0);
+	return false;
+}
+
+bool Crossline::DoCompletion(const std::string &prompt, std::string &buf, int &pos, int &num,
+                             const bool isTab) {
+  if (nullptr == completer) {
+    return false;
+  }
+  if (privData->compAsync) {
+    CompletionStart(buf, pos, isTab);
+    return false;
+  }
+  if (!completer->CacheNarrow(buf, pos)) {
+    completer->JobBegin(0);
+    completer->Clear();
+    CrosslineStatsTimer timer(&privData->stats, privData->stats.findItems);
+    completer->FindItems(buf, *this, pos);
+    completer->CacheStore(buf, pos);
+  }
+  return CompletionShow(prompt, buf, pos, num, isTab);
+}
+
+void Crossline::CompletionAsync(const bool async, const int budgetMs)
+{
+    privData->compBudgetMs = budgetMs;
+    if (async == privData->compAsync) {
+        return;
+    }
+    privData->compAsync = async;
+    if (!async) {
+        {
+            std::lock_guard<std::mutex> lock(privData->compMutex);
+            privData->compStop = true;
+            privData->compQueued = false;
+        }
+        completer->JobCancel();
+        privData->compCv.notify_all();
+        privData->compThread.join();
+        privData->compWaiting = false;
+        return;
+    }
+    privData->compStop = false;
+    privData->compThread = std::thread([this]() {
+        CrosslinePrivate &pd = *privData;
+        std::unique_lock<std::mutex> lock(pd.compMutex);
+        while (!pd.compStop) {
+            if (!pd.compQueued) {
+                pd.compCv.wait(lock);
+                continue;
+            }
+            pd.compQueued = false;
+            std::string jobBuf = pd.compBuf;
+            int jobPos = pd.compPos;
+            unsigned int gen = pd.compGen;
+            completer->JobBegin(pd.compBudgetMs, this);
+            lock.unlock();
+
+            if (!completer->CacheNarrow(jobBuf, jobPos)) {
+                completer->Clear();
+                CrosslineStatsTimer timer(&pd.stats, pd.stats.findItems);
+                completer->FindItemsAsync(jobBuf, jobPos);
+                completer->CacheStore(jobBuf, jobPos);
+            }
+
+            lock.lock();
+            pd.compDoneGen = gen;
+            pd.term.Wake();
+        }
+    });
+}
+
+// queue a job, replacing one that is waiting and stopping one that is running
+void Crossline::CompletionStart(const std::string &buf, const int pos, const bool isTab)
+{
+    {
+        std::lock_guard<std::mutex> lock(privData->compMutex);
+        privData->compGen++;
+        privData->compBuf = buf;
+        privData->compPos = pos;
+        privData->compTab = isTab;
+        privData->compQueued = true;
+        completer->JobCancel();
+    }
+    privData->compWaiting = true;
+    privData->compCv.notify_all();
+}
+
+// the input has changed, the outstanding result isn't wanted
+void Crossline::CompletionCancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(privData->compMutex);
+        privData->compQueued = false;
+        completer->JobCancel();
+    }
+    privData->compWaiting = false;
+}
+
+// The worker has finished a job, show it if it is the latest and the worker is idle
+void Crossline::CompletionReady(const std::string &prompt, std::string &buf, int &pos, int &num)
+{
+    if (!privData->compWaiting) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(privData->compMutex);
+        if (privData->compQueued || (privData->compDoneGen != privData->compGen)) {
+            return;
+        }
+    }
+    privData->compWaiting = false;
+    if ((buf == privData->compBuf) && (pos == privData->compPos)) {
+        CompletionShow(prompt, buf, pos, num, privData->compTab);
+    }
+}
+
+#define CROSS_MENU_EXTRA	4	// in each column have "____: word_len____"
+
+// Show completions returned by callback, a page at a time.  Only the visible page is
+// formatted, the keys 1-9, a-z, A-Z select from the page shown and PgUp/PgDn, Up/Down
+// and Space move through the rest.  Any other key ends the menu and goes back to the
+// line being edited.
+int Crossline::ShowCompletions ()
+{
+	int ret = -2;
+
+    if ((completer->HasHint()) || (completer->Size() > 0)) {
+		PrintStr(" \b\n");
+		ret = -1;
+	}
+	// Print syntax hints.
+    if (completer->HasHint()) {
+		PrintStr("Please input: ");
+        ColorSet (completer->GetHintColor());
+        PrintStr(completer->GetHint());
+		ColorSet (CROSSLINE_COLOR_DEFAULT);
+		PrintStr("\n");
+	}
+	size_t total = completer->Size();
+    if (0 == total) {
+		return ret;
+	}
+
+	int word_len = 0;
+	bool with_help = false;
+	completer->Layout(word_len, with_help);
+
+    static const std::vector<char> keys = MakeIndexKeys();
+	const size_t maxKeys = keys.size();
+	const bool paged = privData->term.IsTty();
+
+	size_t first = 0;
+	int lines = 0;      // lines drawn for the current page, to go back over them
+	while (true) {
+		int rows, cols;
+		ScreenGet (rows, cols);
+		int word_num = 1;
+		if (!with_help) {
+			word_num = std::max(1, std::min(cols / (word_len + 6 + CROSS_MENU_EXTRA), 3));   // 6 = "____: ""
+		}
+		// a page is what fits above the prompt, no more than there are keys
+		size_t page = paged ? std::min(maxKeys, (size_t)std::max(1, rows - 2) * word_num) : maxKeys;
+		size_t last = std::min(total, first + page);
+		const int width = std::max(1, cols - 1);   // clip so each row is exactly one line
+
+		std::string row;
+		lines = 0;
+		for (size_t i = first; i < last; ++i) {
+			size_t col = (i - first) % word_num;
+			const CompletionItem *comp = dynamic_cast<const CompletionItem*>(completer->Get(i).get());
+			const std::string &word = comp->GetWord();
+			row.assign(4, ' ');
+			row[3] = keys[i - first];
+			row += ":  ";
+			ColorSet (comp->GetColor());
+			PrintStr(row);
+			int used = (int)(col * (word_len + 6 + CROSS_MENU_EXTRA)) + 6;
+			int room = std::max(0, width - used);
+			if (with_help) {
+				PrintStr(word.substr(0, room));
+				int l = 4 + word_len - (int)word.length();
+				room -= std::min(room, (int)word.length());
+				if ((l > 0) && (room > 0)) {
+					PrintStr(std::string(std::min(l, room), ' '));
+					room -= std::min(l, room);
+				}
+				ColorSet (comp->GetHelpColor());
+				PrintStr(comp->GetHelp().substr(0, room));
+			} else {
+				ColorSet(CROSSLINE_FGCOLOR_BLACK | CROSSLINE_FGCOLOR_BRIGHT);
+				PrintStr(word.substr(0, room));
+				int l = word_len - (int)word.length();
+				if (col + 1 < (size_t)word_num) {
+					l += CROSS_MENU_EXTRA;
+				}
+				if (l > 0) {
+					PrintStr(std::string(l, ' '));
+				}
+			}
+			ColorSet (CROSSLINE_COLOR_DEFAULT);
+			if ((col + 1 == (size_t)word_num) || (i + 1 == last)) {
+				PrintStr("\n");
+				lines++;
+			}
+		}
+
+		std::string status = "Input match id: ";
+		if (total > page) {
+			status = "Input match id (" + std::to_string(first + 1) + "-" + std::to_string(last) +
+			         " of " + std::to_string(total) + ", PgUp/PgDn): ";
+		}
+		PrintStr(status.substr(0, width));
+
+		bool is_esc;
+		int ch = crossline_getkey (*this, is_esc, privData->allowEscCombo);
+		ch = crossline_key_mapping (ch);
+
+		size_t next = first;
+		switch (ch) {
+		case KEY_WAKE:
+			break;
+		case KEY_RESIZE:
+			break;      // drawn again for the new size
+		case KEY_PGDN:
+		case ' ':
+			if (last < total) {
+				next = last;
+			} else {
+				privData->term.Beep();
+			}
+			break;
+		case KEY_PGUP:
+			next = (first > page) ? first - page : 0;
+			break;
+		case KEY_DOWN:
+			if (last < total) {
+				next = first + word_num;
+			}
+			break;
+		case KEY_UP:
+			next = (first > (size_t)word_num) ? first - word_num : 0;
+			break;
+		case KEY_HOME:
+			next = 0;
+			break;
+		case KEY_END:
+			next = (total > page) ? total - page : 0;
+			break;
+		default: {
+			int k = -1;
+			if ((ch > 0) && (ch < 128)) {
+				auto it = std::find(keys.begin(), keys.end(), (char)ch);
+				k = (it == keys.end()) ? -1 : (int)(it - keys.begin());
+			}
+			PrintStr(" \b\n");
+			if ((k >= 0) && (first + k < last)) {
+				return (int)(first + k);
+			}
+			// not a choice, give it back to the line being edited
+			if (!is_esc && (ch >= ' ') && (ch < 127)) {
+				privData->term.PutChar(ch);
+			}
+			return -1;
+		}
+		}
+		// go back to the top of the menu and draw the new page over it
+		if (!paged) {
+			PrintStr(" \b\n");
+			return -1;
+		}
+		first = next;
+		PrintStr("\r");
+		if (lines > 0) {
+			CursorMove(-lines, 0);
+		}
+		PrintStr("\x1b[J");
+	}
+}
+
+bool Crossline::CompletionShow(const std::string &prompt, std::string &buf, int &pos, int &num,
+                               const bool isTab) {
+
+  // int common_add = 0;
+  int pos1 = pos;
+  int num1 = num;
+  int oldLen = 0;
+  std::string buf1 = buf;
+
+  // Find and show any common completion
+  if (completer->Size() >= 1) {
+    if (isTab) {
+      std::string common = completer->FindCommon();
+      int commonLen = common.length();
+      int start = completer->start;
+      oldLen = completer->end - start; // length that is being replaced
+
+      // this is a temporary addition
+      buf1 = buf.substr(0, start) + common + buf.substr(completer->end);
+      if (buf1 != buf) {
+        // buf.insert(completions.end, common.substr(oldLen));
+        // common_add = commonLen;
+        Refresh(prompt, buf1, pos1, num1, start + commonLen,
+                num + commonLen - oldLen, UpdateType::DRAW_CHANGED, 0);
+        pos = pos1;
+        num = num1;
+        buf = buf1;
+        oldLen = common.length();
+      }
+    }
+  }
+
+  int newNum = num;
+  int newPos = pos;
+  // if have 1 match just use it, 0 or more then show completions or hint
+  int ind = -2;
+  if (((completer->Size() != 1) || (!isTab)) && ((ind = ShowCompletions()) > -2)) {
+
+    if ((ind >= 0) && (ind < completer->Size())) {
+      auto cmp = completer->MakeItemPtr(completer->Get(ind));
+      std::string newBuf = cmp->GetWord();
+      if (cmp->NeedQuotes()) {
+        newBuf = "\"" + newBuf + "\"";
+      }
+      // pos and num have been updated with common_add
+      int len3 = newBuf.length();
+
+      newPos = pos + len3 - oldLen;
+      newNum = num + len3 - oldLen;
+
+      int start = completer->start;
+      buf = buf.substr(0, start) + newBuf + buf.substr(pos);
+    }
+    // Need to clear the line as moving to a new prompt
+
+    RefreshFull(prompt, buf, pos, num, newPos, newNum);
+  } else {
+    pos = pos1;
+    num = num1;
+    buf = buf1;
+  }
+
+  return true;
+}
+
+void Crossline::AfterProcess(char ch)
+{
+    // do nothing
+}
+
+HistorySearchType::HistorySearchType()
+{
+    currentState = POPUP_HISTORY;
+    possibleStates = {STANDARD_HISTORY, POPUP_HISTORY};
+}
+
+HistorySearchType::HistorySearchType(const int maxSt)
+{
+    currentState = maxSt;
+    int st = STANDARD_HISTORY;
+    while (st <= maxSt) {
+        possibleStates.push_back(st);
+    }
+}
+
+void HistorySearchType::Reset()
+{
+    currentState = possibleStates.back();
+}
+
+bool HistorySearchType::CanPopup()
+{
+    return currentState > STANDARD_HISTORY;
+}
+
+void HistorySearchType::SetMin()
+{
+    currentState = STANDARD_HISTORY;
+}
+
+void HistorySearchType::Reduce()
+{
+    // move state down
+    if (currentState > STANDARD_HISTORY) {
+        currentState = currentState - 1;
+    }
+}
+
+
+/*****************************************************************************/
+
+/* Internal readline from terminal. has_input indicates buf has inital input.
+ * edit_only will disable history and complete shortcuts, only allowing line editing
+ */
+bool Crossline::ReadlineEdit(std::string &buf, const std::string &prompt, const bool has_input,
+                             const bool edit_only, const StrVec &choices, const bool clear)
+{
+	EditState st;
+	const bool highlightOn = privData->highlightOn;   // this may be a search inside another edit
+	EditBegin(st, buf, prompt, has_input, edit_only, choices, clear);
+	do {
+		bool is_esc = false;
+		int ch = crossline_getkey (*this, is_esc, privData->allowEscCombo);
+		uint64_t start = privData->stats.Start();
+		unsigned int reads = privData->term.readCount;
+		EditKey(st, ch, is_esc);
+		privData->KeyTimed(start, reads);
+		// a suggestion waiting for a pause in typing
+		if (st.suggestDue && (st.pos == st.num) && !st.read_end && !privData->term.InputWait(hintDelay)) {
+			SuggestDraw(st, true);
+			privData->term.Flush();
+		}
+	} while (!st.read_end);
+	bool ok = EditEnd(st);
+	privData->highlightOn = highlightOn;
+	return ok;
+}
+
+bool Crossline::ReadLineStart (const std::string &prompt, const std::string &initial)
+{
+	if (privData->feed) {
+		return false;   // a line is already being edited
+	}
+	if (privData->interactive < 0) {
+		privData->interactive = privData->term.Terminal().Interactive();
+	}
+	privData->feed.reset(new EditState());
+	privData->feedBuf = initial;
+	if (privData->interactive) {
+		EditBegin(*privData->feed, privData->feedBuf, prompt, initial.length() > 0, false, StrVec(), false);
+		privData->term.Flush();
+	}
+	return true;
+}
+
+int Crossline::FeedInput (std::string &line)
+{
+	if (!privData->feed) {
+		return -1;
+	}
+	if (!privData->interactive) {
+		std::string_view view;
+		bool got = privData->input.Take(view, true);
+		privData->feed.reset();
+		if (!got) {
+			line.clear();
+			return -1;
+		}
+		line.assign(view.data(), view.length());
+		return 1;
+	}
+
+	EditState &st = *privData->feed;
+	while (!st.read_end && privData->term.InputReady()) {
+		bool is_esc = false;
+		int ch = crossline_getkey (*this, is_esc, privData->allowEscCombo);
+		uint64_t start = privData->stats.Start();
+		unsigned int reads = privData->term.readCount;
+		EditKey(st, ch, is_esc);
+		privData->KeyTimed(start, reads);
+	}
+	if (st.suggestDue && (st.pos == st.num) && !st.read_end) {
+		SuggestDraw(st, true);
+	}
+	privData->term.Flush();
+	if (!st.read_end) {
+		return 0;
+	}
+	int end = st.read_end;
+	EditEnd(st);
+	privData->feed.reset();
+	if (end < 0) {
+		line.clear();
+		return -1;
+	}
+	line = privData->feedBuf;
+	return 1;
+}
+
+// Give up the line being edited, leaving it on the screen and the cursor on a new line
+void Crossline::ReadLineStop ()
+{
+	if (!privData->feed) {
+		return;
+	}
+	if (privData->interactive) {
+		EditState &st = *privData->feed;
+		SuggestShow(std::string_view(), st.pos);
+		Refresh(st.prompt, st.text, st.pos, st.num, st.num, st.num, UpdateType::MOVE_CURSOR, 0);
+		PrintStr(" \b\n");
+		st.read_end = -1;
+		EditEnd(st);
+	}
+	privData->feed.reset();
+}
+
+bool Crossline::ReadLineActive () const
+{
+	return privData->feed != nullptr;
+}
+
+#ifdef _WIN32
+void *Crossline::InputHandle () const
+{
+	return privData->term.Terminal().InputHandle();
+}
+
+void *Crossline::EventHandle () const
+{
+	return privData->term.Terminal().EventHandle();
+}
+#else
+int Crossline::InputFd () const
+{
+	return privData->term.Terminal().InputFd();
+}
+
+int Crossline::EventFd () const
+{
+	return privData->term.Terminal().EventFd();
+}
+#endif
+
+// Start editing a line: raw mode, the prompt and any initial text drawn
+void Crossline::EditBegin(EditState &st, std::string &buf, const std::string &prompt, const bool has_input,
+                          const bool edit_only, const StrVec &choices, const bool clear)
+{
+	st = EditState();
+	st.buf = &buf;
+	st.prompt = prompt;
+	st.edit_only = edit_only;
+	st.choices = choices;
+	st.clear = clear;
+	privData->highlightOn = !edit_only && choices.empty();
+
+	// are we moving back through history or searching
+	st.canHis = !edit_only;
+	historySearchState->Reset();
+
+	history->HistorySync(false);   // a mapped load finished in the background can now be used
+	history->JournalTail();        // and what other sessions have added
+	st.history_id = history->Size();
+	if (st.history_id > 0) {
+		st.has_his = true;
+	}
+
+	if (has_input) {
+		st.num = st.pos = buf.length();
+		st.input = buf;
+		st.text.Assign(buf);
+	} else {
+		buf.clear();
+		st.input.clear();
+	}
+	// stay in raw mode for the whole edit rather than switching for every key,
+	// pastes are only recognised when escape sequences are being decoded
+	privData->term.RawBegin(privData->allowEscCombo);
+	privData->term.BeginFrame();
+
+	// draw the prompt and any text if buf
+	RefreshFull(prompt, st.text, st.pos, st.num, st.pos, st.num);
+}
+
+// Handle one key, st.read_end is set when the line is finished
+void Crossline::EditKey(EditState &st, int ch, const bool is_esc)
+{
+	EditBuffer &buf = st.text;
+	const std::string &prompt = st.prompt;
+	const bool edit_only = st.edit_only;
+	const StrVec &choices = st.choices;
+	int &pos = st.pos;
+	int &num = st.num;
+	int &read_end = st.read_end;
+	int &copy_buf = st.copy_buf;
+	bool &canHis = st.canHis;
+	bool &is_choice = st.is_choice;
+	const bool has_his = st.has_his;
+	int32_t &history_id = st.history_id;
+	std::string &input = st.input;
+	bool isUp = false;
+	int new_pos;
+
+	// one lookup says what the key does, anything unbound is typed
+	const uint16_t action = privData->keymap->Get(ch);
+	// a suggestion is left to SuggestDraw by the keys that only edit the line or move in it,
+	// anything that might write past the line takes it away first
+	const bool editing = ((KeyAction::NONE == KeyAction(action)) && !is_esc) ||
+	                     ((action >= uint16_t(KeyAction::MOVE_LEFT)) && (action <= uint16_t(KeyAction::PASTE_BEGIN)));
+	if (!editing && (privData->shown.suggestEnd > 0)) {
+		SuggestShow(std::string_view(), pos);
+	}
+	switch (KeyAction(action)) {
+	case KeyAction::COMPLETION_RESULTS:		// async completion results
+		CompletionReady(prompt, buf.Str(), pos, num);
+		break;
+
+	case KeyAction::REDRAW:	// Terminal size changed, redraw with the new width straight away
+		new_pos = pos;
+		if (privData->shown.valid) {  // goto beginning of line
+			CursorMoveCell(privData->shown.Cell(pos), 0, privData->shown.cols);
+		}
+		PrintStr("\x1b[J"); // clear to end of screen
+		RefreshFull(prompt, buf, pos, num, new_pos, num);
+		break;
+
+	/* Misc Commands */
+	case KeyAction::HELP:	// Show help
+		crossline_show_help (*this, edit_only);
+		RefreshFull(prompt, buf, pos, num, pos, num);
+		break;
+
+	case KeyAction::DEBUG_KEYS:	// Enter keyboard debug mode
+		PrintStr(" \b\nEnter keyboard debug mode, <Ctrl-C> to exit debug\n");
+		while (CTRL_KEY('C') != (ch=Getch())) {
+			// printf ("%3d 0x%02x (%c)\n", ch, ch, isprint(ch) ? ch : ' ');
+		    std::ostringstream msg;
+	  		msg << std::setw(3) << ch << "0x" << std::setw(2) << ch << "x " << (isprint(ch) ? ch : ' ') << "\n";
+	  		PrintStr(msg.str());
+		}
+		RefreshFull(prompt, buf, pos, num, pos, num);
+		break;
+
+	/* Move Commands */
+	case KeyAction::MOVE_LEFT:	// Move back a character.
+		if (pos > 0)
+			{ Refresh(prompt, buf, pos, num, buf.CharBefore(pos), num, UpdateType::MOVE_CURSOR, 0); }
+		break;
+
+	case KeyAction::MOVE_RIGHT:	// Move forward a character.
+		if (pos < num) {
+			Refresh(prompt, buf, pos, num, buf.CharAfter(pos), num, UpdateType::MOVE_CURSOR, 0);
+			break;
+		}
+		// at the end it takes the suggestion
+		[[fallthrough]];
+	case KeyAction::MOVE_END:	// Move cursor to end of line, or take the suggestion if it is there
+		if ((pos == num) && !privData->shown.suggestion.empty()) {
+			const std::string more = privData->shown.suggestion;
+			const int moreLen = more.length();
+			buf.Insert(num, more);
+			Refresh(prompt, buf, pos, num, num+moreLen, num+moreLen, UpdateType::DRAW_CHANGED, 0);
+			copy_buf = 0;
+		} else {
+			Refresh(prompt, buf, pos, num, num, num, UpdateType::MOVE_CURSOR, 0);
+		}
+		break;
+
+	case KeyAction::MOVE_WORD_LEFT:	// Move back a word.
+		for (new_pos=pos-1; (new_pos > 0) && isdelim(buf[new_pos]); --new_pos)	;
+		for (; (new_pos > 0) && !isdelim(buf[new_pos]); --new_pos)	;
+		Refresh(prompt, buf, pos, num, new_pos?new_pos+1:new_pos, num, UpdateType::MOVE_CURSOR, 0);
+		break;
+
+	case KeyAction::MOVE_WORD_RIGHT:	 // Move forward a word.
+		for (new_pos=pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
+		for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)	;
+		Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::MOVE_CURSOR, 0);
+		break;
+
+	case KeyAction::MOVE_HOME:	// Move cursor to start of line.
+	    Refresh(prompt, buf, pos, num, 0, num, UpdateType::MOVE_CURSOR, 0);
+		break;
+
+	case KeyAction::CLEAR_SCREEN:	// Clear screen and redisplay line
+		ScreenClear ();
+		RefreshFull(prompt, buf, pos, num, pos, num);
+		break;
+
+	case KeyAction::MOVE_ROW_UP: // Move to up line
+		UpdownMove(prompt, buf, pos, num, -1, true);
+		break;
+
+	case KeyAction::MOVE_ROW_DOWN: // Move to down line
+		UpdownMove(prompt, buf, pos, num, 1, true);
+		break;
+
+	/* Edit Commands */
+	case KeyAction::DELETE_BACK: // Delete char to left of cursor (same with CTRL_KEY('H'))
+		if (pos > 0) {
+			new_pos = buf.CharBefore(pos);
+			buf.Erase(new_pos, pos - new_pos);
+			Refresh(prompt, buf, pos, num, new_pos, num - (pos - new_pos), UpdateType::DRAW_CHANGED, 0);
+		}
+		break;
+
+	case KeyAction::DELETE_CHAR:	// Delete character under cursor
+	case KeyAction::DELETE_CHAR_OR_EOF:
+		if (pos < num) {
+			new_pos = buf.CharAfter(pos);
+			buf.Erase(pos, new_pos - pos);
+			Refresh(prompt, buf, pos, num, pos, num - (new_pos - pos), UpdateType::DRAW_CHANGED, 0);
+		} else if ((0 == num) && (KeyAction::DELETE_CHAR_OR_EOF == KeyAction(action))) { // On an empty line, EOF
+			PrintStr(" \b\n"); read_end = -1;
+		}
+		break;
+
+	case KeyAction::UPCASE_WORD:	// Uppercase current or following word.
+		for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
+		for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)
+			{ buf.Set(new_pos, (char)toupper ((unsigned char)buf[new_pos])); }
+		Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::DOWNCASE_WORD:	// Lowercase current or following word.
+		for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
+		for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)
+			{ buf.Set(new_pos, (char)tolower ((unsigned char)buf[new_pos])); }
+		Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::CAPITALIZE_WORD:	// Capitalize current or following word.
+		for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
+		if (new_pos<num)
+			{ buf.Set(new_pos, (char)toupper ((unsigned char)buf[new_pos])); }
+		for (; new_pos<num && !isdelim(buf[new_pos]); ++new_pos)	;
+		Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::DELETE_SPACE: // Delete whitespace around cursor.
+		for (new_pos = pos; (new_pos > 0) && (' ' == buf[new_pos]); --new_pos)	;
+		buf.Erase(pos, num - pos);
+		Refresh(prompt, buf, pos, num, new_pos, num - (pos-new_pos), UpdateType::DRAW_CHANGED, 0);
+		for (new_pos = pos; (new_pos < num) && (' ' == buf[new_pos]); ++new_pos)	;
+		buf.Erase(pos, num - new_pos);
+		Refresh(prompt, buf, pos, num, pos, num - (new_pos-pos), UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::TRANSPOSE: // Transpose previous character with current character.
+		if (!buf.Ascii()) {
+			// whole characters, which may be several bytes
+			int beg = buf.CharBefore(pos), mid = pos, end = buf.CharAfter(pos);
+			if ((pos == num) || isdelim(buf[pos])) {
+				mid = beg;
+				beg = buf.CharBefore(mid);
+				end = pos;
+			}
+			if ((beg < mid) && (mid < end) && !isdelim(buf[beg]) && !isdelim(buf[mid])) {
+				std::string left, right;
+				buf.Copy(left, beg, mid);
+				buf.Copy(right, mid, end);
+				buf.Erase(beg, end - beg);
+				buf.Insert(beg, right + left);
+				Refresh(prompt, buf, pos, num, (end == pos) ? pos : end, num, UpdateType::DRAW_CHANGED, 0);
+			}
+		} else if ((pos > 0) && !isdelim(buf[pos]) && !isdelim(buf[pos-1])) {
+			ch = buf[pos];
+			buf.Set(pos, buf[pos-1]);
+			buf.Set(pos-1, (char)ch);
+			Refresh(prompt, buf, pos, num, pos<num?pos+1:pos, num, UpdateType::DRAW_CHANGED, 0);
+		} else if ((pos > 1) && !isdelim(buf[pos-1]) && !isdelim(buf[pos-2])) {
+			ch = buf[pos-1];
+			buf.Set(pos-1, buf[pos-2]);
+			buf.Set(pos-2, (char)ch);
+			Refresh(prompt, buf, pos, num, pos, num, UpdateType::DRAW_CHANGED, 0);
+		}
+		break;
+
+	/* Cut&Paste Commands */
+	case KeyAction::CUT_TO_END: // Cut from cursor to end of line.
+		buf.Copy (privData->clip_buf, pos, num);
+		Refresh(prompt, buf, pos, num, pos, pos, UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::CUT_TO_START: // Cut from start of line to cursor.
+		buf.Copy (privData->clip_buf, 0, pos);
+		buf.Erase(0, num-pos);
+		Refresh(prompt, buf, pos, num, 0, num - pos, UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::CUT_LINE:	// Cut whole line.
+		buf.Copy (privData->clip_buf, 0, num);
+		// fall through
+	case KeyAction::REVERT_LINE:	// Revert line
+		Refresh(prompt, buf, pos, num, 0, 0, UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::CUT_TO_SPACE: // Cut whitespace (not word) to left of cursor.
+	case KeyAction::CUT_WORD_LEFT: // Cut word to left of cursor.
+		new_pos = pos;
+		if ((new_pos > 1) && isdelim(buf[new_pos-1]))	{
+			--new_pos;
+		}
+		for (; (new_pos > 0) && isdelim(buf[new_pos]); --new_pos) ;
+		if (KeyAction::CUT_TO_SPACE == KeyAction(action)) {
+			for (; (new_pos > 0) && (' ' != buf[new_pos]); --new_pos)	;
+		} else {
+			for (; (new_pos > 0) && !isdelim(buf[new_pos]); --new_pos)	;
+		}
+		if ((new_pos>0) && (new_pos<pos) && isdelim(buf[new_pos]))	{
+			new_pos++;
+		}
+		buf.Copy (privData->clip_buf, new_pos, pos);
+		buf.Erase(new_pos, pos - new_pos);
+		Refresh(prompt, buf, pos, num, new_pos, num - (pos-new_pos), UpdateType::DRAW_CHANGED, 0);
+		break;
+
+	case KeyAction::CUT_WORD_RIGHT: { // Cut word following cursor.
+		for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
+		for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)	;
+		buf.Copy (privData->clip_buf, pos, new_pos);
+		int no_del = new_pos - pos;
+		buf.Erase(pos, no_del);
+		Refresh(prompt, buf, pos, num, pos, num - no_del, UpdateType::DRAW_CHANGED, 0);
+		break;
+	}
+	case KeyAction::PASTE: {	// Paste last cut text.
+		buf.Insert(pos, privData->clip_buf);
+		// memmove (&buf[pos+len], &buf[pos], num - pos);
+		// memcpy (&buf[pos], info->s_clip_buf, len);
+		int clipLen = privData->clip_buf.length();
+		Refresh(prompt, buf, pos, num, pos+clipLen, num+clipLen, UpdateType::DRAW_CHANGED, 0);
+		break;
+    }
+
+    /* Complete Commands */
+	case KeyAction::COMPLETE:		// Autocomplete (same with CTRL_KEY('I'))
+	case KeyAction::LIST_COMPLETIONS: {	// List possible completions.
+	    if (edit_only) {
+			break;
+		}
+		DoCompletion(prompt, buf.Str(), pos, num, KeyAction::COMPLETE == KeyAction(action));
+		break;
+	}
+
+	/* History Commands */
+	case KeyAction::HISTORY_PREV:		// Fetch previous line in history.
+	    // at end of line with text entered, so search
+		isUp = true;
+        if (canHis && has_his && historySearchState->CanPopup()
+            && pos > 0 && buf.Length() == (size_t)pos) {
+            bool res = DoHistorySearch(prompt, buf.Str(), pos, num, history_id);
+            if (!res) {
+                historySearchState->SetMin();
+                break;
+            }
+            historySearchState->Reduce();
+            break;
+		} else {
+			canHis = false;
+            // hisSearch = -1;
+            historySearchState->SetMin();
+		}
+
+        // Otherwise move up through the history
+		if (UpdownMove(prompt, buf, pos, num, -1, false)) {
+			break;
+		}
+		// can we use the history
+		if (edit_only || !has_his) {
+			privData->term.Beep();
+			break;
+		}
+		if (!copy_buf) {
+			buf.Copy(input, 0, num); copy_buf = 1;
+		}
+		if (history_id > 0) {
+			CopyFromHistory(prompt, buf.Str(), pos, num, --history_id);
+		} else {
+			history_id = history->Size();
+			buf.Assign(input);
+			int bufLen = buf.Length();
+			Refresh(prompt, buf, pos, num, bufLen, bufLen, UpdateType::DRAW_CHANGED, 0);
+		}
+
+		break;
+
+	case KeyAction::HISTORY_NEXT:		// Fetch next line in history.
+		// check multi line move down
+		if (UpdownMove(prompt, buf, pos, num, 1, false)) {
+			break;
+		}
+		if (!edit_only && has_his) {
+			if (!copy_buf) {
+				buf.Copy(input, 0, num);
+				copy_buf = 1;
+			}
+            if (history_id+1 < history->Size()) {
+                CopyFromHistory(prompt, buf.Str(), pos, num, ++history_id);
+			} else {
+				// cycle back
+                history_id = -1;
+				buf.Assign(input);
+				// strncpy (buf, input, size - 1);
+				// buf[size - 1] = '\0';
+				int bufLen = buf.Length();
+				Refresh(prompt, buf, pos, num, bufLen, bufLen, UpdateType::DRAW_CHANGED, 0);
+			}
+		} else {
+			privData->term.Beep();
+		}
+		break; //case UP/DOWN
+
+	case KeyAction::HISTORY_FIRST:	// Move to first line in history.
+	case KeyAction::PAGE_UP:
+		if ((KeyAction::PAGE_UP == KeyAction(action)) && PageMove(prompt, buf, pos, num, -1)) {
+			break;      // a page up in a line taller than the screen
+		}
+		if (edit_only || !has_his) {
+			break;
+		}
+		if (!copy_buf)
+			{ buf.Copy (input, 0, num); copy_buf = 1; }
+        if (history->Size() > 0) {
+			history_id = 0;
+            CopyFromHistory (prompt, buf.Str(), pos, num, history_id);
+		}
+		break;
+
+	case KeyAction::HISTORY_LAST:	// Move to end of input history.
+	case KeyAction::PAGE_DOWN: {
+		if ((KeyAction::PAGE_DOWN == KeyAction(action)) && PageMove(prompt, buf, pos, num, 1)) {
+			break;
+		}
+		if (edit_only || !has_his) {
+			break;
+		}
+		if (!copy_buf)
+			{ buf.Copy (input, 0, num); copy_buf = 1; }
+        history_id = history->Size();
+		buf.Assign(input);
+		// strncpy (buf, input, size-1);
+		// buf[size-1] = '\0';
+		int bufLen = buf.Length();
+		Refresh(prompt, buf, pos, num, bufLen, bufLen, UpdateType::DRAW_CHANGED, 0);
+		break;
+	}
+	case KeyAction::SEARCH_BACKWARD:	// Incremental search of history
+	case KeyAction::SEARCH_FORWARD:
+		if (edit_only || !has_his) {
+			privData->term.Beep();
+			break;
+		}
+		if (IncrementalSearch(prompt, buf.Str(), pos, num, KeyAction::SEARCH_BACKWARD == KeyAction(action))) {
+			copy_buf = 0;
+		}
+		break;
+
+	case KeyAction::SEARCH_HISTORY: {		// Search history with current input.
+		if (edit_only || !has_his) {
+			privData->term.Beep();
+			break;
+		}
+		buf.Copy (input, 0, num);
+		std::pair<int, std::string> res;
+		std::string search = buf.Str();   // (KEY_F4 == ch) ? buf : "";
+		res = HistorySearch (search);
+		if (res.first >= 0)	{
+			buf.Assign(res.second);
+
+			buf.Assign(input);
+		}
+
+		int bufLen = buf.Length();
+		RefreshFull(prompt, buf, pos, num, bufLen, bufLen);
+		break;
+	}
+	case KeyAction::SHOW_HISTORY:	// Show history
+        if (edit_only || !has_his || (0 == history->Size())) {
+			break;
+		}
+		PrintStr(" \b\n");
+		HistoryShow ();
+		RefreshFull(prompt, buf, pos, num, pos, num);
+		break;
+
+	case KeyAction::CLEAR_HISTORY:	// Clear history
+		if (edit_only || !has_his) {
+			break;
+		}
+		PrintStr(" \b\n!!! Confirm to clear history [y]: ");
+		if ('y' == Getch()) {
+			PrintStr(" \b\nHistory are cleared!");
+            history->Clear ();
+			history_id = 0;
+		}
+		PrintStr(" \b\n");
+		RefreshFull(prompt, buf, pos, num, pos, num);
+		break;
+
+	/* Control Commands */
+	case KeyAction::ACCEPT:		// Accept line (Enter, Ctrl-M, Ctrl-J)
+		Refresh(prompt, buf, pos, num, num, num, UpdateType::MOVE_CURSOR, 0);
+		PrintStr(" \b\n");
+		read_end = 1;
+		break;
+
+	case KeyAction::INTERRUPT:	// Abort line.
+	case KeyAction::ABORT:
+		Refresh(prompt, buf, pos, num, num, num, UpdateType::MOVE_CURSOR, 0);
+		if (KeyAction::INTERRUPT == KeyAction(action))	{ PrintStr(" \b^C\n"); }
+		else	{ PrintStr(" \b\n"); }
+		num = pos = 0;
+		errno = EAGAIN;
+		read_end = -1;
+		break;;
+
+	case KeyAction::PASTE_BEGIN: {	// Bracketed paste, insert the whole block with one redraw
+		std::string paste;
+#ifndef _WIN32
+		crossline_read_paste (privData->term, paste);
+#endif
+		int pasteLen = paste.length();
+		if (pasteLen > 0) {
+			buf.Insert(pos, paste);
+			Refresh(prompt, buf, pos, num, pos+pasteLen, num+pasteLen, UpdateType::DRAW_CHANGED, 0);
+			copy_buf = 0;
+		}
+		canHis = !edit_only;
+		break;
+	}
+
+	case KeyAction::DO_NOTHING:	// such as a stray paste end marker
+		break;
+
+	case KeyAction::SUSPEND:
+#ifndef _WIN32
+		privData->term.Suspend();    // Suspend current process
+		RefreshFull (prompt, buf, pos, num, pos, num);
+#endif
+		break;
+
+	case KeyAction::NONE:
+		canHis = !edit_only;
+		if (!is_esc && isprint(ch)) {  // && (num < size-1)) {
+			const char c = (char)ch;
+			buf.Insert(pos, &c, 1);
+			// memmove (&buf[pos+1], &buf[pos], num - pos);
+			// buf[pos] = (char)ch;
+			Refresh(prompt, buf, pos, num, pos+1, num+1, UpdateType::DRAW_CHANGED, 0);
+			copy_buf = 0;
+			st.partial.clear();
+		} else if (!is_esc && (ch >= 0x80) && (ch <= 0xff)) {
+			// a UTF-8 character arrives a byte at a time, it is inserted once it is complete
+			if ((ch >= 0xc0) || st.partial.empty()) {
+				st.partial.assign(1, (char)ch);
+			} else {
+				st.partial += (char)ch;
+			}
+			if (st.partial.length() >= crossline_utf8_len(st.partial[0])) {
+				const int len = st.partial.length();
+				buf.Insert(pos, st.partial);
+				st.partial.clear();
+				Refresh(prompt, buf, pos, num, pos+len, num+len, UpdateType::DRAW_CHANGED, 0);
+				copy_buf = 0;
+			}
+		} else if (is_esc && !privData->allowEscCombo) {
+			// clear the line
+			PrintStr("\n");
+			// pos = 0;
+			// num = 0;
+			read_end = -1;
+		}
+		break;
+
+	default: {	// a custom action, the line is drawn again as it has left it
+		std::string &line = buf.Str();
+		new_pos = pos;
+		privData->keyFunctions[action - uint16_t(KeyAction::COUNT)](*this, line, new_pos);
+		new_pos = buf.CharStart(std::max(0, std::min(new_pos, (int)line.length())));
+		const int len = line.length();
+		Refresh(prompt, buf, pos, num, new_pos, len, UpdateType::DRAW_CHANGED, 0);
+		copy_buf = 0;
+		break;
+	}
+    } // switch( action )
+	SuggestDraw(st, hintDelay <= 0);
+ 	privData->term.Flush();   // one write for everything this key produced
+	if (privData->compWaiting && (!buf.Equals(privData->compBuf) || (pos != privData->compPos))) {
+		CompletionCancel();   // completing something that has changed
+	}
+	if (!edit_only) {
+		AfterProcess(ch);
+	}
+
+ 	if (choices.size() > 0 and num > 0) {
+        bool hasMatch = false;
+        const std::string &line = buf.Str();   // choices are short
+ 		for (auto const &choice : choices) {
+ 			if (line == choice) {
+				PrintStr(" \b\n");
+				read_end = 1;
+				is_choice = true;
+                hasMatch = true;
+                break;
+            } else {
+                if (choice.find(line) == 0) {
+                    // matches start of string
+                    hasMatch = true;
+                    break;
+ 			}
+ 		}
+	}
+        if (!hasMatch) {
+            read_end = 1;
+            is_choice = false;
+        }
+	}
+	if (!isUp) {
+ 	    historySearchState->Reset();   // not doing a history search
+	}
+}
+
+// Leave raw mode and finish the line, adding it to history.  True if there is a line
+bool Crossline::EditEnd(EditState &st)
+{
+	std::string &buf = *st.buf;
+	buf.swap(st.text.Str());   // the line is only made a std::string now
+
+	if (privData->compWaiting) {
+		CompletionCancel();
+	}
+	privData->term.EndFrame();
+	privData->term.RawEnd();
+	privData->shown.valid = false;   // a caller's line has to be drawn again
+
+    if (st.clear) {
+        ClearLine();
+	}
+
+	if (st.read_end > 0) {
+		// success completion
+
+    	// add to history if not a canned response
+    	if (st.choices.size() == 0 && !st.edit_only && (st.num > 0)) {
+    		// check if already stored
+    		bool add = true;
+                int hisNo = history->Size();
+    		if (hisNo > 0) {
+    			if (buf == history->GetHistoryView(hisNo-1)) {
+    				add = false;
+    			}
+    		}
+    		if (add) {
+                    history->Add(buf);
+    		}
+    	} else if (st.choices.size() > 0 && !st.is_choice) {
+    		// have response that is not one of the choices
+    		// put the characters back and return false
+    		for (auto ch : buf) {
+                    privData->term.PutChar(ch);
+    		}
+    		buf.clear();
+    	}
+
+    	return buf.length() > 0;
+	} else {
+		return false;
+	}
+}
+
+
+const int TerminalClass::BufLen;
+
+TerminalClass::TerminalClass(CrosslineTerminal *terminal)
+{
+    io = terminal;
+    if (nullptr == io) {
+        ownIo.reset(new CrosslineConsole());
+        io = ownIo.get();
+    }
+    ansi = io->Ansi();
+#ifdef _WIN32
+    hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    dftAttributes = 0;
+#endif
+    curBuf = -1;
+    inHead = inTail = 0;
+    rawDepth = 0;
+    pasteWanted = false;
+    frameDepth = 0;
+    resizeReported = 0;
+    wakeCount = wakeReported = 0;
+    curColor = -1;
+}
+
+TerminalClass::~TerminalClass()
+{
+	Flush();
+	if (rawDepth > 0) {
+		rawDepth = 1;
+		RawEnd();
+	}
+}
+
+bool TerminalClass::EventPending() const
+{
+	return (resizeReported != ResizeCount()) || (wakeReported != wakeCount);
+}
+
+// Pushed back characters come first, then any input already read from the terminal
+int TerminalClass::GetChar(const bool allowEvent)
+{
+	if (curBuf >= 0) {
+		return buffer[curBuf--];
+	}
+	if (!allowEvent || (inHead != inTail) || !EventPending()) {
+		int ch = RawGetChar(allowEvent);
+		if (KEY_RESIZE != ch) {
+			return ch;
+		}
+	}
+	// an event, resizes first
+	if (resizeReported != ResizeCount()) {
+		resizeReported = ResizeCount();
+		return KEY_RESIZE;
+	}
+	wakeReported = wakeCount;
+	return KEY_WAKE;
+}
+
+bool TerminalClass::IsTty() const
+{
+	return io->Interactive() && io->OutputTty();
+}
+
+void CrosslinePrivate::ScreenGet (int &pRows, int &pCols)
+{
+	if (screenResizeCount != term.ResizeCount()) {
+		screenResizeCount = term.ResizeCount();
+		term.ScreenQuery(screenRows, screenCols);
+	}
+	pRows = screenRows;
+	pCols = screenCols;
+}
+
+void TerminalClass::PutChar(const int c)
+{
+	if (curBuf < BufLen-1) {
+		buffer[++curBuf] = c;
+	}
+}
+
+void TerminalClass::PushInput(const unsigned char ch)
+{
+	int next = (inTail + 1) % InBufLen;
+	if (next != inHead) {
+		inBuf[inTail] = ch;
+		inTail = next;
+	}
+}
+
+bool TerminalClass::InRaw() const
+{
+	return rawDepth > 0;
+}
+
+void TerminalClass::Beep()
+{
+	Print("\x7", 1);
+}
+
+void TerminalClass::Print(const std::string &st)
+{
+	Print(st.c_str(), st.length());
+}
+
+void TerminalClass::Print(const char *st, const size_t len)
+{
+	if (frameDepth > 0) {
+		outBuf.append(st, len);
+	} else {
+		io->Write(st, len);
+	}
+}
+
+void TerminalClass::BeginFrame()
+{
+	if (frameDepth++ == 0) {
+		ColorReset();   // the application may have changed colours since the last frame
+	}
+}
+
+void TerminalClass::EndFrame()
+{
+	if ((frameDepth > 0) && (--frameDepth == 0)) {
+		Flush();
+	}
+}
+
+void TerminalClass::ColorReset()
+{
+	curColor = -1;
+}
+
+
+CrosslinePrivate::CrosslinePrivate(const bool log, CrosslineTerminal *terminal) : term(terminal)
+{
+	paging_print_line = 0;
+	prompt_color = CROSSLINE_COLOR_DEFAULT;
+	history_noSearchRepeats = false;
+	allowEscCombo = true;
+	escTimeoutMs = CROSS_ESC_TIMEOUT;
+
+    word_delimiter = CROSS_DFT_DELIMITER;
+    delimiters.Set(word_delimiter);
+
+    history_search_no = 20;
+    history_search_threads = 1;
+
+    screenResizeCount = term.ResizeCount();
+    term.ScreenQuery(screenRows, screenCols);
+    term.stats = &stats;
+    input.io = &term.Terminal();
+
+	if (log) {
+		this->log.SetLevel(Crossline::LogLevel::TRACE);
+	}
+}
+
+void Crossline::ClearLine()
+{
+    std::string st(privData->last_print_num, ' ');
+    PrintStr(st);
+    CursorMove(0, -privData->last_print_num);
+}
+
+bool CrosslinePrivate::IsLogging(const Crossline::LogLevel level) const
+{
+	return log.Enabled(level);
+}
+
+void CrosslinePrivate::LogMessage(const std::string &st)
+{
+	log.Add(Crossline::LogLevel::INFO, "%s", st.c_str());
+}
+
+// A key that read more input (a search, a menu) waited on the user, so it isn't sampled.
+// The frame is sent here so the time includes the write
+void CrosslinePrivate::KeyTimed(const uint64_t start, const unsigned int reads)
+{
+	if (!start) {
+		return;
+	}
+	term.Flush();
+	if (reads == term.readCount) {
+		stats.Stop(stats.keyLatency, start);
+	}
+	if (stats.dumpSec > 0) {
+		uint64_t now = stats.Start();
+		if (now >= stats.nextDump) {
+			stats.nextDump = now + uint64_t(stats.dumpSec) * 1000000;
+			CrosslineStats st;
+			stats.Get(st);
+			// a line a record, the whole text is longer than a log record holds
+			std::string text = st.ToString();
+			size_t from = 0;
+			while (from < text.length()) {
+				size_t to = text.find('\n', from);
+				if (to == std::string::npos) {
+					to = text.length();
+				}
+				log.Add(Crossline::LogLevel::INFO, "Stats %.*s", int(to - from), text.c_str() + from);
+				from = to + 1;
+			}
+		}
+	}
+}
+
+// The file is created, and the ring and writer started, the first time logging is turned on
+void CrosslineLog::SetLevel(const Level lvl)
+{
+	if ((lvl != Level::NONE) && !ring) {
+		file = "Messages.log";
+		FILE *fp = fopen(file.c_str(), "w");
+		if (fp == nullptr) {
+			return;
+		}
+		fclose(fp);
+		ring.reset(new Record[CROSS_LOG_RECORDS]);
+		for (size_t i = 0; i < CROSS_LOG_RECORDS; ++i) {
+			ring[i].seq.store(i, std::memory_order_relaxed);
+		}
+		start = std::chrono::steady_clock::now();
+		writer = std::thread([this]() {
+			FILE *fp = fopen(file.c_str(), "a");
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				cv.wait_for(lock, std::chrono::milliseconds(CROSS_LOG_FLUSH_MS));
+				const bool last = stop;
+				lock.unlock();
+				if (fp != nullptr) {
+					Write(fp);
+				}
+				lock.lock();
+				if (last) {
+					break;
+				}
+			}
+			if (fp != nullptr) {
+				fclose(fp);
+			}
+		});
+	}
+	level.store(int(lvl), std::memory_order_relaxed);
+}
+
+CrosslineLog::~CrosslineLog()
+{
+	if (writer.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cv.notify_all();
+		writer.join();     // writes what is left
+	}
+}
+
+void CrosslineLog::Add(const Level lvl, const char *fmt, va_list args)
+{
+	if (!Enabled(lvl) || !ring) {
+		return;
+	}
+	// claim the next free record, a record is free when its seq is the position claiming it
+	size_t pos = head.load(std::memory_order_relaxed);
+	Record *rec;
+	while (true) {
+		rec = &ring[pos & (CROSS_LOG_RECORDS - 1)];
+		size_t seq = rec->seq.load(std::memory_order_acquire);
+		if (seq == pos) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		} else if (seq < pos) {
+			dropped.fetch_add(1, std::memory_order_relaxed);   // full, the writer is behind
+			return;
+		} else {
+			pos = head.load(std::memory_order_relaxed);
+		}
+	}
+	rec->usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	rec->level = lvl;
+	int n = vsnprintf(rec->text, CROSS_LOG_TEXT_LEN, fmt, args);
+	rec->len = (uint16_t)std::min(std::max(n, 0), CROSS_LOG_TEXT_LEN - 1);
+	rec->seq.store(pos + 1, std::memory_order_release);    // ready for the writer
+	if ((pos & (CROSS_LOG_RECORDS / 2 - 1)) == 0) {
+		cv.notify_one();    // half a ring since the last nudge, don't wait for the timer
+	}
+}
+
+void CrosslineLog::Add(const Level lvl, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	Add(lvl, fmt, args);
+	va_end(args);
+}
+
+// Write the records that are ready and give them back to the producers
+void CrosslineLog::Write(FILE *fp)
+{
+	static const char *names[] = {"", "ERROR", "WARN", "INFO", "TRACE"};
+	bool wrote = false;
+	while (true) {
+		Record &rec = ring[tail & (CROSS_LOG_RECORDS - 1)];
+		if (rec.seq.load(std::memory_order_acquire) != tail + 1) {
+			break;
+		}
+		fprintf(fp, "%10.6f %-5s %.*s\n", rec.usec / 1e6, names[int(rec.level)], int(rec.len), rec.text);
+		rec.seq.store(tail + CROSS_LOG_RECORDS, std::memory_order_release);
+		tail++;
+		wrote = true;
+	}
+	size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+	if (lost > 0) {
+		fprintf(fp, "*** %zu log messages dropped\n", lost);
+		wrote = true;
+	}
+	if (wrote) {
+		fflush(fp);
+	}
+}
+
+
+// Crossline class
+Crossline::Crossline(CompleterClass *comp, HistoryClass *his, const bool log, CrosslineTerminal *terminal)
+{
+    completer = comp;
+    history = his;
+    highlighter = nullptr;
+    hintDelay = 0;
+    historySearchState = new HistorySearchType();
+
+    if (comp == nullptr) {
+        throw("No completer registered");
+    }
+    if (history == nullptr) {
+        throw("No history registered");
+    }
+
+    privData = new CrosslinePrivate(log, terminal);
+    history->stats = &privData->stats;
+}
+
+Crossline::~Crossline()
+{
+    ReadLineStop();
+    CompletionAsync(false);
+    if (completer != nullptr) {
+        delete completer;
+    }
+    if (history != nullptr) {
+        delete history;
+}
+    if (highlighter != nullptr) {
+        delete highlighter;
+    }
+    if (privData != nullptr) {
+        delete privData;
+    }
+}
+
+
+void Crossline::HighlighterSet(HighlighterClass *hl)
+{
+    if (highlighter != hl) {
+        delete highlighter;
+    }
+    highlighter = hl;
+    privData->colors.from = nullptr;   // lex the line again with the new one
+}
+
+void Crossline::AllowESCCombo(const bool all)
+{
+    privData->allowEscCombo = all;
+}
+
+void Crossline::SetEscTimeout(const int ms)
+{
+    privData->escTimeoutMs = std::max(ms, 0);
+}
+
+void Crossline::LogSetLevel(const LogLevel level)
+{
+    privData->log.SetLevel(level);
+}
+
+Crossline::LogLevel Crossline::LogGetLevel() const
+{
+    return LogLevel(privData->log.level.load());
+}
+
+void Crossline::Log(const LogLevel level, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    privData->log.Add(level, fmt, args);
+    va_end(args);
+}
+
+void Crossline::StatsEnable(const bool enable, const int dumpSec)
+{
+    CrosslineStatsData &stats = privData->stats;
+    stats.dumpSec = enable ? std::max(dumpSec, 0) : 0;
+    stats.enabled.store(enable, std::memory_order_relaxed);
+    stats.nextDump = stats.Start() + uint64_t(stats.dumpSec) * 1000000;
+}
+
+CrosslineStats Crossline::GetStats() const
+{
+    CrosslineStats st;
+    privData->stats.Get(st);
+    return st;
+}
+
+void Crossline::ResetStats()
+{
+    privData->stats.Reset();
+}
+
+
+HistoryItemPtr HistoryClass::MakeItemPtr(const SearchItemPtr &p) const
+{
+    return std::dynamic_pointer_cast<HistoryItem>(p);
+}
+
+
+void HistoryClass::HistoryDelete(const ssize_t ind, const ssize_t n)
+{
+    HistorySync(true);
+    if (itemSeq.size() != (size_t)Size()) {
+        IndexRebuild();
+    }
+    // the fingerprints of what goes
+    std::vector<std::pair<size_t, uint32_t>> gone;
+    for (ssize_t i = ind; i < ind+n; i++) {
+        gone.push_back({std::hash<std::string_view>()(GetHistoryView(i)), itemSeq[i]});
+    }
+    EntriesDeleted(ind, n);
+    if (useArena) {
+        for (ssize_t i = ind; i < ind+n; i++) {
+            if (!(arenaEntries[i].len & ArenaEntry::MAPPED)) {
+                arenaDead += arenaEntries[i].len;
+            }
+        }
+        arenaEntries.erase(arenaEntries.begin()+ind, arenaEntries.begin() + (ind+n));
+        if (arenaDead > arena.length()/2) {
+            ArenaCompact();
+        }
+    } else {
+        std::vector<SearchItemPtr>::iterator it = items.begin();
+        items.erase(it+ind, it + (ind+n));
+    }
+    itemSeq.erase(itemSeq.begin()+ind, itemSeq.begin() + (ind+n));
+    staleSeqs += n;
+    for (const std::pair<size_t, uint32_t> &g : gone) {
+        auto it = repeats.find(g.first);
+        if (it == repeats.end()) {
+            continue;
+        }
+        if (--it->second.count == 0) {
+            repeats.erase(it);
+        } else if (it->second.seq == g.second) {
+            // the newest copy went, find the one before it
+            for (ssize_t i = Size()-1; i >= 0; i--) {
+                if (std::hash<std::string_view>()(GetHistoryView(i)) == g.first) {
+                    it->second.seq = itemSeq[i];
+                    break;
+                }
+            }
+        }
+    }
+    // deleted entries are skipped in searches, only rebuild once they outnumber the rest
+    if ((useIndex || usePrefixes) && (staleSeqs > itemSeq.size())) {
+        IndexRebuild();
+    }
+}
+
+// Completions for completion or history
+CompleterClass::CompleterClass()
+{
+    cancelled = false;
+    hasDeadline = false;
+    jobLine = nullptr;
+    useCache = false;
+    Clear();
+}
+
+bool CompleterClass::Cancelled() const
+{
+    return cancelled;
+}
+
+bool CompleterClass::PastDeadline() const
+{
+    return cancelled || (hasDeadline && (std::chrono::steady_clock::now() >= deadline));
+}
+
+void CompleterClass::JobBegin(const int budgetMs, Crossline *line)
+{
+    jobLine = line;
+    cancelled = false;
+    hasDeadline = budgetMs > 0;
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(budgetMs);
+}
+
+void CompleterClass::JobCancel()
+{
+    cancelled = true;
+}
+
+void CompleterClass::Clear()
+{
+    BaseSearchable::Clear();
+	start = 0;
+	end = 0;
+	cacheValid = false;
+	layoutValid = false;
+}
+
+void CompleterClass::Layout(int &wordLen, bool &withHelp) const
+{
+    // items can be added or narrowed behind our back, a new count means a new set
+    if (!layoutValid || (layoutCount != items.size())) {
+        layoutWord = 0;
+        layoutHelp = false;
+        for (auto const &p : items) {
+            const CompletionItem *comp = dynamic_cast<const CompletionItem*>(p.get());
+            if (comp) {
+                layoutWord = std::max(layoutWord, (int)comp->GetWord().length());
+                layoutHelp = layoutHelp || (comp->GetHelp().length() > 0);
+            }
+        }
+        layoutCount = items.size();
+        layoutValid = true;
+    }
+    wordLen = layoutWord;
+    withHelp = layoutHelp;
 }
 
-bool Crossline::DoCompletion(const std::string &prompt, std::string &buf, int &pos, int &num,
-                             const bool isTab) {
-  if (nullptr == completer) {
-    return false;
-  }
-  completer->Clear();
-  completer->FindItems(buf, *this, pos);
+void CompleterClass::CacheEnable(const bool enable)
+{
+    useCache = enable;
+    cacheValid = false;
+}
 
-  // int common_add = 0;
-  int pos1 = pos;
-  int num1 = num;
-  int oldLen = 0;
-  std::string buf1 = buf;
+bool CompleterClass::CacheEnabled() const
+{
+    return useCache;
+}
 
-  // Find and show any common completion
-  if (completer->Size() >= 1) {
-    if (isTab) {
-      std::string common = completer->FindCommon();
-      int commonLen = common.length();
-      int start = completer->start;
-      oldLen = completer->end - start; // length that is being replaced
+// ignoring case, so the narrowed items are what CompletionDict::Complete would give
+bool CompleterClass::PrefixMatch(const CompletionItem &item, const std::string &prefix) const
+{
+    const std::string &word = item.GetWord();
+    if (word.length() < prefix.length()) {
+        return false;
+    }
+    for (size_t i = 0; i < prefix.length(); ++i) {
+        if (crossline_fold(word[i]) != crossline_fold(prefix[i])) {
+            return false;
+        }
+    }
+    return true;
+}
 
-      // this is a temporary addition
-      buf1 = buf.substr(0, start) + common + buf.substr(completer->end);
-      if (buf1 != buf) {
-        // buf.insert(completions.end, common.substr(oldLen));
-        // common_add = commonLen;
-        Refresh(prompt, buf1, pos1, num1, start + commonLen,
-                num + commonLen - oldLen, UpdateType::DRAW_ALL, 0);
-        pos = pos1;
-        num = num1;
-        buf = buf1;
-        oldLen = common.length();
-      }
+bool CompleterClass::CacheNarrow(const std::string &buf, const int pos)
+{
+    if (!useCache || !cacheValid) {
+        return false;
     }
-  }
+    // the text around the token must be unchanged and the token only longer
+    size_t st = cacheHead.length();
+    size_t plen = cachePrefix.length();
+    if ((pos < (int)(st + plen)) || (buf.length() - pos != cacheTail.length()) ||
+        (buf.compare(0, st, cacheHead) != 0) || (buf.compare(st, plen, cachePrefix) != 0) ||
+        (buf.compare(pos, std::string::npos, cacheTail) != 0)) {
+        return false;
+    }
+    // a space or quote may start a new token, let FindItems decide
+    std::string prefix = buf.substr(st, pos - st);
+    if (prefix.find_first_of(" \t\"'", plen) != std::string::npos) {
+        return false;
+    }
+    if (prefix.length() > plen) {
+        size_t keep = 0;
+        for (size_t i = 0; i < items.size(); ++i) {
+            auto comp = std::dynamic_pointer_cast<CompletionItem>(items[i]);
+            if (comp && PrefixMatch(*comp, prefix)) {
+                items[keep++] = items[i];
+            }
+        }
+        items.resize(keep);
+        cachePrefix = prefix;
+    }
+    start = st;
+    end = pos;
+    return true;
+}
 
-  int newNum = num;
-  int newPos = pos;
-  // if have 1 match just use it, 0 or more then show completions or hint
-  std::map<std::string, int> matches;
-  if (((completer->Size() != 1) || (!isTab)) && ShowCompletions(matches)) {
+void CompleterClass::CacheStore(const std::string &buf, const int pos)
+{
+    // a partial result (cancelled or out of time) can't be narrowed later
+    cacheValid = useCache && (end == pos) && (start <= end) && (end <= (int)buf.length()) &&
+                 !PastDeadline();
+    if (cacheValid) {
+        cacheHead = buf.substr(0, start);
+        cachePrefix = buf.substr(start, end - start);
+        cacheTail = buf.substr(end);
+    }
+}
 
-    if (matches.size() > 0) {
-      StrVec inChoices;
-      for (auto const &pair : matches) {
-        inChoices.push_back(pair.first);
-      }
-      std::string inBuf;
-      // StrVec inChoices = {"1", "2", "3", "4", "5", "6", "7", "8", "9"};
-      if (ReadlineEdit(inBuf, "Input match id: ", false, true, inChoices,
-                       true)) {
-        if (inBuf.length() == 0) {
-          PrintStr(" \b\n");
-          return false;
-        }
+void CompleterClass::Setup(const int startIn, const int endIn)
+{
+	start = startIn;
+	end = endIn;
+}
 
-        if (matches.count(inBuf) == 0) {
-          PrintStr(" \b\n");
-          return false;
-        }
+void CompleterClass::Add(const std::string &word, const std::string &help)
+{
+    Add(word, help, false, CROSSLINE_COLOR_DEFAULT, CROSSLINE_COLOR_DEFAULT);
+}
 
-        int ind = matches[inBuf];
-        if (ind < completer->Size()) {
-          auto cmp = completer->MakeItemPtr(completer->Get(ind));
-          std::string newBuf = cmp->GetWord();
-          if (cmp->NeedQuotes()) {
-            newBuf = "\"" + newBuf + "\"";
-          }
-          // pos and num have been updated with common_add
-          int len3 = newBuf.length();
-
-          newPos = pos + len3 - oldLen;
-          newNum = num + len3 - oldLen;
-
-          int start = completer->start;
-          buf = buf.substr(0, start) + newBuf + buf.substr(pos);
-        }
-      }
+void CompleterClass::Add(const std::string &word, const std::string &help, const bool needQuotes,
+                    crossline_color_e wcolor, crossline_color_e hcolor)
+{
+    items.push_back(std::make_shared<CompletionItem>(word, help, needQuotes, wcolor, hcolor));
+}
+
+bool CompleterClass::FindItems(const std::string &buf, Crossline &cLine, const int pos)
+{
+    return true;
+}
+
+// for completers written for the edit thread, see the header
+bool CompleterClass::FindItemsAsync(const std::string &buf, const int pos)
+{
+    return (jobLine != nullptr) && FindItems(buf, *jobLine, pos);
+}
+
+
+
+
+void BaseSearchable::AddHint(const std::string &h, crossline_color_e col)
+{
+    if ((h.length() > 0)) {
+        hint = h;
+        // pCompletions.hints[CROSS_COMPLET_HINT_LEN - 1] = '\0';
+        hintColor = col;
     }
-    // Need to clear the line as moving to a new prompt
+}
 
-    RefreshFull(prompt, buf, pos, num, newPos, newNum);
-  } else {
-    pos = pos1;
-    num = num1;
-    buf = buf1;
-  }
+void BaseSearchable::Clear()
+{
+    items.clear();
+    hint = "";
+}
 
-  return true;
+void BaseSearchable::Add(const SearchItemPtr &item)
+{
+    items.push_back(item);
 }
 
-void Crossline::AfterProcess(char ch)
+bool BaseSearchable::HasHint() const
 {
-    // do nothing
+    return hint.length() > 0;
 }
 
-HistorySearchType::HistorySearchType()
+std::string BaseSearchable::GetHint() const
 {
-    currentState = POPUP_HISTORY;
-    possibleStates = {STANDARD_HISTORY, POPUP_HISTORY};
+    return hint;
 }
 
-HistorySearchType::HistorySearchType(const int maxSt)
+crossline_color_e BaseSearchable::GetHintColor() const
 {
-    currentState = maxSt;
-    int st = STANDARD_HISTORY;
-    while (st <= maxSt) {
-        possibleStates.push_back(st);
+    return hintColor;
+}
+
+CompletionItemPtr CompleterClass::MakeItemPtr(const SearchItemPtr &p) const
+{
+    return std::dynamic_pointer_cast<CompletionItem>(p);
+}
+
+std::string CompleterClass::FindCommon()  const
+{
+	// Find the common part of the completions, one pass over the words
+    std::string common;
+    if (items.size() == 0) {
+        return common;
+    }
+    auto item = std::dynamic_pointer_cast<CompletionItem>(items[0]);
+    const std::string &first = item->GetWord();
+    if (items.size() == 1) {
+        return item->NeedQuotes() ? "\"" + first + "\"" : first;
+    }
+
+    size_t len = first.length();
+    for (size_t i = 1; (i < items.size()) && (len > 0); ++i) {
+        const std::string &word = std::dynamic_pointer_cast<CompletionItem>(items[i])->GetWord();
+        size_t n = std::min(len, word.length());
+        size_t j = 0;
+        while ((j < n) && (word[j] == first[j])) {
+            j++;
+        }
+        len = j;
     }
+    common = first.substr(0, len);
+	return common;
 }
 
-void HistorySearchType::Reset()
+
+CompletionDict::CompletionDict()
 {
-    currentState = possibleStates.back();
+    sorted = true;
 }
 
-bool HistorySearchType::CanPopup()
+void CompletionDict::Add(const std::string &word, const std::string &help, const bool needQuotes,
+                         crossline_color_e wcolor, crossline_color_e hcolor)
 {
-    return currentState > STANDARD_HISTORY;
+    Entry e;
+    e.key.resize(word.length());
+    for (size_t i = 0; i < word.length(); ++i) {
+        e.key[i] = crossline_fold(word[i]);
+    }
+    e.order = entries.size();
+    e.item = std::make_shared<CompletionItem>(word, help, needQuotes, wcolor, hcolor);
+    entries.push_back(std::move(e));
+    sorted = false;
 }
 
-void HistorySearchType::SetMin()
+void CompletionDict::Clear()
 {
-    currentState = STANDARD_HISTORY;
+    entries.clear();
+    sorted = true;
 }
 
-void HistorySearchType::Reduce()
+size_t CompletionDict::Size() const
 {
-    // move state down
-    if (currentState > STANDARD_HISTORY) {
-        currentState = currentState - 1;
+    return entries.size();
+}
+
+void CompletionDict::Sort()
+{
+    if (!sorted) {
+        // stable so words differing only in case stay in the order they were added
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const Entry &a, const Entry &b) { return a.key < b.key; });
+        sorted = true;
     }
 }
 
+std::pair<size_t, size_t> CompletionDict::Range(const std::string &prefix)
+{
+    Sort();
+    std::string key(prefix.length(), '\0');
+    for (size_t i = 0; i < prefix.length(); ++i) {
+        key[i] = crossline_fold(prefix[i]);
+    }
+    // the words with the prefix are contiguous: after the first not less than it,
+    // up to the first that doesn't start with it
+    auto first = std::lower_bound(entries.begin(), entries.end(), key,
+                                  [](const Entry &e, const std::string &k) { return e.key < k; });
+    auto last = std::partition_point(first, entries.end(),
+                                     [&key](const Entry &e) { return e.key.compare(0, key.length(), key) == 0; });
+    return std::make_pair(size_t(first - entries.begin()), size_t(last - entries.begin()));
+}
 
-/*****************************************************************************/
+const CompletionItemPtr &CompletionDict::Get(const size_t i) const
+{
+    return entries[i].item;
+}
 
-/* Internal readline from terminal. has_input indicates buf has inital input.
- * edit_only will disable history and complete shortcuts, only allowing line editing
- */
-bool Crossline::ReadlineEdit(std::string &buf, const std::string &prompt, const bool has_input,
-                             const bool edit_only, const StrVec &choices, const bool clear)
+size_t CompletionDict::Complete(CompleterClass &comp, const std::string &prefix, const bool addedOrder)
 {
-	int		pos = 0, num = 0, read_end = 0;
-	bool    is_esc;
-    int     new_pos, copy_buf=0;
+    auto range = Range(prefix);
+    std::vector<size_t> ind;
+    ind.reserve(range.second - range.first);
+    for (size_t i = range.first; i < range.second; ++i) {
+        ind.push_back(i);
+    }
+    if (addedOrder) {
+        // only the matching words are put back in order, the lookup is still a binary search
+        std::sort(ind.begin(), ind.end(),
+                  [this](const size_t a, const size_t b) { return entries[a].order < entries[b].order; });
+    }
+    comp.items.reserve(comp.items.size() + ind.size());
+    for (size_t i : ind) {
+        comp.items.push_back(entries[i].item);
+    }
+    return range.second - range.first;
+}
 
-	// are we moving back through history or searching
-	bool canHis = !edit_only;
-	historySearchState->Reset();
 
-	uint32_t search_his;
-	std::string input;
+CompletionItem::CompletionItem()
+{
+    color = CROSSLINE_COLOR_DEFAULT;
+    helpColor = CROSSLINE_COLOR_DEFAULT;
+}
+
+CompletionItem::CompletionItem(const std::string w, const std::string h, const bool needQuot,
+                                const crossline_color_e wCol, const crossline_color_e hCol)
+{
+    word = w;
+    help = h;
+    needQuotes = needQuot;
+    color = wCol;
+    helpColor = hCol;
+}
 
-	int rows, cols;
-	ScreenGet (rows, cols);
+std::string CompletionItem::GetStItem(const int no) const
+{
+    return word;
+}
 
-	bool is_choice = false;
-	bool has_his = false;
-	int32_t history_id;
-	bool isUp = false;
-    history_id = history->Size();
-	if (history_id > 0) {
-	 	has_his = true;
-	}
+const std::string &CompletionItem::GetWord() const
+{
+    return word;
+}
 
-	if (has_input) {
-		num = pos = buf.length();
-		input = buf;
-	} else {
-		buf.clear();
-		input.clear();
-	}
-    // draw the prompt and any text if buf
-	RefreshFull(prompt, buf, pos, num, pos, num);
-	crossline_winchg_reg (*this);
+crossline_color_e CompletionItem::GetColor() const
+{
+    return color;
+}
 
-	do {
-		is_esc = 0;
-		isUp = 0;
-        int ch = crossline_getkey (*this, is_esc, privData->allowEscCombo);
-		ch = crossline_key_mapping (ch);
+const std::string &CompletionItem::GetHelp() const
+{
+    return help;
+}
 
-		if (privData->got_resize) { // Handle window resizing for Linux, Windows can handle it automatically
-			new_pos = pos;
-			Refresh(prompt, buf, pos, num, 0, num, UpdateType::MOVE_CURSOR, 0); // goto beginning of line
-			PrintStr("\x1b[J"); // clear to end of screen
-			Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_ALL, 0);
-			privData->got_resize = false;
-		}
+crossline_color_e CompletionItem::GetHelpColor() const
+{
+    return helpColor;
+}
 
-		switch (ch) {
-		/* Misc Commands */
-		case KEY_F1:	// Show help
-			crossline_show_help (*this, edit_only);
-			RefreshFull(prompt, buf, pos, num, pos, num);
-			break;
+bool CompletionItem::NeedQuotes() const
+{
+    return needQuotes;
+}
 
-		case KEY_DEBUG:	// Enter keyboard debug mode
-			PrintStr(" \b\nEnter keyboard debug mode, <Ctrl-C> to exit debug\n");
-			while (CTRL_KEY('C') != (ch=Getch())) {
-				// printf ("%3d 0x%02x (%c)\n", ch, ch, isprint(ch) ? ch : ' ');
-			    std::ostringstream msg;
-		  		msg << std::setw(3) << ch << "0x" << std::setw(2) << ch << "x " << (isprint(ch) ? ch : ' ') << "\n";
-		  		PrintStr(msg.str());
-			}
-			RefreshFull(prompt, buf, pos, num, pos, num);
-			break;
 
-		/* Move Commands */
-		case KEY_LEFT:	// Move back a character.
-		case CTRL_KEY('B'):
-			if (pos > 0)
-				{ Refresh(prompt, buf, pos, num, pos-1, num, UpdateType::MOVE_CURSOR, 0); }
-			break;
 
-		case KEY_RIGHT:	// Move forward a character.
-		case CTRL_KEY('F'):
-			if (pos < num)
-				{ Refresh(prompt, buf, pos, num, pos+1, num, UpdateType::MOVE_CURSOR, 0); }
-			break;
+HistoryItem::HistoryItem(const std::string &st)
+{
+    item = st;
+}
+
+std::string HistoryItem::GetStItem(const int no) const
+{
+    return item;
+}
+
+
+HistoryClass::HistoryClass()
+{
+    useIndex = false;
+    usePrefixes = false;
+    nextSeq = 0;
+    staleSeqs = 0;
+    useArena = false;
+    arenaDead = 0;
+    mapBase = NULL;
+    mapLen = 0;
+    loadDone = false;
+    loadPrefixesBuilt = false;
+    loadFirst = loadTail = 0;
+    loadPending = false;
+    journalFd = -1;
+    journalGen = 0;
+    journalPacked = 0;
+    journalTailing = false;
+    dupes = HistoryDupes::KEEP;
+    capacity = 0;
+    stats = nullptr;
+}
 
-		case ALT_KEY('b'):	// Move back a word.
-		case ALT_KEY('B'):
-		case KEY_CTRL_LEFT:
-		case KEY_ALT_LEFT:
-			for (new_pos=pos-1; (new_pos > 0) && isdelim(buf[new_pos]); --new_pos)	;
-			for (; (new_pos > 0) && !isdelim(buf[new_pos]); --new_pos)	;
-			Refresh(prompt, buf, pos, num, new_pos?new_pos+1:new_pos, num, UpdateType::MOVE_CURSOR, 0);
-			break;
+HistoryClass::~HistoryClass()
+{
+    JournalClose();
+    HistorySync(true);
+    HistoryUnmap();
+}
 
-		case ALT_KEY('f'):	 // Move forward a word.
-		case ALT_KEY('F'):
-		case KEY_CTRL_RIGHT:
-		case KEY_ALT_RIGHT:
-			for (new_pos=pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
-			for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)	;
-			Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::MOVE_CURSOR, 0);
-			break;
+bool HistoryClass::FindItems(const std::string &buf, Crossline &cLine, const int pos)
+{
+    return false;
+}
 
-		case CTRL_KEY('A'):	// Move cursor to start of line.
-		case KEY_HOME:
-		    Refresh(prompt, buf, pos, num, 0, num, UpdateType::MOVE_CURSOR, 0);
-			break;
+void HistoryClass::Add(const SearchItemPtr &item)
+{
+    HistoryItemPtr hisPtr = MakeItemPtr(item);
+    std::string st = hisPtr ? hisPtr->item : item->GetStItem(0);
+    ssize_t older = (dupes != HistoryDupes::KEEP) ? FindRepeat(st) : -1;
+    if ((dupes == HistoryDupes::IGNORE) && (older >= 0)) {
+        return;
+    }
+    if (useArena) {
+        ArenaAppend(st);
+    } else {
+        BaseSearchable::Add(item);
+    }
+    Added(item, older);
+}
 
-		case CTRL_KEY('E'):	// Move cursor to end of line
-		case KEY_END:
-			Refresh(prompt, buf, pos, num, num, num, UpdateType::MOVE_CURSOR, 0);
-			break;
+void HistoryClass::Add(const std::string &st)
+{
+    ssize_t older = (dupes != HistoryDupes::KEEP) ? FindRepeat(st) : -1;
+    if ((dupes == HistoryDupes::IGNORE) && (older >= 0)) {
+        return;
+    }
+    if (useArena) {
+        // no item is needed to keep the text
+        ArenaAppend(st);
+        Added(SearchItemPtr(), older);
+    } else {
+        Add(std::make_shared<HistoryItem>(st));
+    }
+}
 
-		case CTRL_KEY('L'):	// Clear screen and redisplay line
-			ScreenClear ();
-			RefreshFull(prompt, buf, pos, num, pos, num);
-			break;
+// an entry was put at the end, keep the index and subclasses up to date.
+// older is the same entry already in history, deleted with HistoryDupes::ERASE_OLDER
+void HistoryClass::Added(const SearchItemPtr &item, const ssize_t older)
+{
+    size_t ind = Size() - 1;
+    EntryAdded(item, ind);
+    if (itemSeq.size() != ind) {
+        // items was changed directly, the sequence numbers need to be set up again
+        IndexRebuild();
+    } else {
+        SeqAdd(ind);
+        if ((dupes == HistoryDupes::ERASE_OLDER) && (older >= 0) && !loadPending) {
+            HistoryDelete(older, 1);
+        }
+    }
+    if ((journalFd >= 0) && !journalTailing) {
+        JournalAppend(GetHistoryView(Size() - 1));
+    }
+    Trim();
+}
 
-		case KEY_CTRL_UP: // Move to up line
-		case KEY_ALT_UP:
-			UpdownMove(prompt, pos, num, -1, true);
-			break;
+// give entry ind the next sequence number and add it to the fingerprints and the index
+void HistoryClass::SeqAdd(const size_t ind)
+{
+    std::string_view st = GetHistoryView(ind);
+    itemSeq.push_back(nextSeq);
+    RepeatInfo &rep = repeats[std::hash<std::string_view>()(st)];
+    rep.seq = nextSeq;
+    rep.count++;
+    if (useIndex) {
+        IndexAdd(st);
+    }
+    if (usePrefixes) {
+        PrefixAdd(st);
+    }
+    nextSeq++;
+}
 
-		case KEY_ALT_DOWN: // Move to down line
-		case KEY_CTRL_DOWN:
-			UpdownMove(prompt, pos, num, 1, true);
-			break;
+// where the entry with sequence number seq is, -1 if it has gone
+ssize_t HistoryClass::SeqIndex(const uint32_t seq) const
+{
+    auto it = std::lower_bound(itemSeq.begin(), itemSeq.end(), seq);
+    return ((it != itemSeq.end()) && (*it == seq)) ? (it - itemSeq.begin()) : -1;
+}
 
-		/* Edit Commands */
-		case KEY_BACKSPACE: // Delete char to left of cursor (same with CTRL_KEY('H'))
-			if (pos > 0) {
-				buf.erase(pos-1, 1);
-				Refresh(prompt, buf, pos, num, pos-1, num-1, UpdateType::DRAW_ALL, 0);
-			}
-			break;
+// The newest entry the same as st, -1 if there isn't one
+ssize_t HistoryClass::FindRepeat(const std::string_view &st)
+{
+    if (itemSeq.size() != (size_t)Size()) {
+        IndexRebuild();
+    }
+    auto it = repeats.find(std::hash<std::string_view>()(st));
+    if (it == repeats.end()) {
+        return -1;
+    }
+    ssize_t ind = SeqIndex(it->second.seq);
+    return ((ind >= 0) && (GetHistoryView(ind) == st)) ? ind : -1;
+}
 
-		case KEY_DEL:	// Delete character under cursor
-		case CTRL_KEY('D'):
-			if (pos < num) {
-				buf.erase(pos, 1);
-				Refresh(prompt, buf, pos, num, pos, num - 1, UpdateType::DRAW_ALL, 0);
-			} else if ((0 == num) && (ch == CTRL_KEY('D'))) { // On an empty line, EOF
-				PrintStr(" \b\n"); read_end = -1;
-			}
-			break;
+// Whether a newer entry has the same text as entry ind
+bool HistoryClass::IsRepeat(const ssize_t ind)
+{
+    if (itemSeq.size() != (size_t)Size()) {
+        IndexRebuild();
+    }
+    auto it = repeats.find(std::hash<std::string_view>()(GetHistoryView(ind)));
+    return (it != repeats.end()) && (it->second.seq != itemSeq[ind]);
+}
 
-		case ALT_KEY('u'):	// Uppercase current or following word.
-		case ALT_KEY('U'):
-			for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
-			for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)
-				{ buf[new_pos] = (char)toupper (buf[new_pos]); }
-			Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_ALL, 0);
-			break;
+void HistoryClass::HistorySetDupes(const HistoryDupes mode)
+{
+    dupes = mode;
+}
 
-		case ALT_KEY('l'):	// Lowercase current or following word.
-		case ALT_KEY('L'):
-			for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
-			for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)
-				{ buf[new_pos] = (char)tolower (buf[new_pos]); }
-			Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_ALL, 0);
-			break;
+// Keep at most maxEntries (0 for no limit), the oldest go first.  Uses arena storage
+void HistoryClass::HistorySetCapacity(const size_t maxEntries)
+{
+    capacity = maxEntries;
+    if (capacity > 0) {
+        ArenaEnable(true);
+    }
+    Trim();
+}
 
-		case ALT_KEY('c'):	// Capitalize current or following word.
-		case ALT_KEY('C'):
-			for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
-			if (new_pos<num)
-				{ buf[new_pos] = (char)toupper (buf[new_pos]); }
-			for (; new_pos<num && !isdelim(buf[new_pos]); ++new_pos)	;
-			Refresh(prompt, buf, pos, num, new_pos, num, UpdateType::DRAW_ALL, 0);
-			break;
+// Not while a mapped load is pending, deleting would move the entries loadFirst and loadTail
+// point at.  HistorySync trims once they are merged
+void HistoryClass::Trim()
+{
+    if ((capacity > 0) && !loadPending && ((size_t)Size() > capacity)) {
+        HistoryDelete(0, Size() - capacity);
+    }
+}
 
-		case ALT_KEY('\\'): // Delete whitespace around cursor.
-			for (new_pos = pos; (new_pos > 0) && (' ' == buf[new_pos]); --new_pos)	;
-			buf.erase(pos, num - pos);
-			Refresh(prompt, buf, pos, num, new_pos, num - (pos-new_pos), UpdateType::DRAW_ALL, 0);
-			for (new_pos = pos; (new_pos < num) && (' ' == buf[new_pos]); ++new_pos)	;
-			buf.erase(pos, num - new_pos);
-			Refresh(prompt, buf, pos, num, pos, num - (new_pos-pos), UpdateType::DRAW_ALL, 0);
-			break;
+void HistoryClass::Clear()
+{
+    HistorySync(true);
+    EntriesDeleted(0, Size());
+    BaseSearchable::Clear();
+    arena.clear();
+    arenaEntries.clear();
+    arenaDead = 0;
+    HistoryUnmap();
+    trigrams.clear();
+    prefixes.clear();
+    repeats.clear();
+    itemSeq.clear();
+    staleSeqs = 0;
+}
 
-		case CTRL_KEY('T'): // Transpose previous character with current character.
-			if ((pos > 0) && !isdelim(buf[pos]) && !isdelim(buf[pos-1])) {
-				ch = buf[pos];
-				buf[pos] = buf[pos-1];
-				buf[pos-1] = (char)ch;
-				Refresh(prompt, buf, pos, num, pos<num?pos+1:pos, num, UpdateType::DRAW_ALL, 0);
-			} else if ((pos > 1) && !isdelim(buf[pos-1]) && !isdelim(buf[pos-2])) {
-				ch = buf[pos-1];
-				buf[pos-1] = buf[pos-2];
-				buf[pos-2] = (char)ch;
-				Refresh(prompt, buf, pos, num, pos, num, UpdateType::DRAW_ALL, 0);
-			}
-			break;
+int HistoryClass::Size() const
+{
+    return useArena ? arenaEntries.size() : items.size();
+}
 
-		/* Cut&Paste Commands */
-		case CTRL_KEY('K'): // Cut from cursor to end of line.
-		case KEY_CTRL_END:
-		case KEY_ALT_END:
-			TextCopy (privData->clip_buf, buf, pos, num);
-			Refresh(prompt, buf, pos, num, pos, pos, UpdateType::DRAW_ALL, 0);
-			break;
+// The text of entry n, valid until history is next changed
+std::string_view HistoryClass::GetHistoryView(const ssize_t n) const
+{
+    if (useArena) {
+        const ArenaEntry &entry = arenaEntries[n];
+        if (entry.len & ArenaEntry::MAPPED) {
+            return std::string_view(mapBase + entry.off, entry.len & ~ArenaEntry::MAPPED);
+        }
+        return std::string_view(arena.data() + entry.off, entry.len);
+    }
+    const HistoryItem *hisItem = dynamic_cast<const HistoryItem*>(items[n].get());
+    return hisItem ? std::string_view(hisItem->item) : std::string_view();
+}
 
-		case CTRL_KEY('U'): // Cut from start of line to cursor.
-		case KEY_CTRL_HOME:
-		case KEY_ALT_HOME:
-			TextCopy (privData->clip_buf, buf, 0, pos);
-			buf.erase(0, num-pos);
-			Refresh(prompt, buf, pos, num, 0, num - pos, UpdateType::DRAW_ALL, 0);
-			break;
+HistoryItemPtr HistoryClass::GetHistoryItem(const ssize_t n) const
+{
+	if (useArena) {
+		return MakeHistoryItem(n);
+	}
+	int ind = n;
+	return MakeItemPtr(Get(ind));
+}
 
-		case CTRL_KEY('X'):	// Cut whole line.
-			TextCopy (privData->clip_buf, buf, 0, num);
-			// fall through
-		case ALT_KEY('r'):	// Revert line
-		case ALT_KEY('R'):
-			Refresh(prompt, buf, pos, num, 0, 0, UpdateType::DRAW_ALL, 0);
-			break;
+// Arena mode has no items, GetHistoryItem makes one from the text
+HistoryItemPtr HistoryClass::MakeHistoryItem(const size_t ind) const
+{
+    return std::make_shared<HistoryItem>(std::string(GetHistoryView(ind)));
+}
 
-		case CTRL_KEY('W'): // Cut whitespace (not word) to left of cursor.
-		case KEY_ALT_BACKSPACE: // Cut word to left of cursor.
-		case KEY_CTRL_BACKSPACE:
-			new_pos = pos;
-			if ((new_pos > 1) && isdelim(buf[new_pos-1]))	{
-				--new_pos;
-			}
-			for (; (new_pos > 0) && isdelim(buf[new_pos]); --new_pos) ;
-			if (CTRL_KEY('W') == ch) {
-				for (; (new_pos > 0) && (' ' != buf[new_pos]); --new_pos)	;
-			} else {
-				for (; (new_pos > 0) && !isdelim(buf[new_pos]); --new_pos)	;
-			}
-			if ((new_pos>0) && (new_pos<pos) && isdelim(buf[new_pos]))	{
-				new_pos++;
-			}
-			TextCopy (privData->clip_buf, buf, new_pos, pos);
-			buf.erase(new_pos, pos - new_pos);
-			Refresh(prompt, buf, pos, num, new_pos, num - (pos-new_pos), UpdateType::DRAW_ALL, 0);
-			break;
+/*****************************************************************************/
 
-		case ALT_KEY('d'): // Cut word following cursor.
-		case ALT_KEY('D'):
-		case KEY_ALT_DEL:
-		case KEY_CTRL_DEL: {
-			for (new_pos = pos; (new_pos < num) && isdelim(buf[new_pos]); ++new_pos)	;
-			for (; (new_pos < num) && !isdelim(buf[new_pos]); ++new_pos)	;
-			TextCopy (privData->clip_buf, buf, pos, new_pos);
-			int no_del = new_pos - pos;
-			buf.erase(pos, no_del);
-			Refresh(prompt, buf, pos, num, pos, num - no_del, UpdateType::DRAW_ALL, 0);
-			break;
-		}
-		case CTRL_KEY('Y'):	// Paste last cut text.
-		case CTRL_KEY('V'):
-        case KEY_INSERT: {
-			buf.insert(pos, privData->clip_buf);
-			// memmove (&buf[pos+len], &buf[pos], num - pos);
-			// memcpy (&buf[pos], info->s_clip_buf, len);
-			int clipLen = privData->clip_buf.length();
-			Refresh(prompt, buf, pos, num, pos+clipLen, num+clipLen, UpdateType::DRAW_ALL, 0);
-			break;
+// Arena storage
+
+void HistoryClass::ArenaEnable(const bool enable)
+{
+    if (enable == useArena) {
+        return;
+    }
+    if (enable) {
+        for (size_t i = 0; i < items.size(); i++) {
+            ArenaAppend(GetHistoryView(i));
+        }
+        items.clear();
+        items.shrink_to_fit();
+        useArena = true;
+    } else {
+        HistorySync(true);
+        std::vector<SearchItemPtr> made;
+        made.reserve(arenaEntries.size());
+        for (size_t i = 0; i < arenaEntries.size(); i++) {
+            made.push_back(MakeHistoryItem(i));
         }
+        items.swap(made);
+        arena.clear();
+        arenaEntries.clear();
+        arenaDead = 0;
+        HistoryUnmap();
+        useArena = false;
+    }
+}
 
-        /* Complete Commands */
-		case KEY_TAB:		// Autocomplete (same with CTRL_KEY('I'))
-		case ALT_KEY('='):	// List possible completions.
-		case ALT_KEY('?'): {
-		    if (edit_only) {
-				break;
-			}
-			DoCompletion(prompt, buf, pos, num, ch==KEY_TAB);
-			break;
-		}
+bool HistoryClass::ArenaEnabled() const
+{
+    return useArena;
+}
 
-		/* History Commands */
-		case KEY_UP:		// Fetch previous line in history.
-		case CTRL_KEY('P'):
-		    // at end of line with text entered, so search
-			isUp = true;
-            if (canHis && has_his && historySearchState->CanPopup()
-                && pos > 0 && buf.length() == pos) {
-                bool res = DoHistorySearch(prompt, buf, pos, num, history_id);
-                if (!res) {
-                    historySearchState->SetMin();
-                    break;
-                }
-                historySearchState->Reduce();
-                break;
-    		} else {
-    			canHis = false;
-                // hisSearch = -1;
-                historySearchState->SetMin();
-    		}
+void HistoryClass::ArenaAppend(const std::string_view &st)
+{
+    arenaEntries.push_back({arena.length(), (uint32_t)st.length()});
+    arena.append(st.data(), st.length());
+}
 
-            // Otherwise move up through the history
-    		if (UpdownMove(prompt, pos, num, -1, false)) {
-    			break;
-    		}
-    		// can we use the history
-    		if (edit_only || !has_his) {
-    			privData->term.Beep();
-    			break;
-    		}
-    		if (!copy_buf) {
-    			TextCopy(input, buf, 0, num); copy_buf = 1;
-    		}
-    		if (history_id > 0) {
-    			CopyFromHistory(prompt, buf, pos, num, --history_id);
-    		} else {
-    			history_id = history->Size();
-    			buf = input;
-    			int bufLen = buf.length();
-    			Refresh(prompt, buf, pos, num, bufLen, bufLen, UpdateType::DRAW_ALL, 0);
-    		}
+// drop the text of deleted entries
+void HistoryClass::ArenaCompact()
+{
+    std::string packed;
+    packed.reserve(arena.length() - arenaDead);
+    for (ArenaEntry &entry : arenaEntries) {
+        if (entry.len & ArenaEntry::MAPPED) {
+            continue;
+        }
+        size_t off = packed.length();
+        packed.append(arena, entry.off, entry.len);
+        entry.off = off;
+    }
+    arena.swap(packed);
+    arenaDead = 0;
+}
 
-			break;
+/*****************************************************************************/
 
-		case KEY_DOWN:		// Fetch next line in history.
-		case CTRL_KEY('N'):
-			// check multi line move down
-			if (UpdownMove(prompt, pos, num, -1, false)) {
-				break;
-			}
-			if (!edit_only && has_his) {
-				if (!copy_buf) {
-					TextCopy(input, buf, 0, num);
-					copy_buf = 1;
-				}
-                if (history_id+1 < history->Size()) {
-                    CopyFromHistory(prompt, buf, pos, num, ++history_id);
-				} else {
-					// cycle back
-                    history_id = -1;
-					buf = input;
-					// strncpy (buf, input, size - 1);
-					// buf[size - 1] = '\0';
-					int bufLen = buf.length();
-					Refresh(prompt, buf, pos, num, bufLen, bufLen, UpdateType::DRAW_ALL, 0);
-				}
-			} else {
-				privData->term.Beep();
-			}
-			break; //case UP/DOWN
+// Trigram index
 
-		case ALT_KEY('<'):	// Move to first line in history.
-		case KEY_PGUP:
-			if (edit_only || !has_his) {
-				break;
-			}
-			if (!copy_buf)
-				{ TextCopy (input, buf, 0, num); copy_buf = 1; }
-            if (history->Size() > 0) {
-				history_id = 0;
-                CopyFromHistory (prompt, buf, pos, num, history_id);
-			}
-			break;
+static inline uint32_t crossline_trigram (const char *st)
+{
+    return ((uint32_t)crossline_fold(st[0]) << 16) | ((uint32_t)crossline_fold(st[1]) << 8) |
+           (uint32_t)crossline_fold(st[2]);
+}
 
-		case ALT_KEY('>'):	// Move to end of input history.
-		case KEY_PGDN: {
-			if (edit_only || !has_his) {
-				break;
-			}
-			if (!copy_buf)
-				{ TextCopy (input, buf, 0, num); copy_buf = 1; }
-            history_id = history->Size();
-			buf = input;
-			// strncpy (buf, input, size-1);
-			// buf[size-1] = '\0';
-			int bufLen = buf.length();
-			Refresh(prompt, buf, pos, num, bufLen, bufLen, UpdateType::DRAW_ALL, 0);
-			break;
-		}
-		case CTRL_KEY('R'):	// Search history
-		case CTRL_KEY('S'):
-		case KEY_F4: {		// Search history with current input.
-			if (edit_only || !has_his) {
-				privData->term.Beep();
-				break;
-			}
-			TextCopy (input, buf, 0, num);
-			std::pair<int, std::string> res;
-			std::string search = buf;   // (KEY_F4 == ch) ? buf : "";
-			res = HistorySearch (search);
-			if (res.first >= 0)	{
-				buf = res.second;
-
-				buf = input;
-			}
+// add the trigrams of st to the posting lists of seq
+static void crossline_index_add (std::unordered_map<uint32_t, std::vector<uint32_t>> &trigrams,
+                                 const std::string_view &st, const uint32_t seq)
+{
+    const char *pt = st.data();
+    for (int i = 0; i+3 <= (int)st.length(); i++) {
+        std::vector<uint32_t> &post = trigrams[crossline_trigram(pt+i)];
+        if (post.empty() || (post.back() != seq)) {
+            post.push_back(seq);
+        }
+    }
+}
 
-			int bufLen = buf.length();
-			RefreshFull(prompt, buf, pos, num, bufLen, bufLen);
-			break;
-		}
-		case KEY_F2:	// Show history
-            if (edit_only || !has_his || (0 == history->Size())) {
-				break;
-			}
-			PrintStr(" \b\n");
-			HistoryShow ();
-			RefreshFull(prompt, buf, pos, num, pos, num);
-			break;
+void HistoryClass::IndexEnable(const bool enable)
+{
+    HistorySync(true);
+    useIndex = enable;
+    IndexRebuild();
+}
 
-		case KEY_F3:	// Clear history
-			if (edit_only || !has_his) {
-				break;
-			}
-			PrintStr(" \b\n!!! Confirm to clear history [y]: ");
-			if ('y' == Getch()) {
-				PrintStr(" \b\nHistory are cleared!");
-                history->Clear ();
-				history_id = 0;
-			}
-			PrintStr(" \b\n");
-			RefreshFull(prompt, buf, pos, num, pos, num);
-			break;
+bool HistoryClass::IndexEnabled() const
+{
+    return useIndex;
+}
 
-		/* Control Commands */
-		case KEY_ENTER:		// Accept line (same with CTRL_KEY('M'))
-		case KEY_ENTER2:	// same with CTRL_KEY('J')
-			Refresh(prompt, buf, pos, num, num, num, UpdateType::MOVE_CURSOR, 0);
-			PrintStr(" \b\n");
-			read_end = 1;
-			break;
+// add the trigrams of the entry with sequence number nextSeq
+void HistoryClass::IndexAdd(const std::string_view &st)
+{
+    crossline_index_add(trigrams, st, nextSeq);
+}
 
-		case CTRL_KEY('C'):	// Abort line.
-		case CTRL_KEY('G'):
-			Refresh(prompt, buf, pos, num, num, num, UpdateType::MOVE_CURSOR, 0);
-			if (CTRL_KEY('C') == ch)	{ PrintStr(" \b^C\n"); }
-			else	{ PrintStr(" \b\n"); }
-			num = pos = 0;
-			errno = EAGAIN;
-			read_end = -1;
-			break;;
+void HistoryClass::IndexRebuild()
+{
+    trigrams.clear();
+    prefixes.clear();
+    repeats.clear();
+    itemSeq.clear();
+    staleSeqs = 0;
+    nextSeq = 0;
+    for (size_t i = 0; i < (size_t)Size(); i++) {
+        SeqAdd(i);
+    }
+}
 
-		case CTRL_KEY('Z'):
-#ifndef _WIN32
-			raise(SIGSTOP);    // Suspend current process
-			RefreshFull (prompt, buf, pos, num, pos, num);
-#endif
-			break;
+bool HistoryClass::IndexCandidates(const std::string &needle, std::vector<int> &cand)
+{
+    cand.clear();
+    if (!useIndex || (needle.length() < 3)) {
+        return false;
+    }
+    if (itemSeq.size() != (size_t)Size()) {
+        IndexRebuild();
+    }
 
-		default:
-			canHis = !edit_only;
-			if (!is_esc && isprint(ch)) {  // && (num < size-1)) {
-				buf.insert(pos, 1, ch);
-				// memmove (&buf[pos+1], &buf[pos], num - pos);
-				// buf[pos] = (char)ch;
-				if (prompt.length() + pos + 1 > cols) {
-					Refresh(prompt, buf, pos, num, pos+1, num+1, UpdateType::DRAW_ALL, 0);
-				} else {
-				 	Refresh(prompt, buf, pos, num, pos+1, num+1, UpdateType::DRAW_FROM_POS,pos);
-				}
-				copy_buf = 0;
-			} else if (is_esc && !privData->allowEscCombo) {
-				// clear the line
-				PrintStr("\n");
-				// pos = 0;
-				// num = 0;
-				read_end = -1;
-			}
-			break;
-        } // switch( ch )
-	 	fflush(stdout);
-		if (!edit_only) {
-			AfterProcess(ch);
-		}
-
-	 	if (choices.size() > 0 and num > 0) {
-            bool hasMatch = false;
-	 		for (auto const &st : choices) {
-	 			if (buf == st) {
-					PrintStr(" \b\n");
-					read_end = 1;
-					is_choice = true;
-                    hasMatch = true;
-                    break;
-                } else {
-                    if (st.find(buf) == 0) {
-                        // matches start of string
-                        hasMatch = true;
-                        break;
-	 			}
-	 		}
-		}
-            if (!hasMatch) {
-                read_end = 1;
-                is_choice = false;
+    // posting lists for every trigram of the needle, shortest first
+    std::vector<const std::vector<uint32_t>*> lists;
+    for (int i = 0; i+3 <= (int)needle.length(); i++) {
+        auto it = trigrams.find(crossline_trigram(needle.c_str()+i));
+        if (it == trigrams.end()) {
+            return true;   // a trigram no entry has, nothing can match
+        }
+        lists.push_back(&it->second);
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) { return a->size() < b->size(); });
+    lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+
+    // intersect, looking up each remaining candidate in the longer lists
+    std::vector<uint32_t> seqs = *lists[0];
+    for (size_t l = 1; (l < lists.size()) && !seqs.empty(); l++) {
+        const std::vector<uint32_t> &post = *lists[l];
+        auto from = post.begin();
+        size_t k = 0;
+        for (uint32_t seq : seqs) {
+            from = std::lower_bound(from, post.end(), seq);
+            if (from == post.end()) {
+                break;
             }
-		}
-		if (!isUp) {
-	 	    historySearchState->Reset();   // not doing a history search
-		}
-	} while ( !read_end );
-
-    if (clear) {
-        ClearLine();
-	}
-
-	if (read_end > 0) {
-		// success completion
-
-    	// add to history if not a canned response
-    	if (choices.size() == 0 && !edit_only && (num > 0)) {
-    		// check if already stored
-    		bool add = true;
-                int hisNo = history->Size();
-    		if (hisNo > 0) {
-                    HistoryItemPtr it = history->GetHistoryItem(hisNo-1);
-    			if (buf == it->item) {
-    				add = false;
-    			}
-    		}
-    		if (add) {
-                    history->Add(buf);
-    		}
-    	} else if (choices.size() > 0 && !is_choice) {
-    		// have response that is not one of the choices
-    		// put the characters back and return false
-    		for (auto ch : buf) {
-                    privData->term.PutChar(ch);
-    		}
-    		buf.clear();
-    	}
+            if (*from == seq) {
+                seqs[k++] = seq;
+            }
+        }
+        seqs.resize(k);
+    }
 
-    	return buf.length() > 0;
-	} else {
-		return false;
-	}
+    // sequence numbers to current indices, deleted entries are no longer in itemSeq
+    auto from = itemSeq.begin();
+    for (uint32_t seq : seqs) {
+        from = std::lower_bound(from, itemSeq.end(), seq);
+        if (from == itemSeq.end()) {
+            break;
+        }
+        if (*from == seq) {
+            cand.push_back(from - itemSeq.begin());
+        }
+    }
+    return true;
 }
 
+#define CROSS_PREFIX_MAX	32		// longest prefix indexed for Suggest, a power of 2
 
-const int TerminalClass::BufLen;
-
-TerminalClass::TerminalClass()
+// the prefix index key of the first len bytes of st
+static uint64_t crossline_prefix_key (const std::string_view &st, const size_t len)
 {
-#ifdef _WIN32
-    hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-#endif
-    curBuf = -1;
+    return std::hash<std::string_view>()(st.substr(0, len)) + len;
 }
 
-int TerminalClass::GetChar()
+// add the prefixes of st to the posting lists of seq
+static void crossline_prefix_add (std::unordered_map<uint64_t, std::vector<uint32_t>> &prefixes,
+                                  const std::string_view &st, const uint32_t seq)
 {
-	if (curBuf >= 0) {
-		return buffer[curBuf--];
-	}
-	return RawGetChar();
+    for (size_t len = 1; (len <= CROSS_PREFIX_MAX) && (len <= st.length()); len *= 2) {
+        prefixes[crossline_prefix_key(st, len)].push_back(seq);
+    }
 }
 
-void TerminalClass::PutChar(const int c)
+void HistoryClass::PrefixAdd(const std::string_view &st)
 {
-	if (curBuf < BufLen) {
-		buffer[++curBuf] = c;
-	}
+    crossline_prefix_add(prefixes, st, nextSeq);
 }
 
-void TerminalClass::Beep()
-{
-	Print("\x7");
+// The newest entry that starts with prefix and is longer than it, -1 if there is none
+ssize_t HistoryClass::Suggest(const std::string_view &prefix)
+{
+    if (prefix.empty()) {
+        return -1;
+    }
+    if (itemSeq.size() != (size_t)Size()) {
+        IndexRebuild();
+    }
+    if (!usePrefixes) {
+        usePrefixes = true;
+        for (size_t i = 0; i < itemSeq.size(); i++) {
+            crossline_prefix_add(prefixes, GetHistoryView(i), itemSeq[i]);
+        }
+    }
+
+    // the entries starting with the longest indexed part of prefix, newest first
+    size_t len = 1;
+    while ((len * 2 <= prefix.length()) && (len * 2 <= CROSS_PREFIX_MAX)) {
+        len *= 2;
+    }
+    auto it = prefixes.find(crossline_prefix_key(prefix, len));
+    if (it == prefixes.end()) {
+        return -1;
+    }
+    const std::vector<uint32_t> &post = it->second;
+    for (auto seq = post.rbegin(); seq != post.rend(); ++seq) {
+        const ssize_t ind = SeqIndex(*seq);
+        if (ind < 0) {
+            continue;   // deleted
+        }
+        std::string_view st = GetHistoryView(ind);
+        if ((st.length() > prefix.length()) && (st.compare(0, prefix.length(), prefix) == 0)) {
+            return ind;
+        }
+    }
+    return -1;
 }
 
+/*****************************************************************************/
+
+// Mapped history loading
 
-CrosslinePrivate::CrosslinePrivate(const bool log)
+// Map the file and use its lines as entries in place (arena storage is switched on).
+// The last tailLines lines are read straight away so the first prompt and Up work,
+// a thread finds the rest and builds the trigram index, HistorySync puts them in
+int HistoryClass::HistoryMap (const std::string &filename, const size_t tailLines)
 {
-	paging_print_line = 0;
-	prompt_color = CROSSLINE_COLOR_DEFAULT;
-	history_noSearchRepeats = false;
-	allowEscCombo = true;
+    CrosslineStatsTimer timer(stats, stats ? stats->historyLoad : s_no_stats.historyLoad);
+    if (filename.length() == 0) {
+        return -1;
+    }
+    HistorySync(true);
+    if (mapBase != NULL) {
+        // only one file is kept mapped, copy any more in
+        return HistoryLoad(filename);
+    }
 
-    word_delimiter = CROSS_DFT_DELIMITER;
-    got_resize = false;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        return -1;
+    }
+    size_t len = (size_t)fileSize.QuadPart;
+    const char *base = NULL;
+    if (len > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            base = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);   // the view keeps the mapping
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t len = st.st_size;
+    const char *base = NULL;
+    if (len > 0) {
+        void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        base = (p == MAP_FAILED) ? NULL : (const char*)p;
+    }
+    close(fd);
+#endif
+    if (len == 0) {
+        return 0;
+    }
+    if (base == NULL) {
+        return HistoryLoad(filename);
+    }
 
-    history_search_no = 20;
+    ArenaEnable(true);
+    mapBase = base;
+    mapLen = len;
 
-    ScreenGet(term.screenRows, term.screenCols);
+    // the lines start after the header of a compacted journal (JournalOpen)
+    size_t first = 0;
+    if (crossline_journal_header(std::string_view(mapBase, len))) {
+        const char *nl = (const char*)memchr(mapBase, '\n', len);
+        first = nl ? (nl - mapBase) + 1 : len;
+    }
 
-	if (log) {
-		logFile = "Messages.log";
-		std::ofstream ofs(logFile);
-		ofs.close();
-	} else {
-		logFile = "";
-	}
+    // read the tail backwards, a final newline doesn't start another line (as with getline)
+    size_t end = (mapBase[len-1] == '\n') ? len-1 : len;
+    std::vector<ArenaEntry> tail;
+    size_t start = end;
+    while ((tail.size() < tailLines) && (start > first)) {
+        size_t lineStart = start;
+        while ((lineStart > first) && (mapBase[lineStart-1] != '\n')) {
+            lineStart--;
+        }
+        tail.push_back({lineStart, (uint32_t)(start - lineStart) | ArenaEntry::MAPPED});
+        start = (lineStart > first) ? lineStart-1 : first;
+        if (lineStart == first) {
+            break;
+        }
+    }
+    size_t tailStart = tail.empty() ? len : tail.back().off;
+
+    loadPending = true;
+    loadFirst = Size();
+    loadTail = tail.size();
+    journalTailing = true;   // they are in a file already
+    for (auto it = tail.rbegin(); it != tail.rend(); ++it) {
+        arenaEntries.push_back(*it);
+        Added(SearchItemPtr(), -1);
+    }
+    journalTailing = false;
+
+    // the lines before the tail, a newline scan with memchr, then the index of the whole file
+    std::vector<ArenaEntry> tailEntries(tail.rbegin(), tail.rend());
+    // with nothing before the file its sequence numbers start at 0 and the tables can be made here
+    const bool buildTables = (loadFirst == 0);
+    const bool buildIndex = useIndex;
+    loadPrefixesBuilt = buildTables && usePrefixes;
+    const bool buildPrefixes = loadPrefixesBuilt;
+    loadDone = false;
+    loader = std::thread([this, first, tailStart, tailEntries, buildTables, buildIndex, buildPrefixes]() {
+        const char *p = mapBase + first, *stop = mapBase + tailStart;
+        while (p < stop) {
+            const char *nl = (const char*)memchr(p, '\n', stop - p);
+            if (nl == NULL) {
+                nl = stop;
+            }
+            loadEntries.push_back({(size_t)(p - mapBase), (uint32_t)(nl - p) | ArenaEntry::MAPPED});
+            p = nl + 1;
+        }
+        loadEntries.insert(loadEntries.end(), tailEntries.begin(), tailEntries.end());
+        for (size_t i = 0; buildTables && (i < loadEntries.size()); i++) {
+            std::string_view st(mapBase + loadEntries[i].off, loadEntries[i].len & ~ArenaEntry::MAPPED);
+            RepeatInfo &rep = loadRepeats[std::hash<std::string_view>()(st)];
+            rep.seq = i;
+            rep.count++;
+            if (buildIndex) {
+                crossline_index_add(loadTrigrams, st, i);
+            }
+            if (buildPrefixes) {
+                crossline_prefix_add(loadPrefixes, st, i);
+            }
+        }
+        loadDone = true;
+    });
 
+    return 0;
 }
 
-void Crossline::ClearLine()
+// Put in the entries found by a mapped load.  Without wait, returns false if it is still running
+bool HistoryClass::HistorySync(const bool wait)
 {
-    std::string st(privData->last_print_num, ' ');
-    PrintStr(st);
-    CursorMove(0, -privData->last_print_num);
+    if (!loader.joinable()) {
+        return true;
+    }
+    if (!wait && !loadDone) {
+        return false;
+    }
+    loader.join();
+
+    // the entries before the load, the whole file, then what was added since
+    const size_t noFile = loadEntries.size();
+    EntriesDeleted(loadFirst, loadTail);
+    std::deque<ArenaEntry> merged(arenaEntries.begin(), arenaEntries.begin() + loadFirst);
+    merged.insert(merged.end(), loadEntries.begin(), loadEntries.end());
+    merged.insert(merged.end(), arenaEntries.begin() + (loadFirst + loadTail), arenaEntries.end());
+    arenaEntries.swap(merged);
+    for (size_t i = 0; i < noFile; i++) {
+        EntryAdded(SearchItemPtr(), loadFirst + i);
+    }
+
+    if (loadFirst == 0) {
+        trigrams.swap(loadTrigrams);
+        repeats.swap(loadRepeats);
+        prefixes.swap(loadPrefixes);
+        itemSeq.resize(noFile);
+        for (nextSeq = 0; nextSeq < noFile; nextSeq++) {
+            itemSeq[nextSeq] = nextSeq;
+            if (usePrefixes && !loadPrefixesBuilt) {
+                PrefixAdd(GetHistoryView(nextSeq));   // suggestions were started during the load
+            }
+        }
+        staleSeqs = 0;
+        for (size_t i = noFile; i < arenaEntries.size(); i++) {
+            SeqAdd(i);
+        }
+    } else {
+        IndexRebuild();
+    }
+
+    loadEntries = std::vector<ArenaEntry>();
+    loadTrigrams.clear();
+    loadRepeats.clear();
+    loadPrefixes.clear();
+    loadFirst = loadTail = 0;
+    loadPending = false;
+    Trim();
+    return true;
 }
 
-bool CrosslinePrivate::IsLogging() const
+// copy the entries in the mapped file into the arena so it can be unmapped
+void HistoryClass::MapRelease()
 {
-	return logFile.length() > 0;
+    if (mapBase == NULL) {
+        return;
+    }
+    HistorySync(true);
+    for (ArenaEntry &entry : arenaEntries) {
+        if (entry.len & ArenaEntry::MAPPED) {
+            entry.len &= ~ArenaEntry::MAPPED;
+            size_t off = arena.length();
+            arena.append(mapBase + entry.off, entry.len);
+            entry.off = off;
+        }
+    }
+    HistoryUnmap();
 }
 
-void CrosslinePrivate::LogMessage(const std::string &st)
+void HistoryClass::HistoryUnmap()
 {
-	if (IsLogging()) {
-	    std::ofstream ofs(logFile, std::ios::app);
-	    if (ofs) {
-	        ofs << st << "\n";
-	    }
-	    ofs.close();
-	}
+    if (mapBase == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(mapBase);
+#else
+    munmap((void*)mapBase, mapLen);
+#endif
+    mapBase = NULL;
+    mapLen = 0;
 }
 
+/*****************************************************************************/
+
+// History journal
 
-// Crossline class
-Crossline::Crossline(CompleterClass *comp, HistoryClass *his, const bool log)
+#ifdef _WIN32
+static int64_t crossline_file_size (int fd)
 {
-    completer = comp;
-    history = his;
-    historySearchState = new HistorySearchType();
+    return _filelengthi64(fd);
+}
 
-    if (comp == nullptr) {
-        throw("No completer registered");
+static bool crossline_file_read (int fd, uint64_t off, char *buf, size_t len)
+{
+    if (_lseeki64(fd, off, SEEK_SET) < 0) {
+        return false;
     }
-    if (history == nullptr) {
-        throw("No history registered");
+    while (len > 0) {
+        int n = _read(fd, buf, (unsigned)std::min(len, (size_t)(1<<30)));
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
     }
-
-    privData = new CrosslinePrivate(log);
+    return true;
 }
 
-Crossline::~Crossline()
+static bool crossline_file_write (int fd, const char *buf, size_t len)
 {
-    if (completer != nullptr) {
-        delete completer;
+    while (len > 0) {
+        int n = _write(fd, buf, (unsigned)std::min(len, (size_t)(1<<30)));
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
     }
-    if (history != nullptr) {
-        delete history;
+    return true;
 }
-    if (privData != nullptr) {
-        delete privData;
+
+// open (or make) a journal, others may rename a file over it while it is open
+static int crossline_file_open (const std::string &path)
+{
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        return -1;
     }
+    int fd = _open_osfhandle((intptr_t)h, _O_APPEND | _O_BINARY);
+    if (fd < 0) {
+        CloseHandle(h);
+    }
+    return fd;
 }
 
-
-void Crossline::AllowESCCombo(const bool all)
+static int crossline_file_create (const std::string &path)
 {
-    privData->allowEscCombo = all;
+    return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
 }
 
-
-HistoryItemPtr HistoryClass::MakeItemPtr(const SearchItemPtr &p) const
+static void crossline_file_close (int fd)
 {
-    return std::dynamic_pointer_cast<HistoryItem>(p);
+    _close(fd);
 }
 
+static bool crossline_file_sync (int fd)
+{
+    return _commit(fd) == 0;
+}
 
-void HistoryClass::HistoryDelete(const ssize_t ind, const ssize_t n)
+// put the file at from in place of to in one step
+static bool crossline_file_replace (const std::string &from, const std::string &to)
 {
-    std::vector<SearchItemPtr>::iterator it = items.begin();
-    items.erase(it+ind, it + (ind+n));
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
 }
 
-// Completions for completion or history
-CompleterClass::CompleterClass()
+static void crossline_file_remove (const std::string &path)
 {
-    Clear();
+    _unlink(path.c_str());
 }
 
-void CompleterClass::Clear()
+// whether fd is still the file at path
+static bool crossline_file_is (int fd, const std::string &path)
 {
-    BaseSearchable::Clear();
-	start = 0;
-	end = 0;
+    BY_HANDLE_FILE_INFORMATION a, b;
+    if (!GetFileInformationByHandle((HANDLE)_get_osfhandle(fd), &a)) {
+        return true;    // can't tell, carry on with it
+    }
+    HANDLE h = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                           OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    bool got = GetFileInformationByHandle(h, &b) != 0;
+    CloseHandle(h);
+    return !got || ((a.dwVolumeSerialNumber == b.dwVolumeSerialNumber) &&
+                    (a.nFileIndexHigh == b.nFileIndexHigh) && (a.nFileIndexLow == b.nFileIndexLow));
 }
 
-void CompleterClass::Setup(const int startIn, const int endIn)
+static void crossline_file_lock (int fd, const bool exclusive)
 {
-	start = startIn;
-	end = endIn;
+    OVERLAPPED ov = {0};
+    LockFileEx((HANDLE)_get_osfhandle(fd), exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &ov);
 }
 
-void CompleterClass::Add(const std::string &word, const std::string &help)
+static void crossline_file_unlock (int fd)
 {
-    Add(word, help, false, CROSSLINE_COLOR_DEFAULT, CROSSLINE_COLOR_DEFAULT);
+    OVERLAPPED ov = {0};
+    UnlockFileEx((HANDLE)_get_osfhandle(fd), 0, MAXDWORD, MAXDWORD, &ov);
 }
 
-void CompleterClass::Add(const std::string &word, const std::string &help, const bool needQuotes,
-                    crossline_color_e wcolor, crossline_color_e hcolor)
+#else // Linux
+
+static int64_t crossline_file_size (int fd)
 {
-    items.push_back(std::make_shared<CompletionItem>(word, help, needQuotes, wcolor, hcolor));
+    struct stat st;
+    return (fstat(fd, &st) < 0) ? -1 : st.st_size;
 }
 
-bool CompleterClass::FindItems(const std::string &buf, Crossline &cLine, const int pos)
+static bool crossline_file_read (int fd, uint64_t off, char *buf, size_t len)
 {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n <= 0) {
+            if ((n < 0) && (EINTR == errno))	{ continue; }
+            return false;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
     return true;
 }
 
-
-
-
-void BaseSearchable::AddHint(const std::string &h, crossline_color_e col)
+static bool crossline_file_write (int fd, const char *buf, size_t len)
 {
-    if ((h.length() > 0)) {
-        hint = h;
-        // pCompletions.hints[CROSS_COMPLET_HINT_LEN - 1] = '\0';
-        hintColor = col;
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            if ((n < 0) && (EINTR == errno))	{ continue; }
+            return false;
+        }
+        buf += n;
+        len -= n;
     }
+    return true;
 }
 
-void BaseSearchable::Clear()
+// open (or make) a journal, others may rename a file over it while it is open
+static int crossline_file_open (const std::string &path)
 {
-    items.clear();
-    hint = "";
+    return open(path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
 }
 
-void BaseSearchable::Add(const SearchItemPtr &item)
+static int crossline_file_create (const std::string &path)
 {
-    items.push_back(item);
+    return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
 }
 
-bool BaseSearchable::HasHint() const
+static void crossline_file_close (int fd)
 {
-    return hint.length() > 0;
+    close(fd);
 }
 
-std::string BaseSearchable::GetHint() const
+static bool crossline_file_sync (int fd)
 {
-    return hint;
+    return fsync(fd) == 0;
 }
 
-crossline_color_e BaseSearchable::GetHintColor() const
+// put the file at from in place of to in one step
+static bool crossline_file_replace (const std::string &from, const std::string &to)
 {
-    return hintColor;
+    return rename(from.c_str(), to.c_str()) == 0;
 }
 
-CompletionItemPtr CompleterClass::MakeItemPtr(const SearchItemPtr &p) const
+static void crossline_file_remove (const std::string &path)
 {
-    return std::dynamic_pointer_cast<CompletionItem>(p);
+    unlink(path.c_str());
 }
 
-std::string CompleterClass::FindCommon()  const
+// whether fd is still the file at path
+static bool crossline_file_is (int fd, const std::string &path)
 {
-	// Find the common part of the completions
-    std::string common;
-    if (items.size() == 0) {
-        return common;
+    struct stat a, b;
+    if ((fstat(fd, &a) < 0) || (stat(path.c_str(), &b) < 0)) {
+        return true;    // can't tell, carry on with it
     }
-    auto item = std::dynamic_pointer_cast<CompletionItem>(items[0]);
-    common = item->GetWord();
-	int len = common.length();
-    if (items.size() == 1 && item->NeedQuotes()) {
-		common = "\"" + common + "\"";
-	}
-
-    for (int i = 1; (i < items.size()) && (len > 0); ++i) {
-        item = std::dynamic_pointer_cast<CompletionItem>(items[i]);
-        std::string word = item->GetWord().substr(0, len);
-		if (word.length() < len) {
-			len = word.length();
-		}
-		while (len > 0 && common.find(word) == common.npos) {
-			len--;
-			word.pop_back();
-		}
-		if (len > 0) {  // there should be at least 1 common character
-			common = common.substr(0, len);
-        } else {
-            common = "";
-		}
-	}
-	return common;
+    return (a.st_dev == b.st_dev) && (a.st_ino == b.st_ino);
 }
 
-
-CompletionItem::CompletionItem()
+static void crossline_file_lock (int fd, const bool exclusive)
 {
-    color = CROSSLINE_COLOR_DEFAULT;
-    helpColor = CROSSLINE_COLOR_DEFAULT;
+    while ((flock(fd, exclusive ? LOCK_EX : LOCK_SH) < 0) && (EINTR == errno))	;
 }
 
-CompletionItem::CompletionItem(const std::string w, const std::string h, const bool needQuot,
-                                const crossline_color_e wCol, const crossline_color_e hCol)
+static void crossline_file_unlock (int fd)
 {
-    word = w;
-    help = h;
-    needQuotes = needQuot;
-    color = wCol;
-    helpColor = hCol;
+    flock(fd, LOCK_UN);
 }
 
-std::string CompletionItem::GetStItem(const int no) const
+#endif // #ifdef _WIN32
+
+// where the compacted entries of the journal end and its generation, 0 if it has no header
+static uint64_t crossline_journal_packed (int fd, uint64_t *gen)
 {
-    return word;
+    std::string head(CROSS_JOURNAL_HEADER_LEN, '\0');
+    *gen = 0;
+    if (!crossline_file_read(fd, 0, &head[0], head.length()) || !crossline_journal_header(head)) {
+        return 0;
+    }
+    char *end;
+    *gen = strtoull(head.c_str() + sizeof(CROSS_JOURNAL_HEADER) - 1, &end, 10);
+    return strtoull(end, nullptr, 10);
 }
 
-const std::string &CompletionItem::GetWord() const
+// Append new entries to filename as they are added, other sessions can share the file.
+// Entries are written in groups of commitEvery, or commitMs after the first waiting one,
+// under an advisory lock. The file is compacted (repeats dropped, only the last keepEntries
+// kept if not 0) once it is bigger than compactBytes and has doubled since it was last
+// compacted. The file is loaded first
+int HistoryClass::JournalOpen (const std::string &filename, const size_t commitEvery, const int commitMs,
+                               const size_t compactBytes, const size_t keepEntries)
 {
-    return word;
+    JournalClose();
+    int fd = crossline_file_open(filename);
+    if (fd < 0) {
+        return -1;
+    }
+    journalFd = fd;
+    journalPath = filename;
+    journalMissed.clear();
+    journalRecheck.clear();
+    journalPacked = crossline_journal_packed(fd, &journalGen);
+    journalEvery = std::max(commitEvery, (size_t)1);
+    journalMs = commitMs;
+    journalCompactBytes = compactBytes;
+    journalKeep = keepEntries;
+    journalOff = 0;
+    journalOwn.clear();
+    journalPending = 0;
+    journalCompactDue = false;
+    journalStop = false;
+
+    JournalTail();
+
+    // write what is waiting once it has waited commitMs
+    journalThread = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(journalMutex);
+        while (!journalStop) {
+            if (journalPending == 0) {
+                journalCv.wait(lock);
+            } else if (journalCv.wait_until(lock, journalFirst + std::chrono::milliseconds(journalMs)) ==
+                       std::cv_status::timeout) {
+                JournalWrite();
+            }
+        }
+    });
+    return 0;
 }
 
-crossline_color_e CompletionItem::GetColor() const
+// Write what is waiting and stop journaling
+void HistoryClass::JournalClose()
 {
-    return color;
+    if (journalFd < 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        JournalWrite();
+        journalStop = true;
+    }
+    journalCv.notify_all();
+    journalThread.join();
+    crossline_file_close(journalFd);
+    journalFd = -1;
 }
 
-const std::string &CompletionItem::GetHelp() const
+// an entry was added, queue it for the journal
+void HistoryClass::JournalAppend(const std::string_view &st)
 {
-    return help;
+    bool compact;
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        journalBuf.append(st.data(), st.length());
+        journalBuf += '\n';
+        if (0 == journalPending++) {
+            journalFirst = std::chrono::steady_clock::now();
+            journalCv.notify_all();
+        }
+        if (journalPending >= journalEvery) {
+            JournalWrite();
+        }
+        compact = journalCompactDue;
+    }
+    if (compact) {
+        JournalCompact();
+    }
 }
 
-crossline_color_e CompletionItem::GetHelpColor() const
+// Write the waiting entries now
+int HistoryClass::JournalCommit()
 {
-    return helpColor;
+    if (journalFd < 0) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(journalMutex);
+    return JournalWrite() ? 0 : -1;
 }
 
-bool CompletionItem::NeedQuotes() const
+// write the waiting entries in one append, journalMutex is held
+bool HistoryClass::JournalWrite()
 {
-    return needQuotes;
+    if (journalBuf.empty()) {
+        return true;
+    }
+    JournalLock(true);
+    int64_t off = crossline_file_size(journalFd);
+    bool ok = (off >= 0) && crossline_file_write(journalFd, journalBuf.data(), journalBuf.length());
+    crossline_file_unlock(journalFd);
+    if (ok) {
+        // it's at the end of the file, don't read it back as another session's
+        journalOwn.push_back({(uint64_t)off, (uint64_t)off + journalBuf.length()});
+        // by growth, a journal with more distinct entries than compactBytes holds isn't redone each time
+        const uint64_t end = (uint64_t)off + journalBuf.length();
+        if ((end > journalCompactBytes) && (end > 2*journalPacked)) {
+            journalCompactDue = true;
+        }
+    }
+    journalBuf.clear();
+    journalPending = 0;
+    return ok;
 }
 
-
-
-HistoryItem::HistoryItem(const std::string &st)
+// Lock the journal file.  If a compaction in another session has renamed a new file over
+// it, what is left of the old one (which nothing writes to any more) goes in journalMissed and
+// the new one is used from the end of the entries it was made with.  If more than one
+// compaction went by we can't tell which of its entries we have, they all go in journalRecheck
+// for JournalAdd to skip the ones we have.  journalMutex is held
+void HistoryClass::JournalLock(const bool exclusive)
 {
-    item = st;
+    crossline_file_lock(journalFd, exclusive);
+    while (!crossline_file_is(journalFd, journalPath)) {
+        int fd = crossline_file_open(journalPath);
+        if (fd < 0) {
+            return;     // keep to the old one
+        }
+        uint64_t gen;
+        uint64_t packed = crossline_journal_packed(fd, &gen);
+        int64_t size = crossline_file_size(journalFd);
+        if ((gen == journalGen+1) && (size >= 0) && ((uint64_t)size > journalOff)) {
+            JournalRead(size, journalMissed);
+        }
+        crossline_file_unlock(journalFd);
+        crossline_file_close(journalFd);
+        journalFd = fd;
+        journalOwn.clear();
+        crossline_file_lock(journalFd, exclusive);
+        journalOff = 0;
+        if (gen != journalGen+1) {
+            journalRecheck.insert(journalRecheck.end(), journalMissed.begin(), journalMissed.end());
+            journalMissed.clear();
+            if (packed > 0) {
+                JournalRead(packed, journalRecheck);
+            }
+        }
+        journalGen = gen;
+        journalOff = journalPacked = packed;
+    }
 }
 
-std::string HistoryItem::GetStItem(const int no) const
+// read the lines in the file from journalOff up to end that weren't written by us,
+// journalMutex and the file lock are held
+void HistoryClass::JournalRead(const uint64_t end, std::vector<std::string> &lines)
 {
-    return item;
+    std::string data(end - journalOff, '\0');
+    if (!crossline_file_read(journalFd, journalOff, &data[0], data.length())) {
+        return;
+    }
+    // only whole lines, a line being written without the lock is read next time
+    size_t used = data.rfind('\n');
+    used = (used == data.npos) ? 0 : used+1;
+
+    size_t pos = ((0 == journalOff) && crossline_journal_header(data)) ? CROSS_JOURNAL_HEADER_LEN : 0;
+    while (pos < used) {
+        uint64_t at = journalOff + pos;
+        bool own = false;
+        for (const std::pair<uint64_t, uint64_t> &range : journalOwn) {
+            if ((at >= range.first) && (at < range.second)) {
+                pos = range.second - journalOff;
+                own = true;
+                break;
+            }
+        }
+        if (own) {
+            continue;
+        }
+        size_t nl = data.find('\n', pos);
+        lines.push_back(data.substr(pos, nl - pos));
+        pos = nl+1;
+    }
+    journalOff += used;
+    while (!journalOwn.empty() && (journalOwn.front().second <= journalOff)) {
+        journalOwn.erase(journalOwn.begin());
+    }
 }
 
-
-HistoryClass::HistoryClass()
+// Add the entries other sessions have appended since last time, returns how many were added
+int HistoryClass::JournalTail()
 {
+    if (journalFd < 0) {
+        return 0;
+    }
+    std::vector<std::string> lines, recheck;
+    bool compact;
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        JournalLock(false);
+        recheck.swap(journalRecheck);
+        lines.swap(journalMissed);
+        int64_t size = crossline_file_size(journalFd);
+        if ((size >= 0) && ((uint64_t)size < journalOff)) {
+            // cut short by something else, carry on from its end
+            journalOff = size;
+            journalOwn.clear();
+        } else if ((size >= 0) && ((uint64_t)size > journalOff)) {
+            JournalRead(size, lines);
+        }
+        crossline_file_unlock(journalFd);
+        compact = journalCompactDue;
+    }
+    int added = JournalAdd(recheck, true);
+    added += JournalAdd(lines, false);
+    if (compact) {
+        JournalCompact();
+    }
+    return added;
+}
 
+// add entries read from the journal without writing them back to it, if rechecked
+// not the ones we have already.  Returns how many were added
+int HistoryClass::JournalAdd(const std::vector<std::string> &lines, const bool rechecked)
+{
+    int added = 0;
+    journalTailing = true;
+    for (const std::string &line : lines) {
+        if (!rechecked || (FindRepeat(line) < 0)) {
+            Add(line);
+            added++;
+        }
+    }
+    journalTailing = false;
+    return added;
 }
 
-bool HistoryClass::FindItems(const std::string &buf, Crossline &cLine, const int pos)
+// Rewrite the journal without repeats (the last one is kept) and with at most journalKeep entries.
+// The new file is written beside it and renamed over it, so the journal is never left part
+// written; other sessions move to it the next time they lock the journal
+int HistoryClass::JournalCompact()
 {
-    return false;
+    if (journalFd < 0) {
+        return -1;
+    }
+    std::vector<std::string> lines, recheck;
+    bool ok = false;
+    {
+        std::lock_guard<std::mutex> lock(journalMutex);
+        JournalWrite();
+        journalCompactDue = false;
+        JournalLock(true);
+        recheck.swap(journalRecheck);
+        lines.swap(journalMissed);
+        int64_t size = crossline_file_size(journalFd);
+        if (size >= 0) {
+            // first pick up what the other sessions have added
+            if ((uint64_t)size > journalOff) {
+                JournalRead(size, lines);
+            }
+            std::string data(size, '\0');
+            if (crossline_file_read(journalFd, 0, &data[0], size)) {
+                std::vector<std::string_view> entries;
+                for (size_t pos = crossline_journal_header(data) ? CROSS_JOURNAL_HEADER_LEN : 0; pos < data.length(); ) {
+                    size_t nl = data.find('\n', pos);
+                    if (nl == data.npos) {
+                        nl = data.length();
+                    }
+                    entries.push_back(std::string_view(data.data() + pos, nl - pos));
+                    pos = nl+1;
+                }
+                std::set<std::string_view> seen;
+                std::vector<std::string_view> kept;
+                for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+                    if ((journalKeep > 0) && (kept.size() >= journalKeep)) {
+                        break;
+                    }
+                    if (seen.insert(*it).second) {
+                        kept.push_back(*it);
+                    }
+                }
+                std::string packed;
+                for (auto it = kept.rbegin(); it != kept.rend(); ++it) {
+                    packed.append(it->data(), it->length());
+                    packed += '\n';
+                }
+                char head[CROSS_JOURNAL_HEADER_LEN + 1];
+                snprintf(head, sizeof(head), CROSS_JOURNAL_HEADER "%020llu %020llu\n", (unsigned long long)journalGen+1,
+                         (unsigned long long)(CROSS_JOURNAL_HEADER_LEN + packed.length()));
+                const std::string temp = journalPath + ".compact";
+                int fd = crossline_file_create(temp);
+                ok = (fd >= 0) && crossline_file_write(fd, head, CROSS_JOURNAL_HEADER_LEN) &&
+                     crossline_file_write(fd, packed.data(), packed.length()) && crossline_file_sync(fd);
+                if (fd >= 0) {
+                    crossline_file_close(fd);
+                }
+                // this session moves to the new file in its next JournalLock, like the others
+                ok = ok && crossline_file_replace(temp, journalPath);
+                if (!ok) {
+                    crossline_file_remove(temp);
+                }
+            }
+        }
+        crossline_file_unlock(journalFd);
+    }
+    JournalAdd(recheck, true);
+    JournalAdd(lines, false);
+    return ok ? 0 : -1;
 }
@@ -46,6 +46,16 @@
 #include <utility>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <deque>
+#include <cstdint>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
 
 typedef enum {
 	CROSSLINE_FGCOLOR_DEFAULT       = 0x00,
@@ -80,6 +90,37 @@ typedef enum {
 typedef int crossline_color_e;
 
 class Crossline;
+struct CrosslineStatsData;
+
+// Counters and timings collected while Crossline::StatsEnable is on.  Times are in
+// microseconds; histogram bucket 0 counts 0 and bucket i values below 2^i, the last the rest
+struct CrosslineStats {
+	static const int Buckets = 24;
+	struct Histogram {
+		uint64_t count = 0;
+		uint64_t total = 0;
+		uint64_t max = 0;
+		uint64_t buckets[Buckets] = {};
+		double Mean() const;
+		// upper bound of the bucket holding the p (0-1) quantile
+		uint64_t Percentile(const double p) const;
+	};
+	Histogram keyLatency;       // key read to the frame it produced written
+	Histogram frameBytes;       // bytes in each frame
+	uint64_t frames = 0;
+	uint64_t writes = 0;        // frames written to the terminal, one Write each
+	uint64_t bytes = 0;
+	uint64_t refreshMove = 0;   // Refresh calls by the kind of update done
+	uint64_t refreshChanged = 0;
+	uint64_t refreshFromPos = 0;
+	uint64_t refreshAll = 0;
+	Histogram findItems;        // completer->FindItems
+	Histogram historyDump;
+	Histogram historyLoad;      // HistoryLoad and HistoryMap
+	Histogram historySave;
+
+	std::string ToString() const;
+};
 
 // Base class for history and completion
 // They share similar characteristics
@@ -115,7 +156,7 @@ public:
 
 	virtual void Clear();
 
-	int Size() const {
+	virtual int Size() const {
 		return items.size();
 	}
 
@@ -160,11 +201,59 @@ public:
 typedef std::shared_ptr<CompletionItem> CompletionItemPtr;
 
 class CompleterClass : public BaseSearchable {
+protected:
+	// set for each FindItems run by the completion worker (Crossline::CompletionAsync)
+	std::atomic<bool> cancelled;
+	bool hasDeadline;
+	std::chrono::steady_clock::time_point deadline;
+	Crossline *jobLine;    // for the default FindItemsAsync
+
+	// Completion cache: the result of the last FindItems and the buffer it was for.
+	// A Tab that only extends the prefix being completed narrows items instead
+	bool useCache;
+	bool cacheValid;
+	std::string cacheHead;      // buf before start
+	std::string cachePrefix;    // buf from start to end
+	std::string cacheTail;      // buf after end
+
+	// widest word and whether any item has help, for laying out the completion menu,
+	// worked out once for each set of items
+	mutable bool layoutValid;
+	mutable size_t layoutCount;
+	mutable int layoutWord;
+	mutable bool layoutHelp;
+
 public:
 	int start;
 	int end;
 	CompleterClass();
+
+	// With async completion (Crossline::CompletionAsync) FindItemsAsync runs on a worker thread.
+	// It should return early when Cancelled() (the input has changed, the result isn't wanted)
+	// and return what it has found so far once PastDeadline()
+	bool Cancelled() const;
+	bool PastDeadline() const;
+	// Called by Crossline around each FindItems on the worker, line is for FindItemsAsync
+	void JobBegin(const int budgetMs, Crossline *line=nullptr);
+	void JobCancel();
+
 	virtual bool FindItems(const std::string &buf, Crossline &cLine, const int pos);
+	// What the worker calls with async completion, buf is its own copy of the line.  Override it
+	// for a completer used async: the default calls FindItems, which then must not use cLine at
+	// all as printing, history and key state belong to the edit thread
+	virtual bool FindItemsAsync(const std::string &buf, const int pos);
+
+	// Opt in to the completion cache.  FindItems must call Setup and its items must
+	// only depend on the text before start and the prefix from start to end
+	void CacheEnable(const bool enable);
+	bool CacheEnabled() const;
+	// Does item still complete prefix (the cached prefix plus what has been typed since).
+	// Ignores case as CompletionDict does, override it for a case-sensitive FindItems
+	virtual bool PrefixMatch(const CompletionItem &item, const std::string &prefix) const;
+	// Narrow the cached items if buf only extends the cached prefix, false if FindItems is needed
+	bool CacheNarrow(const std::string &buf, const int pos);
+	// Remember the items FindItems found for buf
+	void CacheStore(const std::string &buf, const int pos);
 
 	void Add(const std::string &word, const std::string &help, const bool needQuotes,
 		 	 crossline_color_e wcolor=CROSSLINE_COLOR_DEFAULT, crossline_color_e hcolor=CROSSLINE_COLOR_DEFAULT);
@@ -172,10 +261,55 @@ public:
 	void Clear();
 	void Setup(const int startIn, const int endIn);
 	std::string FindCommon() const;
+	void Layout(int &wordLen, bool &withHelp) const;
 
 	CompletionItemPtr MakeItemPtr(const SearchItemPtr &p) const;
 };
 
+// Colours the line being edited, a token at a time.  Crossline keeps the tokens and the state
+// after each one, and after an edit only lexes again from the token before the change until a
+// token ends where an old one did in the same state, so only the colours that change are redrawn
+class HighlighterClass {
+public:
+	virtual ~HighlighterClass() {}
+
+	// The token text starts with, in state (0 at the start of the line).  Set color and the state
+	// after it and return its length, 1 to text.length().  text is the rest of the line or at
+	// least 256 characters of it, a longer token can be returned in pieces with state saying how
+	// to go on.  The colour may depend on the character after the token but not on any later one
+	virtual size_t Token(const std::string_view &text, int &state, crossline_color_e &color) = 0;
+};
+
+// A fixed word list for completers (keywords, table and column names).  The words are
+// sorted ignoring case once, so a lookup is a binary search on the prefix and a copy
+// of the matching range rather than a compare against every word
+class CompletionDict {
+protected:
+	struct Entry {
+		std::string key;    // lower case word
+		size_t order;       // when it was added
+		CompletionItemPtr item;
+	};
+	std::vector<Entry> entries;
+	bool sorted;
+
+public:
+	CompletionDict();
+
+	void Add(const std::string &word, const std::string &help=std::string(), const bool needQuotes=false,
+			 crossline_color_e wcolor=CROSSLINE_COLOR_DEFAULT, crossline_color_e hcolor=CROSSLINE_COLOR_DEFAULT);
+	void Clear();
+	size_t Size() const;
+	// Sort the words, the first lookup after an Add does this if it hasn't been called
+	void Sort();
+	// [first, last) of the words starting with prefix, ignoring case
+	std::pair<size_t, size_t> Range(const std::string &prefix);
+	const CompletionItemPtr &Get(const size_t i) const;
+	// Add the words starting with prefix to comp, sorted or with addedOrder in the order
+	// they were added.  Returns the number added
+	size_t Complete(CompleterClass &comp, const std::string &prefix, const bool addedOrder=false);
+};
+
 
 typedef std::vector<std::string> StrVec;
 
@@ -189,23 +323,183 @@ public:
 
 typedef std::shared_ptr<HistoryItem> HistoryItemPtr;
 
+// What HistoryClass::Add does with an entry that is already in history
+enum class HistoryDupes {
+	KEEP,           // add it again
+	IGNORE,         // don't add it
+	ERASE_OLDER     // add it and delete the older one
+};
+
 class HistoryClass : public BaseSearchable {
+protected:
+	// Trigram index for substring search: lower case trigram -> sequence numbers of the
+	// entries containing it, ascending.  itemSeq gives the sequence number of each entry
+	// so deleted entries can be left in the posting lists until the next rebuild
+	bool useIndex;
+	std::unordered_map<uint32_t, std::vector<uint32_t>> trigrams;
+	std::deque<uint32_t> itemSeq;
+	uint32_t nextSeq;
+	size_t staleSeqs;   // sequence numbers of deleted entries still in the posting lists
+
+	// Fingerprints: text hash -> the newest entry with that text and how many there are,
+	// for duplicate handling and the noSearchRepeats filter
+	struct RepeatInfo {
+		uint32_t seq = 0;
+		uint32_t count = 0;
+	};
+	std::unordered_map<size_t, RepeatInfo> repeats;
+	HistoryDupes dupes;
+	size_t capacity;    // most entries kept, 0 for no limit
+
+	// Prefix index for Suggest, made by its first call: the hash of the first 1, 2, 4 .. 32
+	// bytes of an entry -> sequence numbers of the entries starting with them, ascending
+	bool usePrefixes;
+	std::unordered_map<uint64_t, std::vector<uint32_t>> prefixes;
+
+	void IndexAdd(const std::string_view &st);
+	void PrefixAdd(const std::string_view &st);
+	void IndexRebuild();   // sequence numbers, fingerprints and the indexes
+	void SeqAdd(const size_t ind);
+	ssize_t SeqIndex(const uint32_t seq) const;
+	void Trim();
+
+	// Arena storage: the text of every entry is kept in one string and arenaEntries says where,
+	// items is not used.  Entries are only made (MakeHistoryItem) when GetHistoryItem is called
+	struct ArenaEntry {
+		static constexpr uint32_t MAPPED = 0x80000000;   // set in len when off is in the mapped file
+		size_t off;
+		uint32_t len;
+	};
+	bool useArena;
+	std::string arena;
+	std::deque<ArenaEntry> arenaEntries;   // a deque so the oldest can go in O(1)
+	size_t arenaDead;   // bytes of deleted entries still in arena
+
+	void ArenaAppend(const std::string_view &st);
+	void ArenaCompact();
+	void Added(const SearchItemPtr &item, const ssize_t older);
+
+	// Mapped loading (HistoryMap): entries point into the mapped file.  loader finds the lines
+	// before the tail, which were loaded straight away, and indexes them; HistorySync merges them
+	const char *mapBase;
+	size_t mapLen;
+	std::thread loader;
+	std::atomic<bool> loadDone;
+	std::vector<ArenaEntry> loadEntries;
+	std::unordered_map<uint32_t, std::vector<uint32_t>> loadTrigrams;
+	std::unordered_map<size_t, RepeatInfo> loadRepeats;
+	std::unordered_map<uint64_t, std::vector<uint32_t>> loadPrefixes;
+	bool loadPrefixesBuilt;   // loader is making loadPrefixes
+	size_t loadFirst;   // where the file's entries start
+	size_t loadTail;    // the number loaded straight away
+	bool loadPending;   // from the tail going in until HistorySync, entries aren't deleted
+	void HistoryUnmap();
+	void MapRelease();
+
+	// Journal (JournalOpen): added entries are appended to the file in groups by JournalWrite,
+	// on a timer by journalThread or when journalEvery are waiting.  journalMutex guards the
+	// journal state and the file.  A compaction renames a new file over journalPath
+	int journalFd;
+	std::string journalPath;
+	std::vector<std::string> journalMissed;   // read from a replaced file, waiting for JournalTail
+	std::vector<std::string> journalRecheck;  // read after missing compactions, some may be had
+	uint64_t journalGen;           // the compactions the file has been through
+	std::string journalBuf;        // entries waiting to be written
+	size_t journalPending;
+	size_t journalEvery;
+	int journalMs;
+	std::chrono::steady_clock::time_point journalFirst;   // when the first waiting entry came
+	size_t journalCompactBytes;
+	uint64_t journalPacked;        // the file's size when it was compacted, 0 if it hasn't been
+	size_t journalKeep;
+	bool journalCompactDue;
+	uint64_t journalOff;           // the file has been read up to here
+	std::vector<std::pair<uint64_t, uint64_t>> journalOwn;   // our writes past journalOff
+	std::mutex journalMutex;
+	std::condition_variable journalCv;
+	std::thread journalThread;
+	bool journalStop;
+	bool journalTailing;           // adding entries read from a file, not to be journaled
+	void JournalAppend(const std::string_view &st);
+	void JournalLock(const bool exclusive);
+	bool JournalWrite();
+	void JournalRead(const uint64_t end, std::vector<std::string> &lines);
+	int JournalAdd(const std::vector<std::string> &lines, const bool rechecked);
+
+	// For subclasses keeping data for each entry alongside it, in either storage mode.
+	// Entry ind was inserted at ind, the end except when HistorySync puts in a mapped file.
+	// item is NULL when only text was added (Add(string) with arena storage, HistoryMap)
+	virtual void EntryAdded(const SearchItemPtr &/*item*/, const size_t /*ind*/) {}
+	virtual void EntriesDeleted(const size_t /*ind*/, const size_t /*n*/) {}
+	// make the item for entry ind with arena storage
+	virtual HistoryItemPtr MakeHistoryItem(const size_t ind) const;
+
 public:
 	HistoryClass();
+	~HistoryClass();
 	bool FindItems(const std::string &buf, Crossline &cLine, const int pos);
 
+	// set by the Crossline using this history, for the HistoryLoad/HistorySave timings
+	CrosslineStatsData *stats;
+
+	// Keep a trigram index so substring searches only check entries that can match
+	void IndexEnable(const bool enable);
+	bool IndexEnabled() const;
+
+	// Indices (ascending) of the entries that may contain needle, ignoring case.
+	// Returns false if the index can't help (disabled or needle shorter than 3), scan everything then
+	bool IndexCandidates(const std::string &needle, std::vector<int> &cand);
+
+	// Keep the entries in one contiguous arena rather than an item each.  Get()/items
+	// are then empty, use GetHistoryView or GetHistoryItem
+	void ArenaEnable(const bool enable);
+	bool ArenaEnabled() const;
+
+	// While a mapped load is pending (HistorySync) these only cover the entries loaded so far:
+	// those before it, the tail of the file and any added since
+	int Size() const;
+	// The text of entry n without making an item, valid until history is next changed
+	std::string_view GetHistoryView(const ssize_t n) const;
+
+	// What Add does with an entry that is already in history
+	void HistorySetDupes(const HistoryDupes mode);
+	// Keep at most maxEntries (0 for no limit), the oldest go first.  Uses arena storage
+	void HistorySetCapacity(const size_t maxEntries);
+	// The newest entry the same as st, -1 if there isn't one
+	ssize_t FindRepeat(const std::string_view &st);
+	// Whether a newer entry has the same text as entry ind
+	bool IsRepeat(const ssize_t ind);
+	// The newest entry that starts with prefix and is longer than it, -1 if there is none.
+	// The first call makes a prefix index, kept up to date from then on
+	ssize_t Suggest(const std::string_view &prefix);
+
 	// Load history from file, stored as a list of commands
 	virtual int HistoryLoad (const std::string &filename);
 
-	// Save history to file
-	virtual int HistorySave(const std::string &filename) const;
+	// Load history from file by mapping it, the last tailLines lines can be used straight away
+	// and the rest are found in the background.  Uses arena storage
+	virtual int HistoryMap (const std::string &filename, const size_t tailLines=1000);
+	// Wait for (or with wait false, check for) a mapped load to finish and use all of it
+	bool HistorySync(const bool wait);
+
+	// Save history to file, a mapped load is finished first (HistorySync)
+	virtual int HistorySave(const std::string &filename);
+
+	// Load filename and append each new entry to it, several sessions can share the file
+	int JournalOpen(const std::string &filename, const size_t commitEvery=16, const int commitMs=1000,
+	                const size_t compactBytes=16<<20, const size_t keepEntries=0);
+	void JournalClose();
+	int JournalCommit();    // write waiting entries now
+	int JournalTail();      // add what other sessions have appended
+	int JournalCompact();
 
     virtual HistoryItemPtr GetHistoryItem(const ssize_t n) const;
     virtual void HistoryDelete(const ssize_t ind, const ssize_t n);
 
-    // needed to make BaseSearchable visible: https://stackoverflow.com/questions/8816794/overloading-a-virtual-function-in-a-child-class
-    using BaseSearchable::Add;
+    // both overloads are overridden so they stay visible: https://stackoverflow.com/questions/8816794/overloading-a-virtual-function-in-a-child-class
+    void Add(const SearchItemPtr &item);
     virtual void Add(const std::string &st);
+    void Clear();
 
 	HistoryItemPtr MakeItemPtr(const SearchItemPtr &p) const;
 };
@@ -230,6 +524,96 @@ class HistorySearchType {
 
 
 class CrosslinePrivate;
+struct EditState;
+class EditBuffer;
+
+// The terminal a Crossline reads keys from and draws on.  The default is a CrosslineConsole on
+// the process's console; implement this to serve sessions over sockets, ptys or an event loop.
+// A Crossline keeps all its state in its own objects, so sessions on different terminals can
+// run on different threads without locking between them.  On Windows the keys read are
+// expected in the console's _getch form, elsewhere as the bytes a terminal sends
+class CrosslineTerminal {
+public:
+	virtual ~CrosslineTerminal() {}
+
+	// Read up to len bytes, waiting at most timeoutMs (-1 for no limit).  Returns the number
+	// read, 0 on a timeout or when a Wake or resize ended the wait, -1 when the input has ended
+	virtual int Read(char *buf, const size_t len, const int timeoutMs) = 0;
+	// Write len bytes, which may be buffered until Flush.  false if the output has gone
+	virtual bool Write(const char *st, const size_t len) = 0;
+	virtual void Flush() {}
+	// Rows and columns, false if not known
+	virtual bool Size(int &rows, int &cols) = 0;
+	// Goes up with each change of size
+	virtual unsigned int ResizeCount() const { return resizes; }
+	// End a wait in Read from any thread
+	virtual void Wake() = 0;
+	// Raw input (no echo or line buffering) for the length of an edit.  paste asks for
+	// bracketed paste too, the default sends the xterm sequences for it when Ansi()
+	virtual void SetRaw(const bool raw, const bool paste);
+	// Ctrl-Z, only the console stops the process
+	virtual void Suspend() {}
+
+	// Capabilities
+	// Keys come from a user and lines are edited, otherwise lines are taken as they come
+	virtual bool Interactive() const { return true; }
+	// The output is shown to a user, so colour and paging are used
+	virtual bool OutputTty() const { return true; }
+	// The cursor, colours and clearing are done with ANSI/VT100 sequences (not the Windows console API)
+	virtual bool Ansi() const { return true; }
+#ifdef _WIN32
+	// For programs with their own event loop, signalled when Read has input or Wake was called
+	virtual void *InputHandle() const { return nullptr; }
+	virtual void *EventHandle() const { return nullptr; }
+#else
+	// For programs with their own event loop, readable when Read has input or Wake was called.
+	// A regular file InputFd is mapped for non-interactive reading.  -1 if there is none
+	virtual int InputFd() const { return -1; }
+	virtual int EventFd() const { return -1; }
+#endif
+
+protected:
+	std::atomic<unsigned int> resizes{0};
+	bool pasteOn = false;
+	// for a terminal that hears of resizes itself (e.g. telnet NAWS): count one and wake the reader
+	void Resized() { resizes++; Wake(); }
+};
+
+// The process's console.  On Linux/Unix any pair of descriptors can be used, such as a pty
+// or a socket; resizes are only seen for the controlling terminal (SIGWINCH), and only that
+// one is put back if the process is killed while in raw mode
+class CrosslineConsole : public CrosslineTerminal {
+public:
+#ifdef _WIN32
+	CrosslineConsole();
+#else
+	CrosslineConsole(const int inFd=0, const int outFd=1);
+#endif
+	~CrosslineConsole();
+
+	int Read(char *buf, const size_t len, const int timeoutMs);
+	bool Write(const char *st, const size_t len);
+	void Flush();
+	bool Size(int &rows, int &cols);
+	unsigned int ResizeCount() const;
+	void Wake();
+	void SetRaw(const bool raw, const bool paste);
+	void Suspend();
+	bool Interactive() const;
+	bool OutputTty() const;
+	bool Ansi() const;
+#ifdef _WIN32
+	void *InputHandle() const;
+	void *EventHandle() const;
+#else
+	int InputFd() const;
+	int EventFd() const;
+#endif
+
+protected:
+	struct Data;
+	Data *data;
+};
 
 // Class for reading and writing to the console
 class Crossline {
@@ -239,14 +623,16 @@ protected:
 	// elements for history and completions
 	HistoryClass *history;
 	CompleterClass *completer;
+	HighlighterClass *highlighter;
 
-	// Provide a hint if
+	// how long (ms) typing has to pause before an autosuggestion is looked up
 	int hintDelay;
 
 	enum class UpdateType {
 	    MOVE_CURSOR,
 	    DRAW_ALL,
-	    DRAW_FROM_POS
+	    DRAW_FROM_POS,
+	    DRAW_CHANGED      // only redraw the cells that differ from the last refresh
 	};
 
 	HistorySearchType *historySearchState;
@@ -263,6 +649,8 @@ protected:
 					 std::map<std::string, int> &matches, const int maxNo,
  					 const bool forward);
 
+	// Incremental search of history, returns true if buf was set to a match
+	bool IncrementalSearch(const std::string &prompt, std::string &buf, int &pos, int &num, bool reverse);
 	virtual bool DoHistorySearch(const std::string &prompt, std::string &buf, int &pos, int &num,
 	                            int &history_id);
 
@@ -270,41 +658,163 @@ protected:
 	                          int &num, const bool isTab);
 
 	// Show the current completions and identify each one with a character - return in matches
-	int ShowCompletions(std::map<std::string, int> &matches);
+	// Paged menu of the completions, returns the index chosen, -1 if none or -2 if there
+	// was nothing to show
+	int ShowCompletions();
 
 	// update the line starting at the beginning of the line
 	void RefreshFull(const std::string &prompt, std::string &buf, int &pCurPos, int &pCurNum, int new_pos, int new_num);
+	void RefreshFull(const std::string &prompt, EditBuffer &buf, int &pCurPos, int &pCurNum, int new_pos, int new_num);
 
 	// update the line starting from current position
 	void Refresh(const std::string &prompt, std::string &buf, int &pCurPos, int &pCurNum,
 				 const int new_pos, const int new_num, const UpdateType updateType,
  				 const int drawPos);
+	// the line being edited, drawn from the gap buffer without making a std::string of it
+	void Refresh(const std::string &prompt, EditBuffer &buf, int &pCurPos, int &pCurNum,
+				 const int new_pos, const int new_num, const UpdateType updateType,
+ 				 const int drawPos);
+	// Refresh of a line taller than the screen, only the rows around the cursor are drawn
+	void RefreshViewport(const std::string &prompt, EditBuffer &buf, const int curCell, const int new_pos,
+	                     const UpdateType updateType, const int first, const int oldEnd, const int vis,
+	                     const int cols);
+
+	// move the cursor between cells of the edit line (prompt + text)
+	void CursorMoveCell(const int fromCell, const int toCell, const int cols);
 
 	void CopyFromHistory(const std::string &prompt, std::string &buf, int &pos, int &num, int history_id);
 
 	void TextCopy (std::string &dest, const std::string &src, int cut_beg, int cut_end);
 
-	bool UpdownMove (const std::string &prompt, int &pCurPos, const int pCurNum, const int off,
+	bool UpdownMove (const std::string &prompt, EditBuffer &buf, int &pCurPos, int &pCurNum, const int off,
 				      const bool bForce);
+	bool PageMove (const std::string &prompt, EditBuffer &buf, int &pos, int &num, const int dir);
+
+	// The autosuggestion for st's line, looked up if it has changed and lookup, and drawn
+	void SuggestDraw(EditState &st, const bool lookup);
+	// draw ghost after the text in place of the suggestion shown, the cursor is at pos
+	void SuggestShow(const std::string_view &ghost, const int pos);
 
 	void ClearLine();
 
 	virtual void AfterProcess(const char ch);
 
+	// async completion: queue FindItems for the worker, drop the outstanding one, and
+	// show the results when the worker has finished (KEY_WAKE)
+	void CompletionStart(const std::string &buf, const int pos, const bool isTab);
+	void CompletionCancel();
+	void CompletionReady(const std::string &prompt, std::string &buf, int &pos, int &num);
+	// the part of DoCompletion after FindItems
+	bool CompletionShow(const std::string &prompt, std::string &buf, int &pos, int &num, const bool isTab);
+
+	// ReadlineEdit in steps, so an edit can also be driven by FeedInput
+	void EditBegin(EditState &st, std::string &buf, const std::string &prompt, const bool has_input,
+				   const bool edit_only, const StrVec &choices, const bool clear);
+	void EditKey(EditState &st, int ch, const bool is_esc);
+	bool EditEnd(EditState &st);
+
 public:
 	CrosslinePrivate *privData;
 
-	Crossline(CompleterClass *comp, HistoryClass *history, const bool log=false);
+	// Messages at or above the level set are logged to Messages.log
+	enum class LogLevel {
+	    NONE,
+	    ERR,
+	    WARN,
+	    INFO,
+	    TRACE     // every Refresh
+	};
+
+	// log starts logging everything (LogLevel::TRACE).  terminal is where the session is
+	// shown, the process console if nullptr; it is not deleted and must outlive the Crossline
+	Crossline(CompleterClass *comp, HistoryClass *history, const bool log=false,
+	          CrosslineTerminal *terminal=nullptr);
 	~Crossline();
 
 	// Main API to read a line, return input in buf if get line, return false if EOF. If buf has content use that to start
 	bool ReadLine (const std::string &prompt, std::string &buf, const bool useBuf=false);
+	// When stdin isn't a terminal (or TERM is dumb) lines are read from a large buffer, or the
+	// mapped file if stdin is a regular file, with no length limit and the newline removed.
+	// ReadLines returns up to max of them at once as views that stay valid until the next
+	// ReadLine or ReadLines, 0 at the end of input.  Interactive input gives one line per call
+	size_t ReadLines (const std::string &prompt, std::vector<std::string_view> &lines, const size_t max=1024);
+
+	// Event driven reading for programs with their own event loop.  ReadLineStart draws the
+	// prompt and enters raw mode; FeedInput is then called whenever InputFd (or EventFd, for
+	// resizes and async completion) is readable.  It handles the keys that are waiting and
+	// returns 1 with the line when Enter is pressed, -1 at EOF or abort and 0 otherwise.  The
+	// edit ends with a line or ReadLineStop; the modal commands (F1-F4, the completion menu,
+	// incremental search) still read the terminal until they are done
+	bool ReadLineStart (const std::string &prompt, const std::string &initial=std::string());
+	int FeedInput (std::string &line);
+	void ReadLineStop ();
+	bool ReadLineActive () const;
+#ifdef _WIN32
+	void *InputHandle () const;
+	void *EventHandle () const;
+#else
+	int InputFd () const;
+	int EventFd () const;
+#endif
 
     // void Printf(const std::string &fmt, const std::string st="");
     void PrintStr(const std::string msg);
 
     // ESC clears
     void AllowESCCombo(const bool);
+    // How long (ms) to wait for the rest of an escape sequence before Esc is taken on its own
+    void SetEscTimeout(const int ms);
+
+    // Change what is logged, the log is written by a background thread so logging doesn't
+    // slow editing down
+    void LogSetLevel(const LogLevel level);
+    LogLevel LogGetLevel() const;
+    void Log(const LogLevel level, const char *fmt, ...);
+
+    // Collect latency and output statistics (CrosslineStats).  Off they cost a flag test;
+    // if dumpSec > 0 they are written to the log (LogLevel::INFO) that often while editing
+    void StatsEnable(const bool enable, const int dumpSec=0);
+    CrosslineStats GetStats() const;
+    void ResetStats();
+
+	// Run the completer's FindItemsAsync on a worker thread so keys are handled while it works.
+	// The results are shown when they come if the input hasn't changed, budgetMs (if > 0)
+	// is passed on as a deadline (CompleterClass::PastDeadline)
+	void CompletionAsync(const bool async, const int budgetMs=0);
+
+	// Colour the line as it is edited, nullptr for none.  Crossline deletes it like the completer
+	void HighlighterSet(HighlighterClass *hl);
+
+	/*
+	 * Key binding APIs
+	 */
+
+	// What a key does while a line is edited, the defaults are the shortcuts in the F1 help
+	enum class KeyAction : uint16_t {
+		NONE,				// a printable key inserts itself
+		DO_NOTHING,
+		HELP, DEBUG_KEYS, CLEAR_SCREEN, REDRAW, COMPLETION_RESULTS,
+		MOVE_LEFT, MOVE_RIGHT, MOVE_WORD_LEFT, MOVE_WORD_RIGHT, MOVE_HOME, MOVE_END,
+		MOVE_ROW_UP, MOVE_ROW_DOWN, PAGE_UP, PAGE_DOWN,
+		DELETE_BACK, DELETE_CHAR, DELETE_CHAR_OR_EOF, UPCASE_WORD, DOWNCASE_WORD, CAPITALIZE_WORD,
+		DELETE_SPACE, TRANSPOSE,
+		CUT_TO_END, CUT_TO_START, CUT_LINE, REVERT_LINE, CUT_TO_SPACE, CUT_WORD_LEFT, CUT_WORD_RIGHT,
+		PASTE, PASTE_BEGIN,
+		COMPLETE, LIST_COMPLETIONS,
+		HISTORY_PREV, HISTORY_NEXT, HISTORY_FIRST, HISTORY_LAST, SEARCH_BACKWARD, SEARCH_FORWARD,
+		SEARCH_HISTORY, SHOW_HISTORY, CLEAR_HISTORY,
+		ACCEPT, INTERRUPT, ABORT, SUSPEND,
+		COUNT
+	};
+	// A custom action, it may change the line and pos (the cursor, a byte offset into it)
+	using KeyFunction = std::function<void (Crossline &cLine, std::string &line, int &pos)>;
+
+	// Bind a key to an action or a function.  Keys are named as in the F1 help: "Ctrl-A",
+	// "Alt-F" (either case, also Esc then F), "Ctrl-Left", "Alt-Del", "Home", "PgUp", "Tab",
+	// "Backspace", "F2" or a single character.  false if the name isn't known or too many
+	// keys have been bound
+	bool KeyBind(const std::string &key, const KeyAction action);
+	bool KeyBind(const std::string &key, KeyFunction fn);
 
 	/*
 	 * History APIs
@@ -320,6 +830,14 @@ public:
 
 	// set the maximum number of history items to show
 	void HistorySetSearchMaxCount(const ssize_t n);
+	// Scan a large history with up to threads threads in a history search (F4), 0 for one
+	// per core.  The default 1 scans on the calling thread
+	void HistorySetSearchThreads(const int threads);
+
+	// Autosuggestions: the newest history entry starting with the line is shown dimmed after
+	// it while the cursor is at the end, Right or End takes it.  It is looked up once no key
+	// has come for delayMs (FeedInput looks it up when the waiting keys have been handled)
+	void HistorySuggest(const bool enable, const int delayMs=0);
 
 	// Set move/cut word delimiter, default is all not digital and alphabetic characters.
 	void  SetDelimiter (const std::string &delim);
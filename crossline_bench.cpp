@@ -0,0 +1,518 @@
+/*
+
+Benchmarks for Crossline-cpp
+* Copyright (c) 2024, John Burnell
+
+Runs the line editor in a child process on a pseudo terminal, types and pastes into it
+and times how long the output takes to come back.  The results are printed as JSON on
+stdout so they can be compared between builds.
+
+  crossline-bench [--quick]
+
+--quick uses smaller histories, pastes and files, for a check that takes a few seconds.
+The exit status is 1 if any step failed or timed out, its figures are null.
+
+Linux/Unix only, CMake builds it as crossline-bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "crossline.h"
+
+static const char *s_prompt = "B> ";
+static const int s_rows = 40;
+static const int s_cols = 160;
+
+
+/*****************************************************************************/
+
+// The child: a ReadLine loop with the history and completions asked for
+
+class BenchCompleter : public CompleterClass {
+public:
+	CompletionDict dict;
+	bool FindItems(const std::string &buf, Crossline &cLine, const int pos);
+};
+
+bool BenchCompleter::FindItems(const std::string &buf, Crossline &/*cLine*/, const int pos)
+{
+	int start = pos;
+	while ((start > 0) && (buf[start - 1] != ' ')) {
+		start--;
+	}
+	Setup(start, pos);
+	dict.Complete(*this, buf.substr(start, pos - start));
+	return Size() > 0;
+}
+
+static std::string bench_history_line(const size_t i)
+{
+	char line[128];
+	snprintf(line, sizeof(line), "select col%zu, name from table%zu where id = %zu order by col%zu",
+	         i % 31, i % 997, i, i % 7);
+	return line;
+}
+
+static void bench_child(const size_t historyNo, const size_t wordNo)
+{
+	BenchCompleter *comp = new BenchCompleter();
+	char word[32];
+	for (size_t i = 0; i < wordNo; ++i) {
+		snprintf(word, sizeof(word), "item%06zu", i);
+		comp->dict.Add(word);
+	}
+	comp->dict.Sort();
+
+	HistoryClass *his = new HistoryClass();
+	for (size_t i = 0; i < historyNo; ++i) {
+		his->Add(bench_history_line(i));
+	}
+
+	Crossline cLine(comp, his);
+	cLine.StatsEnable(true);
+	std::string buf;
+	while (cLine.ReadLine(s_prompt, buf)) {
+		// how long the keys of the line took to handle, as seen from inside
+		CrosslineStats st = cLine.GetStats();
+		printf("@@done %zu %llu %llu %llu %.1f end@@\n", buf.length(),
+		       (unsigned long long)st.keyLatency.count, (unsigned long long)st.keyLatency.Percentile(0.5),
+		       (unsigned long long)st.keyLatency.Percentile(0.99), st.findItems.Mean());
+		fflush(stdout);
+		cLine.ResetStats();
+	}
+}
+
+
+/*****************************************************************************/
+
+// The parent: the terminal end of the pty
+
+struct BenchPty {
+	int fd = -1;
+	pid_t pid = -1;
+	std::string out;        // output since the last bench_pump started
+	size_t bytes = 0;       // all output read
+};
+
+// What the child reports for each line it returns
+struct BenchLine {
+	size_t len = 0;
+	unsigned long long keys = 0, p50 = 0, p99 = 0;
+	double findUs = 0;
+};
+
+static double bench_now()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration<double>(now).count();
+}
+
+static bool bench_spawn(BenchPty &pty, const size_t historyNo, const size_t wordNo)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		return false;
+	}
+	if ((grantpt(fd) < 0) || (unlockpt(fd) < 0) || (ptsname(fd) == NULL)) {
+		close(fd);
+		return false;
+	}
+	struct winsize ws = {};
+	ws.ws_row = s_rows;
+	ws.ws_col = s_cols;
+	ioctl(fd, TIOCSWINSZ, &ws);
+	std::string slave = ptsname(fd);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fd);
+		return false;
+	}
+	if (pid == 0) {
+		close(fd);
+		setsid();
+		int s = open(slave.c_str(), O_RDWR);
+		if (s < 0) {
+			_exit(1);
+		}
+		ioctl(s, TIOCSCTTY, 0);
+		dup2(s, STDIN_FILENO);
+		dup2(s, STDOUT_FILENO);
+		dup2(s, STDERR_FILENO);
+		if (s > STDERR_FILENO) {
+			close(s);
+		}
+		bench_child(historyNo, wordNo);
+		_exit(0);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	pty.fd = fd;
+	pty.pid = pid;
+	pty.out.clear();
+	pty.bytes = 0;
+	return true;
+}
+
+static void bench_close(BenchPty &pty)
+{
+	if (pty.pid > 0) {
+		kill(pty.pid, SIGKILL);
+		waitpid(pty.pid, NULL, 0);
+	}
+	if (pty.fd >= 0) {
+		close(pty.fd);
+	}
+	pty.fd = pty.pid = -1;
+}
+
+// Send input and read the output until it has all been sent and want has been drawn, or
+// with want empty until there is any output.  Output from before the call is ignored.
+// Returns false on a timeout or if the child has gone
+static bool bench_pump(BenchPty &pty, const std::string &input, const std::string &want,
+                       const double timeout=30.0)
+{
+	size_t sent = 0;
+	size_t found = std::string::npos;
+	size_t from = 0;        // where want could start in output not searched yet
+	const size_t bytes = pty.bytes;
+	const double end = bench_now() + timeout;
+	pty.out.clear();
+	while (true) {
+		if (sent == input.length()) {
+			if (want.empty() ? (pty.bytes > bytes) : (found != std::string::npos)) {
+				return true;
+			}
+		}
+		double left = end - bench_now();
+		if ((pty.fd < 0) || (left <= 0)) {
+			return false;
+		}
+		struct pollfd pfd = {pty.fd, POLLIN, 0};
+		if (sent < input.length()) {
+			pfd.events |= POLLOUT;
+		}
+		if (poll(&pfd, 1, (int)(left * 1000) + 1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (pfd.revents & POLLIN) {
+			char buf[65536];
+			ssize_t n = read(pty.fd, buf, sizeof(buf));
+			if (n > 0) {
+				pty.out.append(buf, n);
+				pty.bytes += n;
+				// the editor only asks where the cursor is when it can't work it out
+				if (pty.out.find("\x1b[6n", from) != std::string::npos) {
+					ssize_t r = write(pty.fd, "\x1b[1;1R", 6);
+					(void) r;
+				}
+				if (found == std::string::npos) {
+					found = want.empty() ? std::string::npos : pty.out.find(want, from);
+				}
+				from = pty.out.length() - std::min(pty.out.length(), std::max<size_t>(want.length(), 4));
+			} else if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR))) {
+				return false;
+			}
+		} else if (pfd.revents & (POLLHUP | POLLERR)) {
+			return false;
+		}
+		if ((pfd.revents & POLLOUT) && (sent < input.length())) {
+			ssize_t n = write(pty.fd, input.data() + sent, input.length() - sent);
+			if (n > 0) {
+				sent += n;
+			}
+		}
+	}
+}
+
+// Send input that ends a line and read what the child reports for it.  Waits for the next
+// prompt too, until then the terminal is not raw and a long paste would be cut short
+static bool bench_line(BenchPty &pty, const std::string &input, BenchLine &line, const double timeout=60.0)
+{
+	if (!bench_pump(pty, input, "end@@", timeout)) {
+		return false;
+	}
+	size_t at = pty.out.rfind("@@done ");
+	if ((at == std::string::npos) ||
+	    (sscanf(pty.out.c_str() + at, "@@done %zu %llu %llu %llu %lf", &line.len, &line.keys,
+	            &line.p50, &line.p99, &line.findUs) != 5)) {
+		return false;
+	}
+	return (pty.out.find(s_prompt, at) != std::string::npos) || bench_pump(pty, "", s_prompt, timeout);
+}
+
+
+/*****************************************************************************/
+
+// JSON output, an object with a member for each benchmark
+
+static int s_failed = 0;
+static bool s_first = true;
+
+static bool bench_check(const bool ok)
+{
+	if (!ok) {
+		s_failed++;
+	}
+	return ok;
+}
+
+static void json_member(const char *name)
+{
+	printf("%s\n  \"%s\": ", s_first ? "{" : ",", name);
+	s_first = false;
+}
+
+static std::string json_num(const double v, const bool ok=true)
+{
+	if (!ok) {
+		return "null";
+	}
+	char st[64];
+	snprintf(st, sizeof(st), "%.3f", v);
+	return st;
+}
+
+static double bench_percentile(std::vector<double> v, const double p)
+{
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, (size_t)(p * (v.size() - 1) + 0.5))];
+}
+
+static std::string json_latency(const std::vector<double> &us, const bool ok=true)
+{
+	if (!ok || us.empty()) {
+		return "null";
+	}
+	return "{\"p50\": " + json_num(bench_percentile(us, 0.5)) + ", \"p99\": " +
+	       json_num(bench_percentile(us, 0.99)) + ", \"max\": " + json_num(bench_percentile(us, 1.0)) + "}";
+}
+
+
+/*****************************************************************************/
+
+// Keys one at a time, waiting for each to be drawn, then as many again at once
+static void bench_typing(const size_t keys)
+{
+	BenchPty pty;
+	bool ok = bench_check(bench_spawn(pty, 0, 0) && bench_pump(pty, "", s_prompt));
+
+	std::vector<double> us;
+	size_t bytes = 0;
+	double start = bench_now();
+	for (size_t i = 0; ok && (i < keys); ++i) {
+		// mostly new text, with some cursor moves and deletes
+		std::string key;
+		switch (i % 16) {
+		case 13: key = "\x1b[D"; break;
+		case 14: key = "\x1b[C"; break;
+		case 15: key = "\x7f"; break;
+		default: key = std::string(1, (char)('a' + (i % 26))); break;
+		}
+		size_t before = pty.bytes;
+		double t = bench_now();
+		ok = bench_check(bench_pump(pty, key, ""));
+		us.push_back((bench_now() - t) * 1e6);
+		bytes += pty.bytes - before;
+	}
+	double elapsed = bench_now() - start;
+	BenchLine line, burstLine;
+	ok = ok && bench_check(bench_line(pty, "\r", line));
+
+	std::string burst;
+	for (size_t i = 0; i < keys; ++i) {
+		burst += (char)('a' + (i % 26));
+	}
+	start = bench_now();
+	bool burstOk = ok && bench_check(bench_line(pty, burst + "\r", burstLine) && (burstLine.len == keys));
+	double burstElapsed = bench_now() - start;
+	bench_close(pty);
+
+	json_member("typing");
+	printf("{\"keys\": %zu, \"keys_per_sec\": %s, \"bytes_per_key\": %s, \"key_latency_us\": %s, "
+	       "\"handle_us_p50\": %s, \"handle_us_p99\": %s, \"burst_keys_per_sec\": %s}",
+	       keys, json_num(keys / elapsed, ok).c_str(), json_num((double)bytes / keys, ok).c_str(),
+	       json_latency(us, ok).c_str(), json_num(line.p50, ok).c_str(), json_num(line.p99, ok).c_str(),
+	       json_num(keys / burstElapsed, burstOk).c_str());
+}
+
+// Bracketed pastes of each size, from the first byte sent to the line coming back
+static void bench_paste(const std::vector<size_t> &sizes)
+{
+	BenchPty pty;
+	bool ok = bench_check(bench_spawn(pty, 0, 0) && bench_pump(pty, "", s_prompt));
+
+	json_member("paste");
+	printf("[");
+	for (size_t i = 0; i < sizes.size(); ++i) {
+		std::string text(sizes[i], ' ');
+		for (size_t j = 0; j < text.length(); ++j) {
+			if (j % 8 != 7) {
+				text[j] = (char)('a' + (j % 26));
+			}
+		}
+		BenchLine line;
+		size_t before = pty.bytes;
+		double start = bench_now();
+		bool pasted = ok && bench_check(bench_line(pty, "\x1b[200~" + text + "\x1b[201~\r", line, 120.0) &&
+		                                (line.len == sizes[i]));
+		double elapsed = bench_now() - start;
+		printf("%s{\"bytes\": %zu, \"ms\": %s, \"mb_per_sec\": %s, \"output_bytes\": %zu}", i ? ", " : "",
+		       sizes[i], json_num(elapsed * 1e3, pasted).c_str(),
+		       json_num(sizes[i] / elapsed / (1 << 20), pasted).c_str(), pty.bytes - before);
+		ok = pasted;
+	}
+	printf("]");
+	bench_close(pty);
+}
+
+// Ctrl-R over histories of each size, the time for each pattern key to be drawn
+static void bench_search(const std::vector<size_t> &entries, const int rounds)
+{
+	const std::string pattern = "where id = 4242";
+	json_member("history_search");
+	printf("[");
+	for (size_t i = 0; i < entries.size(); ++i) {
+		BenchPty pty;
+		bool ok = bench_check(bench_spawn(pty, entries[i], 0) && bench_pump(pty, "", s_prompt, 600.0));
+		std::vector<double> first, all;
+		for (int r = 0; ok && (r < rounds); ++r) {
+			ok = bench_check(bench_pump(pty, "\x12", "`': "));
+			for (size_t k = 1; ok && (k <= pattern.length()); ++k) {
+				double start = bench_now();
+				ok = bench_check(bench_pump(pty, pattern.substr(k - 1, 1), "`" + pattern.substr(0, k) + "': "));
+				double us = (bench_now() - start) * 1e6;
+				all.push_back(us);
+				if (k == 1) {
+					first.push_back(us);
+				}
+			}
+			ok = ok && bench_check(bench_pump(pty, "\x07", s_prompt));
+		}
+		bench_close(pty);
+		printf("%s{\"entries\": %zu, \"first_key_us\": %s, \"key_us\": %s}", i ? ", " : "", entries[i],
+		       json_latency(first, ok).c_str(), json_latency(all, ok).c_str());
+	}
+	printf("]");
+}
+
+// Tab with words candidates, to the completion menu being drawn
+static void bench_completion(const size_t words, const int rounds)
+{
+	BenchPty pty;
+	bool ok = bench_check(bench_spawn(pty, 0, words) && bench_pump(pty, "", s_prompt, 120.0));
+	const std::string shown = "of " + std::to_string(words);
+	std::vector<double> us;
+	double findUs = 0;
+	int finds = 0;      // later rounds can be answered from the completion cache
+	for (int r = 0; ok && (r < rounds); ++r) {
+		// next to the Tab the two letters take no time
+		double start = bench_now();
+		ok = bench_check(bench_pump(pty, "it\t", shown));
+		us.push_back((bench_now() - start) * 1e6);
+		BenchLine line;
+		// leave the menu and end the line, ReadLine gives false for an empty one
+		ok = ok && bench_check(bench_line(pty, "\x07\x15x\r", line));
+		if (line.findUs > 0) {
+			findUs += line.findUs;
+			finds++;
+		}
+	}
+	bench_close(pty);
+
+	json_member("completion");
+	printf("{\"candidates\": %zu, \"tab_us\": %s, \"find_items_us\": %s}", words,
+	       json_latency(us, ok).c_str(), json_num(finds ? findUs / finds : 0, ok).c_str());
+}
+
+// HistoryLoad and HistoryMap of a file of about fileBytes
+static void bench_load(const size_t fileBytes)
+{
+	const char *dir = getenv("TMPDIR");
+	std::string name = std::string(dir ? dir : "/tmp") + "/crossline-bench-XXXXXX";
+	std::vector<char> path(name.begin(), name.end());
+	path.push_back('\0');
+	int fd = mkstemp(path.data());
+	FILE *fp = (fd >= 0) ? fdopen(fd, "w") : NULL;
+	bool ok = bench_check(fp != NULL);
+	size_t lines = 0, bytes = 0;
+	while (ok && (bytes < fileBytes)) {
+		std::string line = bench_history_line(lines++) + "\n";
+		fwrite(line.data(), 1, line.length(), fp);
+		bytes += line.length();
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	double loadMs = 0, mapFirstMs = 0, mapMs = 0;
+	size_t loaded = 0;
+	if (ok) {
+		HistoryClass his;
+		double start = bench_now();
+		ok = bench_check(his.HistoryLoad(path.data()) == 0);
+		loadMs = (bench_now() - start) * 1e3;
+		loaded = his.Size();
+	}
+	if (ok) {
+		HistoryClass his;
+		double start = bench_now();
+		ok = bench_check(his.HistoryMap(path.data()) == 0);
+		mapFirstMs = (bench_now() - start) * 1e3;
+		his.HistorySync(true);
+		mapMs = (bench_now() - start) * 1e3;
+		ok = bench_check(ok && ((size_t)his.Size() == loaded));
+	}
+	if (fd >= 0) {
+		unlink(path.data());
+	}
+
+	json_member("history_load");
+	printf("{\"bytes\": %zu, \"entries\": %zu, \"load_ms\": %s, \"map_first_ms\": %s, \"map_ms\": %s}",
+	       bytes, lines, json_num(loadMs, ok).c_str(), json_num(mapFirstMs, ok).c_str(),
+	       json_num(mapMs, ok).c_str());
+}
+
+
+int main(int argc, char **argv)
+{
+	bool quick = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--quick") == 0) {
+			quick = true;
+		} else {
+			fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+			return 2;
+		}
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	json_member("quick");
+	printf("%s", quick ? "true" : "false");
+	bench_typing(quick ? 200 : 2000);
+	bench_paste(quick ? std::vector<size_t>{1 << 10, 64 << 10} :
+	                    std::vector<size_t>{1 << 10, 64 << 10, 1 << 20});
+	bench_search(quick ? std::vector<size_t>{10000} : std::vector<size_t>{10000, 1000000}, quick ? 1 : 3);
+	bench_completion(quick ? 10000 : 100000, quick ? 2 : 5);
+	bench_load(quick ? (8 << 20) : (100 << 20));
+	json_member("failed");
+	printf("%d\n}\n", s_failed);
+	return s_failed ? 1 : 0;
+}
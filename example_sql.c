@@ -31,6 +31,7 @@ gcc -Wall crossline.c example_sql.c -o example_sql
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "crossline.h"
 
 #ifdef _WIN32
@@ -39,12 +40,16 @@ gcc -Wall crossline.c example_sql.c -o example_sql
 #endif
 
 
+// Each keyword table is loaded into a CompletionDict the first time it is completed,
+// the words are shown in the order of the table
 void sql_add_completion (CompleterClass &completions, const char *prefix, const char **match, const char **help)
 {
-	int i, len = (int)strlen(prefix);
+	static std::map<const char **, CompletionDict> dicts;
+	CompletionDict &dict = dicts[match];
+	int i;
 	crossline_color_e wcolor, hcolor;
-	for (i = 0;  NULL != match[i]; ++i) {
-		if (0 == strncasecmp(prefix, match[i], len)) {
+	if (0 == dict.Size()) {
+		for (i = 0;  NULL != match[i]; ++i) {
 			if (NULL != help) {
 				if (i < 8) { 
 					wcolor = CROSSLINE_FGCOLOR_BRIGHT | CROSSLINE_FGCOLOR_YELLOW; 
@@ -52,12 +57,13 @@ void sql_add_completion (CompleterClass &completions, const char *prefix, const
 					wcolor = CROSSLINE_FGCOLOR_BRIGHT | CROSSLINE_FGCOLOR_CYAN; 
 				}
 				hcolor = i%2 ? CROSSLINE_FGCOLOR_WHITE : CROSSLINE_FGCOLOR_CYAN;
-				completions.Add(match[i], help[i], false, wcolor, hcolor);
+				dict.Add(match[i], help[i], false, wcolor, hcolor);
 			} else {
-				completions.Add(match[i], "", false, CROSSLINE_FGCOLOR_BRIGHT | CROSSLINE_FGCOLOR_MAGENTA);
+				dict.Add(match[i], "", false, CROSSLINE_FGCOLOR_BRIGHT | CROSSLINE_FGCOLOR_MAGENTA);
 			}
 		}
 	}
+	dict.Complete(completions, prefix, true);
 }
 
 int sql_find_key (const char **match, const char *prefix)
@@ -249,12 +255,60 @@ bool SQLCompleter::FindItems(const std::string &buf, Crossline &cLine, const int
 }
 
 
+// Keywords in yellow, numbers in magenta and quoted strings in green.  State 1 is inside a string
+class SQLHighlighter : public HighlighterClass {
+public:
+	virtual size_t Token(const std::string_view &text, int &state, crossline_color_e &color);
+};
+
+size_t SQLHighlighter::Token(const std::string_view &text, int &state, crossline_color_e &color)
+{
+	static const char* sql_keys[] = {"INSERT", "SELECT", "UPDATE", "DELETE", "CREATE", "DROP", "SHOW", "DESCRIBE",
+	                                 "INTO", "SET", "FROM", "WHERE", "ORDER", "BY", "LIMIT", "OFFSET", "UNIQUE",
+	                                 "INDEX", "ON", "TABLE", "TABLES", "DATABASES", NULL};
+	size_t len = 0;
+	if ((1 == state) || ('\'' == text[0])) {
+		len = (1 == state) ? 0 : 1;
+		while ((len < text.length()) && ('\'' != text[len])) {
+			len++;
+		}
+		state = (len < text.length()) ? 0 : 1;	// still in the string if the quote isn't in text
+		color = CROSSLINE_FGCOLOR_GREEN;
+		return std::min(len + 1, text.length());
+	}
+	if (isdigit((unsigned char)text[0])) {
+		while ((len < text.length()) && isdigit((unsigned char)text[len])) {
+			len++;
+		}
+		color = CROSSLINE_FGCOLOR_MAGENTA;
+	} else if (isalpha((unsigned char)text[0])) {
+		char word[16];
+		while ((len < text.length()) && (isalnum((unsigned char)text[len]) || ('_' == text[len]))) {
+			len++;
+		}
+		color = CROSSLINE_COLOR_DEFAULT;
+		if (len < sizeof(word)) {
+			memcpy(word, text.data(), len);
+			word[len] = '\0';
+			if (sql_find_key(sql_keys, word) >= 0) {
+				color = CROSSLINE_FGCOLOR_BRIGHT | CROSSLINE_FGCOLOR_YELLOW;
+			}
+		}
+	} else {
+		len = 1;
+		color = CROSSLINE_COLOR_DEFAULT;
+	}
+	return len;
+}
+
+
 int main ()
 {
 
 	SQLCompleter *comp = new SQLCompleter();
     HistoryClass *his = new HistoryClass();
     Crossline cLine(comp, his);
+	cLine.HighlighterSet(new SQLHighlighter());
 
 	// crossline_completion_register (sql_completion_hook);
 	his->HistoryLoad ("history.txt");